@@ -0,0 +1,288 @@
+/*
+ * cpio_format_bench - microbenchmark the header codec.
+ *
+ * This times cpio_header_serialise() and cpio_header_deserialise(),
+ * and their non-allocating _into() variants, over a pool of synthetic
+ * headers with a realistic spread of name lengths, and counts how
+ * many allocations each call makes.
+ *
+ * Allocations are counted by wrapping the allocator at link time
+ * (-Wl,--wrap); where that isn't available they're reported as -1.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <string.h>
+#include <err.h>
+#include <time.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "../xcpio/cpio_format.h"
+
+#define	BENCH_POOL_SIZE		4096
+
+static uint64_t bench_allocs;
+static bool bench_counting;
+
+#ifdef	BENCH_WRAP_ALLOC
+extern	void * __real_malloc(size_t);
+extern	void * __real_calloc(size_t, size_t);
+extern	void * __real_realloc(void *, size_t);
+extern	char * __real_strdup(const char *);
+extern	char * __real_strndup(const char *, size_t);
+
+void *
+__wrap_malloc(size_t size)
+{
+
+	if (bench_counting)
+		bench_allocs++;
+	return (__real_malloc(size));
+}
+
+void *
+__wrap_calloc(size_t n, size_t size)
+{
+
+	if (bench_counting)
+		bench_allocs++;
+	return (__real_calloc(n, size));
+}
+
+void *
+__wrap_realloc(void *p, size_t size)
+{
+
+	if (bench_counting)
+		bench_allocs++;
+	return (__real_realloc(p, size));
+}
+
+char *
+__wrap_strdup(const char *s)
+{
+
+	if (bench_counting)
+		bench_allocs++;
+	return (__real_strdup(s));
+}
+
+char *
+__wrap_strndup(const char *s, size_t n)
+{
+
+	if (bench_counting)
+		bench_allocs++;
+	return (__real_strndup(s, n));
+}
+#endif
+
+/* xorshift64*; the same generator as xcpio_bench */
+static uint64_t bench_rng_state = 1;
+
+static uint64_t
+bench_rng(void)
+{
+	uint64_t x = bench_rng_state;
+
+	x ^= x >> 12;
+	x ^= x << 25;
+	x ^= x >> 27;
+	bench_rng_state = x;
+	return (x * 0x2545f4914f6cdd1dULL);
+}
+
+static double
+bench_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec + ts.tv_nsec / 1e9);
+}
+
+/*
+ * Pick a path length.  Most paths in an embedded rootfs are short
+ * to medium; a few are long.
+ */
+static int
+bench_name_len(void)
+{
+	uint64_t r = bench_rng() % 100;
+
+	if (r < 60)
+		return (8 + bench_rng() % 32);
+	if (r < 90)
+		return (40 + bench_rng() % 60);
+	return (100 + bench_rng() % 156);
+}
+
+static void
+bench_name(char *buf, int len)
+{
+	static const char chars[] =
+	    "abcdefghijklmnopqrstuvwxyz0123456789_-.";
+	int i;
+
+	for (i = 0; i < len; i++) {
+		if ((i > 0) && (i < len - 1) && (bench_rng() % 10 == 0))
+			buf[i] = '/';
+		else
+			buf[i] = chars[bench_rng() % (sizeof(chars) - 1)];
+	}
+	buf[len] = '\0';
+}
+
+static void
+bench_report(const char *op, uint64_t n, double seconds, uint64_t bytes)
+{
+
+	printf("{\"op\":\"%s\",\"headers\":%llu,\"seconds\":%.6f,"
+	    "\"ns_per_header\":%.2f,\"mb_per_sec\":%.3f,"
+	    "\"allocs_per_header\":%.3f}\n",
+	    op, (unsigned long long) n, seconds,
+	    seconds * 1e9 / n,
+	    seconds > 0 ? bytes / seconds / 1e6 : 0.0,
+#ifdef	BENCH_WRAP_ALLOC
+	    (double) bench_allocs / n
+#else
+	    -1.0
+#endif
+	    );
+}
+
+static void
+usage(void)
+{
+	printf("Usage: cpio_format_bench [-n <headers>] [-s <seed>]\n");
+	printf("  -n <headers> : number of headers to encode/decode (default 1000000)\n");
+	printf("  -s <seed>    : random seed for the synthetic headers (default 1)\n");
+	exit(127);
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct cpio_header *pool[BENCH_POOL_SIZE];
+	char *enc[BENCH_POOL_SIZE];
+	int enc_len[BENCH_POOL_SIZE];
+	struct cpio_header *h, hdr;
+	char name[256], out[CPIO_HEADER_SIZE + 256];
+	struct stat sb;
+	uint64_t n = 1000000, i, bytes;
+	double start;
+	char *buf;
+	int ch, len, r;
+
+	while ((ch = getopt(argc, argv, "n:s:")) != -1) {
+		switch (ch) {
+		case 'n':
+			n = strtoull(optarg, NULL, 0);
+			if (n == 0)
+				usage();
+			break;
+		case 's':
+			bench_rng_state = strtoull(optarg, NULL, 0);
+			if (bench_rng_state == 0)
+				bench_rng_state = 1;
+			break;
+		default:
+			usage();
+			break;
+		}
+	}
+
+	/* Build the pool of headers and their encoded forms */
+	for (i = 0; i < BENCH_POOL_SIZE; i++) {
+		bzero(&sb, sizeof(sb));
+		sb.st_dev = bench_rng() & 0xffff;
+		sb.st_ino = bench_rng() & 0x3ffff;
+		sb.st_mode = (bench_rng() % 8 == 0) ? (S_IFDIR | 0755) :
+		    (S_IFREG | 0644);
+		sb.st_uid = bench_rng() % 1000;
+		sb.st_gid = bench_rng() % 1000;
+		sb.st_nlink = 1;
+		sb.st_mtime = 1500000000 + bench_rng() % 100000000;
+		sb.st_size = S_ISREG(sb.st_mode) ? bench_rng() % 1000000 : 0;
+
+		len = bench_name_len();
+		bench_name(name, len);
+		pool[i] = cpio_header_create(&sb, name);
+		if (pool[i] == NULL)
+			errx(1, "cpio_header_create");
+		enc[i] = cpio_header_serialise(-1, pool[i], &enc_len[i]);
+		if (enc[i] == NULL)
+			errx(1, "cpio_header_serialise");
+	}
+
+	/* Encode */
+	bytes = 0;
+	bench_allocs = 0;
+	bench_counting = true;
+	start = bench_now();
+	for (i = 0; i < n; i++) {
+		buf = cpio_header_serialise(-1, pool[i % BENCH_POOL_SIZE],
+		    &len);
+		if (buf == NULL)
+			errx(1, "cpio_header_serialise");
+		bytes += len;
+		free(buf);
+	}
+	bench_counting = false;
+	bench_report("serialise", n, bench_now() - start, bytes);
+
+	/* Decode */
+	bytes = 0;
+	bench_allocs = 0;
+	bench_counting = true;
+	start = bench_now();
+	for (i = 0; i < n; i++) {
+		r = cpio_header_deserialise(enc[i % BENCH_POOL_SIZE],
+		    enc_len[i % BENCH_POOL_SIZE], &h);
+		if (r <= 0)
+			errx(1, "cpio_header_deserialise");
+		bytes += r;
+		cpio_header_free(h);
+	}
+	bench_counting = false;
+	bench_report("deserialise", n, bench_now() - start, bytes);
+
+	/* And again, into caller buffers */
+	bytes = 0;
+	bench_allocs = 0;
+	bench_counting = true;
+	start = bench_now();
+	for (i = 0; i < n; i++) {
+		r = cpio_header_serialise_into(pool[i % BENCH_POOL_SIZE],
+		    out, sizeof(out));
+		if (r < 0)
+			errx(1, "cpio_header_serialise_into");
+		bytes += r;
+	}
+	bench_counting = false;
+	bench_report("serialise_into", n, bench_now() - start, bytes);
+
+	bytes = 0;
+	bench_allocs = 0;
+	bench_counting = true;
+	start = bench_now();
+	for (i = 0; i < n; i++) {
+		r = cpio_header_deserialise_into(enc[i % BENCH_POOL_SIZE],
+		    enc_len[i % BENCH_POOL_SIZE], &hdr, name, sizeof(name));
+		if (r <= 0)
+			errx(1, "cpio_header_deserialise_into");
+		bytes += r;
+	}
+	bench_counting = false;
+	bench_report("deserialise_into", n, bench_now() - start, bytes);
+
+	for (i = 0; i < BENCH_POOL_SIZE; i++) {
+		cpio_header_free(pool[i]);
+		free(enc[i]);
+	}
+	exit(0);
+}
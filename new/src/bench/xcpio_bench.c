@@ -0,0 +1,573 @@
+/*
+ * xcpio_bench - generate reproducible source trees and time xcpio
+ * creating, listing and extracting them across block sizes.
+ *
+ * Results are printed one JSON object per line so they can be
+ * collected and compared between builds.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <string.h>
+#include <err.h>
+#include <fcntl.h>
+#include <time.h>
+#include <ftw.h>
+#include <limits.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#ifndef	XCPIO_PATH
+#define	XCPIO_PATH	"xcpio"
+#endif
+
+#ifndef	__unused
+#define	__unused	__attribute__((__unused__))
+#endif
+
+/* The largest -S; keeps the size skew from overflowing */
+#define	BENCH_MAX_SIZE	(4ULL * 1024 * 1024 * 1024)
+
+typedef enum {
+	BENCH_PROFILE_TINY,	/* lots of small files */
+	BENCH_PROFILE_LARGE,	/* a few big files */
+	BENCH_PROFILE_DEEP,	/* deeply nested directories */
+	BENCH_PROFILE_SPARSE,	/* big files that are mostly holes */
+} bench_profile;
+
+static const char *bench_profile_names[] = {
+	"tiny", "large", "deep", "sparse",
+};
+
+struct bench_opts {
+	const char *xcpio;
+	const char *workdir;
+	uint64_t seed;
+	int nfiles;		/* 0 means the profile default */
+	uint64_t max_size;	/* 0 means the profile default */
+	int depth;
+	int block_sizes[16];
+	int nblock_sizes;
+	bool profiles[4];
+};
+
+/*
+ * What a generated tree looks like, for the throughput numbers.
+ */
+struct bench_tree {
+	uint64_t entries;
+	uint64_t bytes;
+};
+
+/*
+ * The result of running xcpio once.
+ */
+struct bench_result {
+	double seconds;
+	long peak_rss_kb;
+	long long syscalls;	/* read/write family only; -1 if unknown */
+	int status;
+};
+
+/* xorshift64*; small and good enough for reproducible trees */
+static uint64_t bench_rng_state;
+
+static uint64_t
+bench_rng(void)
+{
+	uint64_t x = bench_rng_state;
+
+	x ^= x >> 12;
+	x ^= x << 25;
+	x ^= x >> 27;
+	bench_rng_state = x;
+	return (x * 0x2545f4914f6cdd1dULL);
+}
+
+static uint64_t
+bench_rng_range(uint64_t lo, uint64_t hi)
+{
+
+	if (hi <= lo)
+		return (lo);
+	return (lo + bench_rng() % (hi - lo + 1));
+}
+
+static double
+bench_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec + ts.tv_nsec / 1e9);
+}
+
+static int
+bench_rm_cb(const char *path, const struct stat *sb __unused,
+    int flag __unused, struct FTW *f __unused)
+{
+
+	if (remove(path) != 0)
+		warn("remove (%s)", path);
+	return (0);
+}
+
+/*
+ * rm -rf
+ */
+static void
+bench_rmtree(const char *path)
+{
+	struct stat sb;
+
+	if (lstat(path, &sb) != 0)
+		return;
+	(void) nftw(path, bench_rm_cb, 64, FTW_DEPTH | FTW_PHYS);
+}
+
+/*
+ * Write a file of the given size filled with pseudo-random data.
+ * If sparse is true then only a few small chunks are written and
+ * the rest is left as holes.
+ */
+static int
+bench_write_file(const char *path, uint64_t size, bool sparse)
+{
+	char buf[65536];
+	uint64_t off, n;
+	size_t i;
+	int fd, k;
+
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		warn("open (%s)", path);
+		return (-1);
+	}
+
+	if (sparse) {
+		if (ftruncate(fd, size) != 0) {
+			warn("ftruncate (%s)", path);
+			close(fd);
+			return (-1);
+		}
+		for (k = 0; (k < 4) && (size > 0); k++) {
+			for (i = 0; i < 4096; i += 8) {
+				uint64_t v = bench_rng();
+				memcpy(buf + i, &v, 8);
+			}
+			off = bench_rng_range(0, size - 1);
+			n = size - off < 4096 ? size - off : 4096;
+			if (pwrite(fd, buf, n, off) != (ssize_t) n) {
+				warn("pwrite (%s)", path);
+				close(fd);
+				return (-1);
+			}
+		}
+		close(fd);
+		return (0);
+	}
+
+	for (off = 0; off < size; off += n) {
+		n = size - off < sizeof(buf) ? size - off : sizeof(buf);
+		for (i = 0; i < n; i += 8) {
+			uint64_t v = bench_rng();
+			memcpy(buf + i, &v, 8);
+		}
+		if (write(fd, buf, n) != (ssize_t) n) {
+			warn("write (%s)", path);
+			close(fd);
+			return (-1);
+		}
+	}
+	close(fd);
+	return (0);
+}
+
+/*
+ * Generate a source tree for the given profile under 'src' and a
+ * manifest listing it (directories before their contents) in 'manifest'.
+ */
+static int
+bench_generate(const struct bench_opts *o, bench_profile p, const char *src,
+    const char *manifest, struct bench_tree *t)
+{
+	char dir[PATH_MAX], path[PATH_MAX], full[PATH_MAX * 2];
+	uint64_t max_size, size;
+	int nfiles, ndirs, i, d;
+	FILE *fp;
+
+	bench_rng_state = o->seed ^ ((uint64_t) p + 1) * 0x9e3779b97f4a7c15ULL;
+	if (bench_rng_state == 0)
+		bench_rng_state = 1;
+
+	switch (p) {
+	case BENCH_PROFILE_TINY:
+		nfiles = 20000;
+		max_size = 4096;
+		ndirs = 64;
+		break;
+	case BENCH_PROFILE_LARGE:
+		nfiles = 8;
+		max_size = 64ULL * 1024 * 1024;
+		ndirs = 1;
+		break;
+	case BENCH_PROFILE_DEEP:
+		nfiles = 2000;
+		max_size = 16384;
+		ndirs = o->depth;
+		break;
+	case BENCH_PROFILE_SPARSE:
+	default:
+		nfiles = 16;
+		max_size = 256ULL * 1024 * 1024;
+		ndirs = 1;
+		break;
+	}
+	if (o->nfiles > 0)
+		nfiles = o->nfiles;
+	if (o->max_size > 0)
+		max_size = o->max_size;
+
+	bzero(t, sizeof(*t));
+	bench_rmtree(src);
+	if (mkdir(src, 0755) != 0) {
+		warn("mkdir (%s)", src);
+		return (-1);
+	}
+
+	fp = fopen(manifest, "w");
+	if (fp == NULL) {
+		warn("fopen (%s)", manifest);
+		return (-1);
+	}
+
+	/*
+	 * The deep profile is one chain of nested directories; the
+	 * others are a flat set of directories.
+	 */
+	dir[0] = '\0';
+	for (d = 0; d < ndirs; d++) {
+		if (p == BENCH_PROFILE_DEEP) {
+			if (d == 0) {
+				snprintf(path, sizeof(path), "d%d", d);
+			} else if (snprintf(path, sizeof(path), "%s/d%d", dir,
+			    d) >= (int) sizeof(path)) {
+				warnx("path too long at depth %d", d);
+				fclose(fp);
+				return (-1);
+			}
+			snprintf(dir, sizeof(dir), "%s", path);
+		} else {
+			snprintf(path, sizeof(path), "d%d", d);
+		}
+		snprintf(full, sizeof(full), "%s/%s", src, path);
+		if (mkdir(full, 0755) != 0) {
+			warn("mkdir (%s)", full);
+			fclose(fp);
+			return (-1);
+		}
+		fprintf(fp, "%s\n", path);
+		t->entries++;
+	}
+
+	for (i = 0; i < nfiles; i++) {
+		d = bench_rng_range(0, ndirs - 1);
+		if (p == BENCH_PROFILE_DEEP) {
+			/* Rebuild the chain prefix down to depth d */
+			int k;
+
+			snprintf(dir, sizeof(dir), "d0");
+			for (k = 1; k <= d; k++) {
+				if (snprintf(path, sizeof(path), "%s/d%d",
+				    dir, k) >= (int) sizeof(path)) {
+					warnx("path too long at depth %d", k);
+					fclose(fp);
+					return (-1);
+				}
+				snprintf(dir, sizeof(dir), "%s", path);
+			}
+		} else {
+			snprintf(dir, sizeof(dir), "d%d", d);
+		}
+		if (snprintf(path, sizeof(path), "%s/f%d", dir, i) >=
+		    (int) sizeof(path)) {
+			warnx("path too long for file %d", i);
+			fclose(fp);
+			return (-1);
+		}
+		snprintf(full, sizeof(full), "%s/%s", src, path);
+
+		/*
+		 * Skew towards smaller files.  With max_size capped at
+		 * BENCH_MAX_SIZE the product fits in 64 bits.
+		 */
+		size = bench_rng_range(0, max_size);
+		if (p == BENCH_PROFILE_TINY || p == BENCH_PROFILE_DEEP)
+			size = size * (size / 2 + 1) / (max_size / 2 + 1);
+
+		if (bench_write_file(full, size,
+		    p == BENCH_PROFILE_SPARSE) != 0) {
+			fclose(fp);
+			return (-1);
+		}
+		fprintf(fp, "%s\n", path);
+		t->entries++;
+		t->bytes += size;
+	}
+
+	fclose(fp);
+	return (0);
+}
+
+/*
+ * Count read/write family syscalls for a child that has exited but
+ * not yet been reaped.  This is only available on Linux.
+ */
+static long long
+bench_child_syscalls(pid_t pid)
+{
+#ifdef	__linux__
+	char path[64], line[128];
+	long long syscr = -1, syscw = -1;
+	FILE *fp;
+
+	snprintf(path, sizeof(path), "/proc/%d/io", (int) pid);
+	fp = fopen(path, "r");
+	if (fp == NULL)
+		return (-1);
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		sscanf(line, "syscr: %lld", &syscr);
+		sscanf(line, "syscw: %lld", &syscw);
+	}
+	fclose(fp);
+	if (syscr < 0 || syscw < 0)
+		return (-1);
+	return (syscr + syscw);
+#else
+	return (-1);
+#endif
+}
+
+/*
+ * Run xcpio with the given arguments, with its output discarded.
+ */
+static int
+bench_run(const struct bench_opts *o, char * const argv[],
+    struct bench_result *r)
+{
+	struct rusage ru;
+	siginfo_t si;
+	double start;
+	pid_t pid;
+	int fd, status;
+
+	bzero(r, sizeof(*r));
+	r->syscalls = -1;
+
+	start = bench_now();
+	pid = fork();
+	if (pid < 0) {
+		warn("fork");
+		return (-1);
+	}
+	if (pid == 0) {
+		fd = open("/dev/null", O_RDWR);
+		if (fd >= 0) {
+			dup2(fd, STDOUT_FILENO);
+			dup2(fd, STDERR_FILENO);
+		}
+		execv(o->xcpio, argv);
+		_exit(127);
+	}
+
+	/* Wait for it to exit but leave it around to be inspected */
+	bzero(&si, sizeof(si));
+	if (waitid(P_PID, pid, &si, WEXITED | WNOWAIT) == 0) {
+		r->seconds = bench_now() - start;
+		r->syscalls = bench_child_syscalls(pid);
+	}
+	if (wait4(pid, &status, 0, &ru) < 0) {
+		warn("wait4");
+		return (-1);
+	}
+	if (r->seconds == 0)
+		r->seconds = bench_now() - start;
+	r->peak_rss_kb = ru.ru_maxrss;
+	r->status = WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+	return (0);
+}
+
+static void
+bench_report(bench_profile p, const char *op, int block_size,
+    const struct bench_tree *t, const struct bench_result *r)
+{
+
+	printf("{\"profile\":\"%s\",\"op\":\"%s\",\"block_size\":%d,"
+	    "\"entries\":%llu,\"bytes\":%llu,\"seconds\":%.6f,"
+	    "\"mb_per_sec\":%.3f,\"entries_per_sec\":%.1f,"
+	    "\"rw_syscalls\":%lld,\"rw_syscalls_per_entry\":%.3f,"
+	    "\"peak_rss_kb\":%ld,\"exit_status\":%d}\n",
+	    bench_profile_names[p], op, block_size,
+	    (unsigned long long) t->entries,
+	    (unsigned long long) t->bytes,
+	    r->seconds,
+	    r->seconds > 0 ? t->bytes / r->seconds / 1e6 : 0.0,
+	    r->seconds > 0 ? t->entries / r->seconds : 0.0,
+	    r->syscalls,
+	    (r->syscalls >= 0 && t->entries > 0) ?
+	      (double) r->syscalls / t->entries : -1.0,
+	    r->peak_rss_kb, r->status);
+	fflush(stdout);
+}
+
+static int
+bench_profile_run(const struct bench_opts *o, bench_profile p)
+{
+	char src[PATH_MAX], dst[PATH_MAX], manifest[PATH_MAX];
+	char archive[PATH_MAX], bs[32];
+	struct bench_tree t;
+	struct bench_result r;
+	int i;
+
+	snprintf(src, sizeof(src), "%s/src-%s", o->workdir,
+	    bench_profile_names[p]);
+	snprintf(dst, sizeof(dst), "%s/dst-%s", o->workdir,
+	    bench_profile_names[p]);
+	snprintf(manifest, sizeof(manifest), "%s/manifest-%s.txt", o->workdir,
+	    bench_profile_names[p]);
+	snprintf(archive, sizeof(archive), "%s/archive-%s.cpio", o->workdir,
+	    bench_profile_names[p]);
+
+	if (bench_generate(o, p, src, manifest, &t) != 0) {
+		return (-1);
+	}
+
+	for (i = 0; i < o->nblock_sizes; i++) {
+		snprintf(bs, sizeof(bs), "%d", o->block_sizes[i]);
+
+		char *create[] = { "xcpio", "-c", "-b", bs, "-d", src,
+		    "-m", manifest, "-f", archive, NULL };
+		char *list[] = { "xcpio", "-l", "-b", bs, "-f", archive, NULL };
+		char *extract[] = { "xcpio", "-e", "-b", bs, "-d", dst,
+		    "-f", archive, NULL };
+
+		unlink(archive);
+		if (bench_run(o, create, &r) != 0)
+			return (-1);
+		bench_report(p, "create", o->block_sizes[i], &t, &r);
+
+		if (bench_run(o, list, &r) != 0)
+			return (-1);
+		bench_report(p, "list", o->block_sizes[i], &t, &r);
+
+		bench_rmtree(dst);
+		if (mkdir(dst, 0755) != 0) {
+			warn("mkdir (%s)", dst);
+			return (-1);
+		}
+		if (bench_run(o, extract, &r) != 0)
+			return (-1);
+		bench_report(p, "extract", o->block_sizes[i], &t, &r);
+	}
+
+	bench_rmtree(dst);
+	bench_rmtree(src);
+	unlink(archive);
+	unlink(manifest);
+	return (0);
+}
+
+static void
+usage(void)
+{
+	printf("Usage: xcpio_bench [-x <xcpio>] [-w <workdir>] [-s <seed>] [-p <profile>]\n");
+	printf("                   [-n <files>] [-S <max size>] [-D <depth>] [-b <blocksize>]\n");
+	printf("  -b <blocksize> : block size to test; may be repeated (default 512, 4096, 65536)\n");
+	printf("  -D <depth>     : directory depth for the deep profile (default 32)\n");
+	printf("  -n <files>     : number of files to generate\n");
+	printf("  -p <profile>   : tiny, large, deep or sparse; may be repeated (default all)\n");
+	printf("  -s <seed>      : random seed for the generated trees (default 1)\n");
+	printf("  -S <max size>  : maximum file size in bytes (at most 4GiB)\n");
+	printf("  -w <workdir>   : scratch directory (default .)\n");
+	printf("  -x <xcpio>     : xcpio binary to run (default %s)\n", XCPIO_PATH);
+	exit(127);
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct bench_opts o;
+	bool any_profile = false;
+	int ch, i, ret = 0;
+
+	bzero(&o, sizeof(o));
+	o.xcpio = XCPIO_PATH;
+	o.workdir = ".";
+	o.seed = 1;
+	o.depth = 32;
+
+	while ((ch = getopt(argc, argv, "b:D:n:p:s:S:w:x:")) != -1) {
+		switch (ch) {
+		case 'b':
+			if (o.nblock_sizes == 16)
+				usage();
+			o.block_sizes[o.nblock_sizes++] = atoi(optarg);
+			break;
+		case 'D':
+			o.depth = atoi(optarg);
+			if (o.depth < 1)
+				usage();
+			break;
+		case 'n':
+			o.nfiles = atoi(optarg);
+			break;
+		case 'p':
+			for (i = 0; i < 4; i++) {
+				if (strcmp(optarg, bench_profile_names[i]) == 0)
+					break;
+			}
+			if (i == 4)
+				usage();
+			o.profiles[i] = true;
+			any_profile = true;
+			break;
+		case 's':
+			o.seed = strtoull(optarg, NULL, 0);
+			break;
+		case 'S':
+			o.max_size = strtoull(optarg, NULL, 0);
+			if (o.max_size > BENCH_MAX_SIZE)
+				usage();
+			break;
+		case 'w':
+			o.workdir = optarg;
+			break;
+		case 'x':
+			o.xcpio = optarg;
+			break;
+		default:
+			usage();
+			break;
+		}
+	}
+
+	if (o.nblock_sizes == 0) {
+		o.block_sizes[o.nblock_sizes++] = 512;
+		o.block_sizes[o.nblock_sizes++] = 4096;
+		o.block_sizes[o.nblock_sizes++] = 65536;
+	}
+	for (i = 0; i < 4; i++) {
+		if (any_profile == false)
+			o.profiles[i] = true;
+		if (o.profiles[i] && (bench_profile_run(&o, i) != 0))
+			ret = 1;
+	}
+
+	exit(ret);
+}
@@ -0,0 +1,66 @@
+#!/bin/sh
+#
+# With a memory budget (-M) creating and extracting an archive must
+# not allocate once the buffers are set up; --stats reports what was
+# allocated while the archive was being read or written.  A budget
+# too small for the job must be refused before anything is done.
+#
+# usage: budget_allocs.sh <xcpio>
+
+XCPIO=$1
+BUDGET=1048576
+
+if [ -z "${XCPIO}" ]; then
+	echo "usage: $0 <xcpio>" >&2
+	exit 2
+fi
+
+WORK=$(mktemp -d "${TMPDIR:-/tmp}/xcpio-budget.XXXXXX") || exit 2
+trap 'rm -rf "${WORK}"' EXIT
+
+fail() {
+	echo "FAIL: $*" >&2
+	exit 1
+}
+
+# Check a --stats report for "allocs: 0"
+check_allocs() {
+	allocs=$(sed -n 's/^allocs: //p' "$2")
+	[ "${allocs}" = "0" ] || fail "$1 made ${allocs:-no} allocations"
+}
+
+mkdir -p "${WORK}/src/d1/d2" "${WORK}/dst" || exit 2
+i=0
+while [ $i -lt 50 ]; do
+	head -c $((i * 997)) /dev/urandom > "${WORK}/src/d1/f$i" || exit 2
+	i=$((i + 1))
+done
+echo small > "${WORK}/src/d1/d2/s" || exit 2
+(cd "${WORK}/src" && find . -print) > "${WORK}/manifest" || exit 2
+
+"${XCPIO}" -c -d "${WORK}/src" -m "${WORK}/manifest" \
+    -f "${WORK}/a.cpio" -M ${BUDGET} --stats 2> "${WORK}/create.stats" ||
+    fail "create with -M ${BUDGET}"
+check_allocs create "${WORK}/create.stats"
+
+"${XCPIO}" -e -d "${WORK}/dst" -f "${WORK}/a.cpio" \
+    -M ${BUDGET} --stats 2> "${WORK}/extract.stats" ||
+    fail "extract with -M ${BUDGET}"
+check_allocs extract "${WORK}/extract.stats"
+
+diff -r "${WORK}/src" "${WORK}/dst" > /dev/null ||
+    fail "extracted tree differs"
+
+# Too small a budget is refused up front, leaving nothing behind
+if "${XCPIO}" -c -d "${WORK}/src" -m "${WORK}/manifest" \
+    -f "${WORK}/small.cpio" -M 100 2> /dev/null; then
+	fail "create with -M 100 wasn't refused"
+fi
+[ -e "${WORK}/small.cpio" ] && fail "create with -M 100 wrote an archive"
+if "${XCPIO}" -e -d "${WORK}/dst" -f "${WORK}/a.cpio" -M 100 \
+    2> /dev/null; then
+	fail "extract with -M 100 wasn't refused"
+fi
+
+echo "PASS"
+exit 0
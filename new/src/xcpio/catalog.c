@@ -0,0 +1,633 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <string.h>
+#include <err.h>
+#include <fcntl.h>
+
+#include <sys/param.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "cpio_format.h"
+#include "cpio_archive.h"
+#include "catalog.h"
+#include "crc32c.h"
+
+#define	CATALOG_MAGIC		"XCPIOCT2"
+
+/*
+ * The catalog file: the header, then the archive table, the sorted
+ * entries, the strings (NUL terminated) and the bloom filters, each
+ * section 8 byte aligned.
+ */
+struct catalog_file_header {
+	char magic[8];
+	uint32_t narchives;
+	uint32_t pad;
+	uint64_t nentries;
+	uint64_t archives_off;
+	uint64_t entries_off;
+	uint64_t strings_off;
+	uint64_t strings_len;
+	uint64_t blooms_off;
+	uint64_t blooms_len;
+};
+
+struct catalog_file_archive {
+	uint64_t name_off;		/* into the strings */
+	uint64_t bloom_off;		/* into the blooms */
+	uint64_t bloom_bits;		/* a power of two */
+	uint64_t nmembers;
+};
+
+struct catalog_file_entry {
+	uint64_t name_off;
+	uint64_t offset;
+	uint64_t size;
+	uint32_t name_len;
+	uint32_t archive;
+};
+
+struct catalog_builder *
+catalog_builder_create(void)
+{
+	struct catalog_builder *b;
+
+	b = calloc(1, sizeof(*b));
+	if (b == NULL) {
+		warn("%s: calloc", __func__);
+		return (NULL);
+	}
+	return (b);
+}
+
+void
+catalog_builder_free(struct catalog_builder *b)
+{
+	int i;
+
+	if (b == NULL)
+		return;
+	for (i = 0; i < b->narchives; i++)
+		free(b->archives[i]);
+	free(b->archives);
+	free(b->first);
+	free(b->e);
+	free(b->names.buf);
+	free(b);
+}
+
+static int
+catalog_names_append(struct cpio_buf *nb, const char *s, size_t len)
+{
+	size_t size;
+	char *p;
+
+	if (nb->len + len + 1 > nb->size) {
+		size = MAX(nb->size * 2, 65536);
+		while (size < nb->len + len + 1)
+			size *= 2;
+		p = realloc(nb->buf, size);
+		if (p == NULL) {
+			warn("%s: realloc", __func__);
+			return (-1);
+		}
+		nb->buf = p;
+		nb->size = size;
+	}
+	memcpy(nb->buf + nb->len, s, len);
+	nb->buf[nb->len + len] = '\0';
+	nb->len += len + 1;
+	return (0);
+}
+
+static int
+catalog_builder_add_entry(struct catalog_builder *b, const char *name,
+    uint64_t offset, uint64_t size)
+{
+	struct catalog_builder_entry *e;
+	uint64_t nsize;
+
+	if (b->nentries == b->size) {
+		nsize = MAX(b->size * 2, 1024);
+		e = realloc(b->e, nsize * sizeof(*e));
+		if (e == NULL) {
+			warn("%s: realloc", __func__);
+			return (-1);
+		}
+		b->e = e;
+		b->size = nsize;
+	}
+	e = &b->e[b->nentries];
+	e->name_off = b->names.len;
+	e->name_len = strlen(name);
+	e->archive = b->narchives - 1;
+	e->offset = offset;
+	e->size = size;
+	if (catalog_names_append(&b->names, name, e->name_len) != 0) {
+		return (-1);
+	}
+	b->nentries++;
+	return (0);
+}
+
+int
+catalog_builder_add_archive(struct catalog_builder *b, const char *file,
+    int block_size)
+{
+	struct cpio_archive *a;
+	const struct cpio_header *c;
+	uint64_t *first;
+	char **archives;
+	off_t offset;
+	int rr = -1;
+
+	archives = realloc(b->archives, (b->narchives + 1) * sizeof(char *));
+	if (archives == NULL) {
+		warn("%s: realloc", __func__);
+		return (-1);
+	}
+	b->archives = archives;
+	first = realloc(b->first, (b->narchives + 1) * sizeof(uint64_t));
+	if (first == NULL) {
+		warn("%s: realloc", __func__);
+		return (-1);
+	}
+	b->first = first;
+	b->archives[b->narchives] = strdup(file);
+	if (b->archives[b->narchives] == NULL) {
+		warn("%s: strdup", __func__);
+		return (-1);
+	}
+	b->first[b->narchives] = b->nentries;
+	b->narchives++;
+
+	a = cpio_archive_create(file, CPIO_ARCHIVE_MODE_READ);
+	if (a == NULL) {
+		return (-1);
+	}
+	cpio_archive_set_blocksize(a, block_size);
+	if (cpio_archive_open(a) < 0) {
+		goto done;
+	}
+
+	/*
+	 * Skipping the payload first puts the reader at the next
+	 * header, which is the offset recorded for it.
+	 */
+	while (1) {
+		if (cpio_archive_skip_payload(a) != 0) {
+			rr = -1;
+			break;
+		}
+		offset = a->read.offset - a->read.buf_len - a->read.start;
+		rr = cpio_archive_next_entry(a, &c);
+		if (rr <= 0) {
+			break;
+		}
+		if (strcmp(c->filename, XCPIO_CSUM_MEMBER) == 0) {
+			continue;
+		}
+		if (catalog_builder_add_entry(b, c->filename, offset,
+		    c->st.st_size) != 0) {
+			rr = -1;
+			break;
+		}
+	}
+	if (rr < 0) {
+		fprintf(stderr, "%s: failed to read '%s'\n", __func__, file);
+	}
+
+done:
+	cpio_archive_free(a);
+	return (rr < 0 ? -1 : 0);
+}
+
+static int
+catalog_entry_cmp(const void *a, const void *b)
+{
+	const struct catalog_builder_entry *ea = a, *eb = b;
+	int r;
+
+	r = memcmp(ea->name, eb->name, MIN(ea->name_len, eb->name_len));
+	if (r != 0)
+		return (r);
+	if (ea->name_len != eb->name_len)
+		return (ea->name_len < eb->name_len ? -1 : 1);
+	/* The same path in several archives; keep them in order */
+	if (ea->archive != eb->archive)
+		return (ea->archive < eb->archive ? -1 : 1);
+	return (ea->offset < eb->offset ? -1 : (ea->offset > eb->offset));
+}
+
+/*
+ * The two hashes the bloom filter's probes are derived from.  They
+ * have to be independent: CRC32C is linear, so two CRCs of the same
+ * name with different seeds differ by a constant and their probes
+ * collide together.  The second is FNV-1a, with the murmur3 finaliser
+ * to spread it into the low bits the probes use.
+ */
+static void
+catalog_hash(const char *name, size_t len, uint32_t *h1, uint32_t *h2)
+{
+	uint32_t h = 2166136261U;
+	size_t i;
+
+	*h1 = crc32c(0, name, len);
+	for (i = 0; i < len; i++) {
+		h ^= (uint8_t) name[i];
+		h *= 16777619U;
+	}
+	h ^= h >> 16;
+	h *= 0x85ebca6bU;
+	h ^= h >> 13;
+	h *= 0xc2b2ae35U;
+	h ^= h >> 16;
+	*h2 = h | 1;
+}
+
+static void
+catalog_bloom_add(uint8_t *bloom, uint64_t bits, const char *name,
+    size_t len)
+{
+	uint32_t h1, h2;
+	uint64_t bit;
+	int i;
+
+	catalog_hash(name, len, &h1, &h2);
+	for (i = 0; i < CATALOG_BLOOM_K; i++) {
+		bit = (h1 + (uint64_t) i * h2) & (bits - 1);
+		bloom[bit / 8] |= 1 << (bit % 8);
+	}
+}
+
+static bool
+catalog_bloom_test(const uint8_t *bloom, uint64_t bits, uint32_t h1,
+    uint32_t h2)
+{
+	uint64_t bit;
+	int i;
+
+	for (i = 0; i < CATALOG_BLOOM_K; i++) {
+		bit = (h1 + (uint64_t) i * h2) & (bits - 1);
+		if ((bloom[bit / 8] & (1 << (bit % 8))) == 0)
+			return (false);
+	}
+	return (true);
+}
+
+static int
+catalog_write_section(FILE *fp, const void *buf, size_t len)
+{
+	static const char zero[8];
+
+	if ((len > 0) && (fwrite(buf, 1, len, fp) != len)) {
+		return (-1);
+	}
+	if ((len % 8) && (fwrite(zero, 1, 8 - len % 8, fp) != 8 - len % 8)) {
+		return (-1);
+	}
+	return (0);
+}
+
+int
+catalog_builder_write(struct catalog_builder *b, const char *path)
+{
+	struct catalog_file_header h;
+	struct catalog_file_archive *fa = NULL;
+	struct catalog_file_entry fe;
+	uint8_t *blooms = NULL;
+	uint64_t i, n, bits;
+	size_t off;
+	char *tmp = NULL;
+	FILE *fp = NULL;
+	int j, ret = -1;
+
+	/* Archive names follow the member names in the strings */
+	fa = calloc(MAX(b->narchives, 1), sizeof(*fa));
+	if (fa == NULL) {
+		warn("%s: calloc", __func__);
+		goto done;
+	}
+	for (j = 0; j < b->narchives; j++) {
+		fa[j].name_off = b->names.len;
+		if (catalog_names_append(&b->names, b->archives[j],
+		    strlen(b->archives[j])) != 0)
+			goto done;
+	}
+
+	/* Size each archive's bloom filter by its member count */
+	off = 0;
+	for (j = 0; j < b->narchives; j++) {
+		n = ((j + 1 < b->narchives) ? b->first[j + 1] : b->nentries) -
+		    b->first[j];
+		bits = 64;
+		while (bits < n * CATALOG_BLOOM_BITS_PER_NAME)
+			bits *= 2;
+		fa[j].nmembers = n;
+		fa[j].bloom_bits = bits;
+		fa[j].bloom_off = off;
+		off += bits / 8;
+	}
+	blooms = calloc(MAX(off, 1), 1);
+	if (blooms == NULL) {
+		warn("%s: calloc", __func__);
+		goto done;
+	}
+
+	for (i = 0; i < b->nentries; i++) {
+		b->e[i].name = b->names.buf + b->e[i].name_off;
+		j = b->e[i].archive;
+		catalog_bloom_add(blooms + fa[j].bloom_off, fa[j].bloom_bits,
+		    b->e[i].name, b->e[i].name_len);
+	}
+	qsort(b->e, b->nentries, sizeof(*b->e), catalog_entry_cmp);
+
+	bzero(&h, sizeof(h));
+	memcpy(h.magic, CATALOG_MAGIC, sizeof(h.magic));
+	h.narchives = b->narchives;
+	h.nentries = b->nentries;
+	h.archives_off = sizeof(h);
+	h.entries_off = h.archives_off + b->narchives * sizeof(*fa);
+	h.strings_off = h.entries_off + b->nentries * sizeof(fe);
+	h.strings_len = b->names.len;
+	h.blooms_off = roundup(h.strings_off + h.strings_len, 8);
+	h.blooms_len = off;
+
+	if (asprintf(&tmp, "%s.tmp.%ld", path, (long) getpid()) < 0) {
+		tmp = NULL;
+		goto done;
+	}
+	fp = fopen(tmp, "w");
+	if (fp == NULL) {
+		warn("%s: fopen (%s)", __func__, tmp);
+		goto done;
+	}
+	if ((catalog_write_section(fp, &h, sizeof(h)) != 0) ||
+	    (catalog_write_section(fp, fa, b->narchives * sizeof(*fa)) != 0)) {
+		goto write_error;
+	}
+	for (i = 0; i < b->nentries; i++) {
+		fe.name_off = b->e[i].name_off;
+		fe.name_len = b->e[i].name_len;
+		fe.archive = b->e[i].archive;
+		fe.offset = b->e[i].offset;
+		fe.size = b->e[i].size;
+		if (fwrite(&fe, sizeof(fe), 1, fp) != 1)
+			goto write_error;
+	}
+	if ((catalog_write_section(fp, b->names.buf, b->names.len) != 0) ||
+	    (catalog_write_section(fp, blooms, off) != 0) ||
+	    (fflush(fp) != 0) || (fsync(fileno(fp)) != 0)) {
+		goto write_error;
+	}
+	if (fclose(fp) != 0) {
+		fp = NULL;
+		goto write_error;
+	}
+	fp = NULL;
+	if (rename(tmp, path) != 0) {
+		warn("%s: rename (%s)", __func__, path);
+		goto done;
+	}
+	ret = 0;
+	goto done;
+
+write_error:
+	warn("%s: write (%s)", __func__, tmp);
+done:
+	if (fp != NULL)
+		fclose(fp);
+	if ((ret != 0) && (tmp != NULL))
+		(void) unlink(tmp);
+	free(tmp);
+	free(fa);
+	free(blooms);
+	return (ret);
+}
+
+/*
+ * Whether a section of count items of the given size at off fits in a
+ * file of len bytes, without overflowing.
+ */
+static bool
+catalog_section_ok(uint64_t off, uint64_t count, size_t size, size_t len)
+{
+
+	if ((off > len) || (off % 8) != 0)
+		return (false);
+	return (count <= (len - off) / size);
+}
+
+/*
+ * Check the header and the archive table; entries are checked as the
+ * lookups reach them, so opening doesn't touch the whole file.
+ */
+static bool
+catalog_check(const struct catalog *cat)
+{
+	const struct catalog_file_header *h = cat->h;
+	const struct catalog_file_archive *fa;
+	const char *strings;
+	uint32_t j;
+
+	if ((memcmp(h->magic, CATALOG_MAGIC, sizeof(h->magic)) != 0) ||
+	    ! catalog_section_ok(h->archives_off, h->narchives,
+	    sizeof(struct catalog_file_archive), cat->len) ||
+	    ! catalog_section_ok(h->entries_off, h->nentries,
+	    sizeof(struct catalog_file_entry), cat->len) ||
+	    ! catalog_section_ok(h->strings_off, h->strings_len, 1, cat->len) ||
+	    ! catalog_section_ok(h->blooms_off, h->blooms_len, 1, cat->len)) {
+		return (false);
+	}
+
+	/* Every string is NUL terminated, so the last byte must be */
+	strings = (const char *) cat->map + h->strings_off;
+	if ((h->strings_len > 0) && (strings[h->strings_len - 1] != '\0')) {
+		return (false);
+	}
+
+	fa = (const void *) ((const char *) cat->map + h->archives_off);
+	for (j = 0; j < h->narchives; j++) {
+		if ((fa[j].name_off >= h->strings_len) ||
+		    (fa[j].bloom_bits < 8) ||
+		    ((fa[j].bloom_bits & (fa[j].bloom_bits - 1)) != 0) ||
+		    (fa[j].bloom_off > h->blooms_len) ||
+		    (fa[j].bloom_bits / 8 > h->blooms_len - fa[j].bloom_off)) {
+			return (false);
+		}
+	}
+	return (true);
+}
+
+/*
+ * Whether an entry's name and archive are within the catalog.
+ */
+static bool
+catalog_entry_ok(const struct catalog *cat, const struct catalog_file_entry *e)
+{
+
+	return ((e->archive < cat->h->narchives) &&
+	    (e->name_off <= cat->h->strings_len) &&
+	    (e->name_len <= cat->h->strings_len - e->name_off));
+}
+
+struct catalog *
+catalog_open(const char *path)
+{
+	const struct catalog_file_header *h;
+	struct catalog *cat;
+	struct stat sb;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		warn("%s: open (%s)", __func__, path);
+		return (NULL);
+	}
+	if (fstat(fd, &sb) != 0) {
+		warn("%s: fstat (%s)", __func__, path);
+		close(fd);
+		return (NULL);
+	}
+	cat = calloc(1, sizeof(*cat));
+	if (cat == NULL) {
+		warn("%s: calloc", __func__);
+		close(fd);
+		return (NULL);
+	}
+	cat->len = sb.st_size;
+	if (cat->len >= sizeof(*h)) {
+		cat->map = mmap(NULL, cat->len, PROT_READ, MAP_SHARED, fd, 0);
+	} else {
+		cat->map = MAP_FAILED;
+	}
+	close(fd);
+	if (cat->map == MAP_FAILED) {
+		fprintf(stderr, "%s: couldn't map '%s'\n", __func__, path);
+		free(cat);
+		return (NULL);
+	}
+
+	h = cat->h = cat->map;
+	if (! catalog_check(cat)) {
+		fprintf(stderr, "%s: '%s' isn't a catalog\n", __func__, path);
+		catalog_close(cat);
+		return (NULL);
+	}
+	cat->archives = (const void *) ((const char *) cat->map +
+	    h->archives_off);
+	cat->entries = (const void *) ((const char *) cat->map +
+	    h->entries_off);
+	cat->strings = (const char *) cat->map + h->strings_off;
+	cat->blooms = (const uint8_t *) cat->map + h->blooms_off;
+	return (cat);
+}
+
+void
+catalog_close(struct catalog *cat)
+{
+
+	if (cat == NULL)
+		return;
+	munmap(cat->map, cat->len);
+	free(cat);
+}
+
+static int
+catalog_name_cmp(struct catalog *cat, const struct catalog_file_entry *e,
+    const char *name, size_t len)
+{
+	int r;
+
+	r = memcmp(cat->strings + e->name_off, name, MIN(e->name_len, len));
+	if (r != 0)
+		return (r);
+	if (e->name_len != len)
+		return (e->name_len < len ? -1 : 1);
+	return (0);
+}
+
+int64_t
+catalog_lookup(struct catalog *cat, const char *name, catalog_match_cb *cb,
+    void *arg)
+{
+	const struct catalog_file_archive *fa;
+	const struct catalog_file_entry *e;
+	struct catalog_match m;
+	uint64_t lo, hi, mid;
+	int64_t n = 0;
+	uint32_t h1, h2, j, first, last;
+	size_t len = strlen(name);
+	int c;
+	bool maybe = false;
+
+	/*
+	 * Find the archives the bloom filters don't rule out.  Most
+	 * misses stop here, without touching the entries.
+	 */
+	catalog_hash(name, len, &h1, &h2);
+	first = last = 0;
+	for (j = 0; j < cat->h->narchives; j++) {
+		fa = &cat->archives[j];
+		if (catalog_bloom_test(cat->blooms + fa->bloom_off,
+		    fa->bloom_bits, h1, h2)) {
+			if (! maybe)
+				first = j;
+			last = j;
+			maybe = true;
+		}
+	}
+	if (! maybe) {
+		return (0);
+	}
+
+	/*
+	 * Entries are sorted by name then archive, so search straight
+	 * for the name's entry in the first candidate archive.
+	 */
+	lo = 0;
+	hi = cat->h->nentries;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		e = &cat->entries[mid];
+		if (! catalog_entry_ok(cat, e)) {
+			lo = mid;
+			goto corrupt;
+		}
+		c = catalog_name_cmp(cat, e, name, len);
+		if ((c < 0) || ((c == 0) && (e->archive < first)))
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	for (; lo < cat->h->nentries; lo++) {
+		e = &cat->entries[lo];
+		if (! catalog_entry_ok(cat, e))
+			goto corrupt;
+		if ((catalog_name_cmp(cat, e, name, len) != 0) ||
+		    (e->archive > last))
+			break;
+		/* Skip the archives in between that were ruled out */
+		fa = &cat->archives[e->archive];
+		if (! catalog_bloom_test(cat->blooms + fa->bloom_off,
+		    fa->bloom_bits, h1, h2))
+			continue;
+		m.archive = cat->strings + fa->name_off;
+		m.offset = e->offset;
+		m.size = e->size;
+		if (cb != NULL)
+			cb(arg, name, &m);
+		n++;
+	}
+	return (n);
+
+corrupt:
+	fprintf(stderr, "%s: corrupt catalog entry %llu\n", __func__,
+	    (unsigned long long) lo);
+	return (-1);
+}
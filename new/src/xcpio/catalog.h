@@ -0,0 +1,95 @@
+#ifndef	__CATALOG_H__
+#define	__CATALOG_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "cpio_archive.h"		/* struct cpio_buf */
+
+/*
+ * A catalog of which archives hold which paths.
+ *
+ * The builder scans each archive's headers (seeking past payloads
+ * where it can) and writes a single file holding:
+ *
+ *  + the archive names;
+ *  + one entry per member, sorted by name, giving the archive and
+ *    the member's header offset and size;
+ *  + a bloom filter per archive over its member names.
+ *
+ * Lookups mmap the catalog.  The bloom filters answer most misses
+ * without touching the name table; otherwise it's a binary search.
+ * The file is in native byte order; it's meant to be built where it's
+ * used.
+ */
+
+#define	CATALOG_BLOOM_BITS_PER_NAME	10
+#define	CATALOG_BLOOM_K			7
+
+struct catalog_builder_entry {
+	size_t name_off;		/* into names */
+	const char *name;		/* set once the names are final */
+	uint32_t name_len;
+	uint32_t archive;
+	uint64_t offset;
+	uint64_t size;
+};
+
+struct catalog_builder {
+	int narchives;
+	char **archives;
+	uint64_t *first;		/* each archive's first entry */
+	struct catalog_builder_entry *e;
+	uint64_t nentries, size;
+	struct cpio_buf names;
+};
+
+/*
+ * A match from catalog_lookup().
+ */
+struct catalog_match {
+	const char *archive;
+	uint64_t offset;		/* of the member's header */
+	uint64_t size;			/* of its payload */
+};
+
+typedef	void catalog_match_cb(void *, const char *,
+	    const struct catalog_match *);
+
+struct catalog {
+	void *map;
+	size_t len;
+	const struct catalog_file_header *h;
+	const struct catalog_file_archive *archives;
+	const struct catalog_file_entry *entries;
+	const char *strings;
+	const uint8_t *blooms;
+};
+
+extern	struct catalog_builder * catalog_builder_create(void);
+extern	void catalog_builder_free(struct catalog_builder *);
+
+/*
+ * Scan an archive's members into the catalog.
+ */
+extern	int catalog_builder_add_archive(struct catalog_builder *,
+	    const char *, int);
+
+/*
+ * Sort and write out the catalog.  It's written to a temporary file
+ * and renamed into place.  This finishes the builder; it can only be
+ * freed afterwards.
+ */
+extern	int catalog_builder_write(struct catalog_builder *, const char *);
+
+extern	struct catalog * catalog_open(const char *);
+extern	void catalog_close(struct catalog *);
+
+/*
+ * Call cb for each archive holding the given path.  Returns the
+ * number of matches, or -1 if an entry it reached is corrupt.
+ */
+extern	int64_t catalog_lookup(struct catalog *, const char *,
+	    catalog_match_cb *, void *);
+
+#endif	/* __CATALOG_H__ */
@@ -7,13 +7,39 @@
 #include <strings.h>
 #include <err.h>
 #include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <fnmatch.h>
 
 #include <sys/param.h>
 #include <sys/stat.h>
+#include <sys/statvfs.h>
+
+#ifdef	__linux__
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <linux/fiemap.h>
+#endif
 
 #include "file_list.h"
 #include "cpio_format.h"
 #include "cpio_archive.h"
+#include "cpio_io.h"
+#include "tree_walk.h"
+#include "dir_cache.h"
+#include "crc32c.h"
+#include "latency.h"
+#include "journal.h"
+#include "tee.h"
+
+#ifndef	nitems
+#define	nitems(x)	(sizeof((x)) / sizeof((x)[0]))
+#endif
+
+#ifndef	__unused
+#define	__unused	__attribute__((__unused__))
+#endif
 
 /*
  * sanity check the file name.  This involves stripping
@@ -21,13 +47,78 @@
  *
  * Yes, this is a big, big todo.
  */
-static char *
-cpio_path_sanity_filter(const char *src)
+static int
+cpio_path_sanity_filter(const char *src, char *dst, size_t len)
 {
 	/* XXX BIG TODO HERE! */
-	return strdup(src);
+	if (strlen(src) >= len) {
+		return (-1);
+	}
+	strcpy(dst, src);
+	return (0);
+}
+
+
+/*
+ * Preallocate len bytes from offset in the given file so its blocks
+ * are allocated up front (and hopefully contiguously) rather than
+ * piecemeal as each block is written.
+ *
+ * This is only a hint; failure (eg the filesystem not supporting it)
+ * is ignored.  On Linux fallocate() is used with FALLOC_FL_KEEP_SIZE
+ * so an interrupted write doesn't leave the file padded out to its
+ * full size, and so glibc doesn't fall back to writing zeros.
+ */
+static void
+cpio_preallocate(int fd, off_t offset, off_t len)
+{
+
+	if (len <= 0) {
+		return;
+	}
+#ifdef	__linux__
+	(void) fallocate(fd, FALLOC_FL_KEEP_SIZE, offset, len);
+#else
+	(void) posix_fallocate(fd, offset, len);
+#endif
+}
+
+static int
+cpio_buf_append(struct cpio_buf *b, const void *data, size_t len)
+{
+	size_t nsize;
+	char *n;
+
+	if (b->len + len > b->size) {
+		nsize = MAX(b->size * 2, b->len + len);
+		nsize = MAX(nsize, 256);
+		n = realloc(b->buf, nsize);
+		if (n == NULL) {
+			warn("%s: realloc(%zu)", __func__, nsize);
+			return (-1);
+		}
+		b->buf = n;
+		b->size = nsize;
+	}
+	memcpy(b->buf + b->len, data, len);
+	b->len += len;
+	return (0);
 }
 
+/*
+ * Append a checksum record for the given member.
+ */
+static int
+cpio_csum_add(struct cpio_buf *b, uint32_t crc, const char *filename)
+{
+	char hex[10];
+
+	snprintf(hex, sizeof(hex), "%08x ", crc);
+	if (cpio_buf_append(b, hex, 9) != 0) {
+		return (-1);
+	}
+	return (cpio_buf_append(b, filename, strlen(filename) + 1));
+}
 
 struct cpio_archive *
 cpio_archive_create(const char *file, cpio_archive_mode mode)
@@ -45,13 +136,15 @@ cpio_archive_create(const char *file, cpio_archive_mode mode)
 		free(a);
 		return (NULL);
 	}
-	a->archive_filename = strdup(file);
+	a->archive_filename = strdup(file != NULL ? file : "(memory)");
 	a->mode = mode;
 	a->fd = -1;
 
 	a->base.fd = AT_FDCWD;
+	a->base.dc = NULL;
 
 	a->block_size = DEFAULT_CPIO_BLOCK_SIZE;
+	a->stats.allocs = -1;
 
 	return a;
 }
@@ -66,6 +159,240 @@ cpio_archive_set_blocksize(struct cpio_archive *a, int block_size)
 	return 0;
 }
 
+/*
+ * Read up to len bytes, looping over short reads until either the
+ * whole amount has been read or EOF is hit.  Pipes and sockets will
+ * happily return less than a block at a time.
+ *
+ * Returns the number of bytes read (less than len only at EOF) or -1
+ * on error.
+ */
+static ssize_t
+cpio_archive_read_full(struct cpio_archive *a, char *buf, size_t len,
+    struct cpio_io_stats *st)
+{
+	size_t n = 0;
+	ssize_t r;
+
+	while (n < len) {
+		r = a->io.ops->read(a->io.arg, buf + n, len - n);
+		st->calls++;
+		if (r == 0) {
+			break;
+		}
+		if (r < 0) {
+			if (errno == EINTR)
+				continue;
+			return (-1);
+		}
+		n += r;
+		st->bytes += r;
+	}
+	return (n);
+}
+
+/*
+ * Write all of len bytes, looping over partial writes.
+ *
+ * Returns len or -1 on error.
+ */
+static ssize_t
+cpio_archive_write_full(struct cpio_archive *a, const char *buf,
+    size_t len, struct cpio_io_stats *st)
+{
+	size_t n = 0;
+	ssize_t r;
+
+	while (n < len) {
+		r = a->io.ops->write(a->io.arg, buf + n, len - n);
+		st->calls++;
+		if (r < 0) {
+			if (errno == EINTR)
+				continue;
+			return (-1);
+		}
+		n += r;
+		st->bytes += r;
+	}
+	return (n);
+}
+
+static uint64_t
+cpio_stats_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+}
+
+static void
+cpio_stats_peak_buffer(struct cpio_archive *a, uint64_t bytes)
+{
+
+	a->stats.peak_buffer_bytes = MAX(a->stats.peak_buffer_bytes, bytes);
+}
+
+/*
+ * Allocate a buffer for the life of the archive.  With a memory
+ * budget it comes out of the arena, otherwise from malloc.
+ */
+static void *
+cpio_archive_alloc(struct cpio_archive *a, size_t size)
+{
+	void *p;
+
+	if (a->budget.arena == NULL) {
+		p = calloc(1, size);
+		if (p == NULL)
+			warn("%s: calloc(%zu)", __func__, size);
+		return (p);
+	}
+
+	size = roundup(size, sizeof(void *));
+	if (a->budget.used + size > a->budget.limit) {
+		fprintf(stderr, "%s: memory budget exhausted (%zu bytes)\n",
+		    __func__, a->budget.limit);
+		return (NULL);
+	}
+	p = a->budget.arena + a->budget.used;
+	a->budget.used += size;
+	return (p);
+}
+
+static void
+cpio_archive_release(struct cpio_archive *a, void *p)
+{
+
+	if (a->budget.arena == NULL)
+		free(p);
+}
+
+/*
+ * Allocate the read side buffers: the filename and path scratch
+ * space, plus the read buffer itself.  With a budget, whatever is
+ * left over becomes the read buffer.
+ */
+static int
+cpio_archive_alloc_read(struct cpio_archive *a)
+{
+	size_t left;
+
+	a->read.name_size = XCPIO_NAME_SIZE;
+	a->read.name = cpio_archive_alloc(a, a->read.name_size);
+	a->read.path = cpio_archive_alloc(a, a->read.name_size);
+	if ((a->read.name == NULL) || (a->read.path == NULL)) {
+		return (-1);
+	}
+
+	/*
+	 * Note: the read buffer is bigger than block_size so we can
+	 * read in block_size reads and potentially read over the block
+	 * boundary whilst accumulating data like header info.
+	 *
+	 * Yes, the important thing here is that stuff like the
+	 * individual files in the archive aren't aligned to block
+	 * sizes; only the actual archive itself is block size aligned.
+	 *
+	 * Hopefully (!) nothing dumb like file names will cause the
+	 * header parsing to exceed 4x the block size.
+	 */
+	if (a->budget.arena == NULL) {
+		a->read.buf_size = a->block_size * 4;
+	} else {
+		left = a->budget.limit - a->budget.used;
+		left -= left % a->block_size;
+		a->read.buf_size = MIN(left, INT_MAX - a->block_size);
+	}
+	a->read.buf = cpio_archive_alloc(a, a->read.buf_size);
+	if (a->read.buf == NULL) {
+		return (-1);
+	}
+	cpio_stats_peak_buffer(a, a->read.buf_size);
+	return (0);
+}
+
+/*
+ * Allocate the write buffer and the header scratch space.  With a
+ * budget, whatever is left over is used for the file list.
+ */
+static int
+cpio_archive_alloc_write(struct cpio_archive *a)
+{
+	size_t left;
+
+	a->write.buf = cpio_archive_alloc(a, a->block_size);
+	a->write.hdr_size = CPIO_HEADER_SIZE + XCPIO_NAME_SIZE;
+	a->write.hdr = cpio_archive_alloc(a, a->write.hdr_size);
+	if ((a->write.buf == NULL) || (a->write.hdr == NULL)) {
+		return (-1);
+	}
+	a->write.size = a->block_size;
+	a->write.len = 0;
+
+	if (a->budget.arena != NULL) {
+		left = a->budget.limit - a->budget.used;
+		if (file_list_set_pool(a->files.fl,
+		    a->budget.arena + a->budget.used, left) != 0) {
+			return (-1);
+		}
+		a->budget.used += left;
+	}
+	return (0);
+}
+
+/*
+ * Limit the archive to the given number of bytes of buffers, all
+ * allocated now.  The block size must already be set.
+ *
+ * The budget must hold the block buffers and a maximum length
+ * filename; the rest goes to the read buffer (when reading) or to
+ * the file list (when writing.)  After this nothing is allocated
+ * for each entry read, extracted or written.
+ */
+int
+cpio_archive_set_memory_budget(struct cpio_archive *a, size_t bytes)
+{
+	size_t need;
+
+	if (a->budget.arena != NULL) {
+		fprintf(stderr, "%s: budget already set\n", __func__);
+		return (-1);
+	}
+
+	/* The smallest that can hold a PATH_MAX filename */
+	if (a->mode == CPIO_ARCHIVE_MODE_READ) {
+		need = 2 * XCPIO_NAME_SIZE +
+		    DIR_CACHE_POOL_SIZE(XCPIO_NAME_SIZE) +
+		    roundup(CPIO_HEADER_SIZE + XCPIO_NAME_SIZE, a->block_size) +
+		    a->block_size;
+	} else {
+		need = a->block_size + CPIO_HEADER_SIZE + XCPIO_NAME_SIZE;
+	}
+	need += 4 * sizeof(void *);	/* alignment slop */
+	if (bytes < need) {
+		fprintf(stderr, "%s: a budget of %zu bytes can't hold the "
+		    "longest filename; need at least %zu\n",
+		    __func__, bytes, need);
+		return (-1);
+	}
+
+	a->budget.arena = malloc(bytes);
+	if (a->budget.arena == NULL) {
+		warn("%s: malloc(%zu)", __func__, bytes);
+		return (-1);
+	}
+	a->budget.limit = bytes;
+	a->budget.used = 0;
+
+	if (a->mode == CPIO_ARCHIVE_MODE_READ) {
+		a->budget.used = roundup(DIR_CACHE_POOL_SIZE(XCPIO_NAME_SIZE),
+		    sizeof(void *));
+		return (cpio_archive_alloc_read(a));
+	}
+	return (cpio_archive_alloc_write(a));
+}
+
 /*
  * Attempt to flush out whatever is in the write buffer.
  *
@@ -90,20 +417,20 @@ cpio_archive_write_flush(struct cpio_archive *a, int do_padding)
 		}
 	}
 
-	/* Write it out; error out if it's not the whole thing */
-	ret = write(a->fd, a->write.buf, a->write.size);
-	if (ret < 0) {
-		warn("%s: write failed", __func__);
-		return (-1);
-	}
 	/*
-	 * Note: We can't handle partial writes here.
+	 * Write it out; partial writes are retried until it's all out.
+	 * With several outputs the tee's writers do that.
 	 */
-	if (ret != a->write.size) {
-		fprintf(stderr, "%s: partial write (%d, not %d bytes)\n",
-		  __func__,
-		  (int) ret,
-		  a->write.size);
+	if (a->outputs.tee != NULL) {
+		ret = tee_write(a->outputs.tee, a->write.buf, a->write.size);
+		a->stats.archive_write.calls++;
+		a->stats.archive_write.bytes += a->write.size;
+	} else {
+		ret = cpio_archive_write_full(a, a->write.buf, a->write.size,
+		    &a->stats.archive_write);
+	}
+	if (ret < 0) {
+		warn("%s: write failed", __func__);
 		return (-1);
 	}
 
@@ -133,7 +460,7 @@ cpio_archive_write_data(struct cpio_archive *a, const char *write_buf,
 		 * This will do nothing in the buffer isn't full.
 		 */
 		if (cpio_archive_write_flush(a, false) < 0) {
-			printf("failed to flush\n");
+			fprintf(stderr, "failed to flush\n");
 			return (-1);
 		}
 
@@ -174,579 +501,2975 @@ cpio_archive_write_data(struct cpio_archive *a, const char *write_buf,
 	return bytes_written;
 }
 
-int
-cpio_archive_open(struct cpio_archive *a)
+/*
+ * Walk the headers of an existing archive open on fd and return the
+ * offset of the TRAILER!!! header.  The payloads are skipped by offset rather
+ * than read, so this only touches the header bytes.
+ *
+ * If 'members' and 'has_csum' aren't NULL they're set to the number
+ * of members before the trailer and whether any was a checksum member.
+ */
+static off_t
+cpio_archive_find_trailer(struct cpio_archive *a, int fd, uint64_t *members,
+    bool *has_csum)
 {
-	if (a->block_size == 0) {
-		fprintf(stderr, "%s: ERROR: block_size must not be 0\n",
-		    __func__);
-		return -1;
-	}
-	switch (a->mode) {
-	case CPIO_ARCHIVE_MODE_READ:
-		a->fd = open(a->archive_filename, O_RDONLY);
-		break;
-	case CPIO_ARCHIVE_MODE_WRITE:
-		a->fd = open(a->archive_filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
-		break;
-	default:
-		a->fd = -1;
-		return -1;
-	}
+	struct cpio_header *c = NULL;
+	char *buf;
+	int buf_size = 76 + PATH_MAX;
+	off_t offset = 0;
+	ssize_t r;
+	int rr;
 
-	if (a->fd < 0) {
-		warn("%s: open (%s)", __func__, a->archive_filename);
-		return -1;
+	buf = calloc(1, buf_size);
+	if (buf == NULL) {
+		warn("%s: calloc(%d)", __func__, buf_size);
+		return (-1);
 	}
+	cpio_stats_peak_buffer(a, buf_size);
 
-	a->write.buf = calloc(1, a->block_size);
-	if (a->write.buf == NULL) {
-		warn("%s: calloc(%d)", __func__, a->block_size);
-		return -1;
+	while (1) {
+		r = pread(fd, buf, buf_size, offset);
+		if (r < 0) {
+			warn("%s: pread", __func__);
+			goto fail;
+		}
+		a->stats.archive_read.calls++;
+		a->stats.archive_read.bytes += r;
+		rr = cpio_header_deserialise(buf, r, &c);
+		if (rr <= 0) {
+			fprintf(stderr, "%s: couldn't parse header at "
+			    "offset %llu\n", __func__,
+			    (unsigned long long) offset);
+			goto fail;
+		}
+
+		if ((c->st.st_size == 0) &&
+		    (strncmp(c->filename, "TRAILER!!!", 10) == 0)) {
+			break;
+		}
+		if (members != NULL)
+			(*members)++;
+		if ((has_csum != NULL) &&
+		    (strcmp(c->filename, XCPIO_CSUM_MEMBER) == 0))
+			*has_csum = true;
+
+		offset += rr + c->st.st_size;
+		cpio_header_free(c);
+		c = NULL;
 	}
-	a->write.size = a->block_size;
-	a->write.len = 0;
-	return 0;
+
+	cpio_header_free(c);
+	free(buf);
+	return (offset);
+
+fail:
+	if (c != NULL)
+		cpio_header_free(c);
+	free(buf);
+	return (-1);
 }
 
-int
-cpio_archive_close(struct cpio_archive *a)
+/*
+ * Position an append-mode archive so the next write overwrites the
+ * existing TRAILER!!! header.
+ *
+ * The trailer isn't necessarily block aligned, so the leading part of
+ * the block it lives in is read back into the write buffer and the
+ * file offset is set to the start of that block.  That way the
+ * writes stay block sized and block aligned.
+ */
+static int
+cpio_archive_append_position(struct cpio_archive *a)
 {
-	struct cpio_header *c;
 	struct stat sb;
-	int ret;
+	off_t trailer_offset, block_offset;
+	uint64_t members = 0;
+	bool has_csum = false;
+	ssize_t r;
 
-	if (a->mode == CPIO_ARCHIVE_MODE_WRITE) {
-		char *sbuf;
-		int slen;
-		bzero(&sb, sizeof(sb));
-		c = cpio_header_create(&sb, "TRAILER!!!");
-		if (c == NULL) {
-			return (-1);
-		}
+	if (fstat(a->fd, &sb) != 0) {
+		warn("%s: fstat (%s)", __func__, a->archive_filename);
+		return (-1);
+	}
+
+	/* An empty file is just a new archive */
+	if (sb.st_size == 0) {
+		return (0);
+	}
+
+	trailer_offset = cpio_archive_find_trailer(a, a->fd, &members,
+	    &has_csum);
+	if (trailer_offset < 0) {
+		fprintf(stderr, "%s: couldn't find the trailer in '%s'\n",
+		    __func__, a->archive_filename);
+		return (-1);
+	}
+
+	/*
+	 * The checksums have to cover every member to verify, so -K
+	 * can only be used to append to an archive made with -K, and
+	 * vice versa.
+	 */
+	if ((members > 0) && (has_csum != a->csum.enabled)) {
+		fprintf(stderr, "%s: ERROR: '%s' was created %s checksums; "
+		    "append %s -K\n", __func__, a->archive_filename,
+		    has_csum ? "with" : "without",
+		    has_csum ? "with" : "without");
+		return (-1);
+	}
 
-		sbuf = cpio_header_serialise(a->fd, c, &slen);
-		if (sbuf == NULL) {
-			cpio_header_free(c);
+	a->write.len = trailer_offset % a->block_size;
+	block_offset = trailer_offset - a->write.len;
+
+	if (a->write.len > 0) {
+		r = pread(a->fd, a->write.buf, a->write.len, block_offset);
+		if (r != a->write.len) {
+			warn("%s: pread", __func__);
 			return (-1);
 		}
-		cpio_archive_write_data(a, sbuf, slen);
-		free(sbuf); sbuf = NULL;
-		cpio_header_free(c);
+	}
 
-		/*
-		 * Flush out any pending data; make sure it's padded.
-		 */
-		cpio_archive_write_flush(a, true);
+	if (lseek(a->fd, block_offset, SEEK_SET) < 0) {
+		warn("%s: lseek", __func__);
+		return (-1);
+	}
 
-		close(a->fd);
-		a->fd = -1;
+	return (0);
+}
+
+/*
+ * Read another block from the archive into the read buffer, if there
+ * is room for it and we haven't hit EOF.
+ *
+ * The buffer holds buf_len bytes of unconsumed data starting at
+ * buf_off.  Consumed data at the front is only reclaimed (by moving
+ * the remainder down) when a block won't fit after it.
+ *
+ * Returns the number of bytes read, 0 at EOF or if there's no room,
+ * or -1 on error.
+ */
+static ssize_t
+cpio_archive_read_fill(struct cpio_archive *a)
+{
+	ssize_t r;
+
+	if (a->read.hit_eof) {
 		return (0);
 	}
 
-	/* For read we're not doing anything else */
+	if (a->read.buf_off + a->read.buf_len + a->block_size >
+	    a->read.buf_size) {
+		if (a->read.buf_len + a->block_size > a->read.buf_size) {
+			return (0);
+		}
+		memmove(a->read.buf, a->read.buf + a->read.buf_off,
+		    a->read.buf_len);
+		a->stats.bytes_memmoved += a->read.buf_len;
+		a->read.buf_off = 0;
+	}
 
-	return (0);
+	/*
+	 * Always read in block_size chunks so the underlying I/O is done
+	 * in the archive block size.  Short reads from pipes are gathered
+	 * up into a full block; only a short read at EOF is short.
+	 */
+	r = cpio_archive_read_full(a,
+	    a->read.buf + a->read.buf_off + a->read.buf_len, a->block_size,
+	    &a->stats.archive_read);
+	if (r < 0) {
+		warn("%s: read", __func__);
+		a->read.hit_eof = true;
+		return (-1);
+	}
+	if (r < a->block_size) {
+		a->read.hit_eof = true;
+	}
+	a->read.buf_len += r;
+	a->read.offset += r;
+	return (r);
 }
 
-int
-cpio_archive_free(struct cpio_archive *a)
+static void
+cpio_archive_read_consume(struct cpio_archive *a, size_t len)
 {
 
-	if (a->fd > -1)
-		close(a->fd);
-	if (a->base.fd > -1)
-		close(a->base.fd);
-	file_list_free(a->files.fl);
-	a->files.fl = NULL;
-	free(a->archive_filename);
-	free(a->base.dirname);
-	if (a->read.c != NULL)
-		cpio_header_free(a->read.c);
-	free(a);
-	return (0);
+	a->read.buf_off += len;
+	a->read.buf_len -= len;
+	if (a->read.buf_len == 0) {
+		a->read.buf_off = 0;
+	}
 }
 
+/*
+ * Keep a restart journal at path while writing or extracting.  With
+ * resume, the job carries on from the journal's last record instead
+ * of starting over.  This must be called before cpio_archive_open().
+ */
 int
-cpio_archive_set_base_directory(struct cpio_archive *a, const char *dirname)
+cpio_archive_set_journal(struct cpio_archive *a, const char *path,
+    bool resume)
 {
-	if (a->base.fd > -1)
-		close(a->base.fd);
-	if (a->base.dirname)
-		free(a->base.dirname);
-	a->base.fd = -1;
-	a->base.dirname = NULL;
 
-	a->base.dirname = strdup(dirname);
-	if (a->base.dirname == NULL) {
+	if (a->mode == CPIO_ARCHIVE_MODE_APPEND) {
+		fprintf(stderr, "%s: ERROR: can't journal an append\n",
+		    __func__);
+		return (-1);
+	}
+	free(a->journal.path);
+	a->journal.path = strdup(path);
+	if (a->journal.path == NULL) {
 		warn("%s: strdup", __func__);
 		return (-1);
 	}
-	a->base.fd = open(dirname, O_RDONLY);
-	if (a->base.fd == -1) {
-		warn("%s: open (%s)", __func__, dirname);
+	a->journal.resume = resume;
+	return (0);
+}
+
+/*
+ * Position the reader at the given archive offset, which must be at
+ * a member boundary.  It seeks where it can, to the block boundary
+ * before it so reads stay aligned, and reads up to it otherwise.
+ */
+static int
+cpio_archive_read_skip_to(struct cpio_archive *a, off_t offset)
+{
+	off_t aligned;
+	size_t n;
+
+	if (offset < a->read.offset - a->read.buf_len) {
 		return (-1);
 	}
+	aligned = offset - ((offset - a->read.start) % a->block_size);
+	if (a->read.seekable && (aligned > a->read.offset)) {
+		if (lseek(a->fd, aligned, SEEK_SET) != aligned) {
+			warn("%s: lseek", __func__);
+			return (-1);
+		}
+		a->stats.bytes_seeked += aligned - a->read.offset;
+		a->read.offset = aligned;
+		a->read.buf_off = a->read.buf_len = 0;
+	}
+
+	while (a->read.offset - a->read.buf_len < offset) {
+		if ((a->read.buf_len == 0) && (cpio_archive_read_fill(a) <= 0)) {
+			fprintf(stderr, "%s: archive ended before offset %lld\n",
+			    __func__, (long long) offset);
+			return (-1);
+		}
+		n = MIN((off_t) a->read.buf_len,
+		    offset - (a->read.offset - a->read.buf_len));
+		cpio_archive_read_consume(a, n);
+	}
 	return (0);
 }
 
 /*
- * Write a file into the current archive. filename is either a
- * full path or a relative to the defined base path / current working
- * directory.
+ * Open the journal and, when resuming, pick up where it left off.
  *
- * TODO: symlinks/hardlinks need the destination link provided
- *       as the file payload; that is currently definitely not
- *       yet implemented!
+ * A resumed write is truncated back to the recorded offset and the
+ * recorded partial block goes back into the write buffer; a resumed
+ * read skips to the recorded offset.  A missing or empty journal
+ * just means starting from the beginning.
  */
-int
-cpio_archive_write_file(struct cpio_archive *a, const char *filename)
+static int
+cpio_archive_journal_open(struct cpio_archive *a)
 {
-	struct cpio_header *c = NULL;
+	struct journal_state st;
 	struct stat sb;
-	int fd = -1;
-	int ret;
-	ssize_t rret, wret, wlen;
-	/* XXX TODO: make this 4x the block size.. */
-	char buf[XCPIO_WRITE_BUF_SIZE];
-	char *sbuf;
-	int slen;
+	int r;
 
-	/*
-	 * Note: we can't open non-regular files; so do fstatat() first.
-	 */
-	ret = fstatat(a->base.fd, filename, &sb, 0);
-	if (ret < 0) {
-		warn("fstatat (%s)", filename);
-		goto fail;
+	if ((a->mode == CPIO_ARCHIVE_MODE_WRITE) && ((a->fd < 0) ||
+	    (a->outputs.n > 0) ||
+	    (fstat(a->fd, &sb) != 0) || ! S_ISREG(sb.st_mode))) {
+		fprintf(stderr, "%s: ERROR: journalling needs the archive to "
+		    "be a single regular file\n", __func__);
+		return (-1);
 	}
 
-	/*
-	 * Only open the file if it's a real file.
-	 */
-	if (S_ISREG(sb.st_mode)) {
-		fd = openat(a->base.fd, filename, O_RDONLY);
-		if (fd < 0) {
-			warn("open (%s)", filename);
-			goto fail;
+	a->journal.j = journal_open(a->journal.path, a->block_size,
+	    a->journal.resume);
+	if (a->journal.j == NULL) {
+		return (-1);
+	}
+	if (! a->journal.resume) {
+		return (0);
+	}
+
+	/* The tail is only kept when writing; it lands in the buffer */
+	bzero(&st, sizeof(st));
+	st.tail = (a->mode == CPIO_ARCHIVE_MODE_WRITE) ? a->write.buf :
+	    a->read.buf;
+	r = journal_load(a->journal.j, &st);
+	if (r < 0) {
+		return (-1);
+	}
+	if (r == 0) {
+		if ((a->mode == CPIO_ARCHIVE_MODE_WRITE) &&
+		    (ftruncate(a->fd, 0) != 0)) {
+			warn("%s: ftruncate", __func__);
+			return (-1);
 		}
+		return (0);
+	}
+	if ((st.mode != (int) a->mode) || (st.block_size != a->block_size)) {
+		fprintf(stderr, "%s: ERROR: journal '%s' is for a different "
+		    "job (mode %d, block size %d)\n", __func__,
+		    a->journal.path, st.mode, st.block_size);
+		return (-1);
+	}
 
-		/*
-		 * Re-do the fstat now.
-		 */
-		ret = fstat(fd, &sb);
-		if (ret != 0) {
-			warn("stat (%s)", filename);
-			goto fail;
+	if (a->mode == CPIO_ARCHIVE_MODE_WRITE) {
+		if ((ftruncate(a->fd, st.offset) != 0) ||
+		    (lseek(a->fd, st.offset, SEEK_SET) != (off_t) st.offset)) {
+			warn("%s: truncating to the journal offset", __func__);
+			return (-1);
+		}
+		a->write.len = st.tail_len;
+	} else {
+		a->read.buf_off = a->read.buf_len = 0;
+		if (cpio_archive_read_skip_to(a, st.offset) != 0) {
+			return (-1);
+		}
+	}
+	a->journal.entries = a->journal.saved_entries = st.entries;
+	a->stats.resumed = st.entries;
+	return (0);
+}
+
+/*
+ * Record that entries members are complete and the archive is at
+ * offset.
+ */
+static int
+cpio_archive_journal_save(struct cpio_archive *a, uint64_t entries,
+    off_t offset)
+{
+	struct journal_state st;
+
+	bzero(&st, sizeof(st));
+	st.mode = a->mode;
+	st.block_size = a->block_size;
+	st.entries = entries;
+	st.offset = offset;
+	if (a->mode == CPIO_ARCHIVE_MODE_WRITE) {
+		st.tail = a->write.buf;
+		st.tail_len = a->write.len;
+	}
+	a->journal.saved_entries = entries;
+	a->journal.saved_bytes = a->stats.archive_write.bytes +
+	    a->stats.archive_read.bytes;
+	a->stats.journal_saves++;
+	return (journal_save(a->journal.j, &st));
+}
+
+/*
+ * Called once journal.entries members are complete.  Every so often
+ * make sure everything done so far is on disk and record it in the
+ * journal.
+ *
+ * Durable extraction records its progress at its own checkpoints
+ * instead.
+ */
+static int
+cpio_archive_journal_progress(struct cpio_archive *a)
+{
+	off_t offset;
+
+	if ((a->journal.j == NULL) || (a->durable.every > 0)) {
+		return (0);
+	}
+	if ((a->journal.entries - a->journal.saved_entries <
+	    XCPIO_JOURNAL_EVERY) && (a->stats.archive_write.bytes +
+	    a->stats.archive_read.bytes - a->journal.saved_bytes <
+	    XCPIO_JOURNAL_BYTES)) {
+		return (0);
+	}
+
+	a->stats.syncs++;
+	if (a->mode == CPIO_ARCHIVE_MODE_WRITE) {
+		offset = lseek(a->fd, 0, SEEK_CUR);
+		if ((offset < 0) || (fdatasync(a->fd) != 0)) {
+			warn("%s: fdatasync", __func__);
+			return (-1);
+		}
+	} else {
+		offset = a->read.offset - a->read.buf_len;
+#ifdef	__linux__
+		if (syncfs(a->base.fd) != 0) {
+			warn("%s: syncfs", __func__);
+			return (-1);
+		}
+#else
+		sync();
+#endif
+	}
+	return (cpio_archive_journal_save(a, a->journal.entries, offset));
+}
+
+/*
+ * The job finished; the journal isn't needed any more.
+ */
+static void
+cpio_archive_journal_done(struct cpio_archive *a)
+{
+
+	if (a->journal.j == NULL) {
+		return;
+	}
+	(void) journal_remove(a->journal.j);
+	journal_free(a->journal.j);
+	a->journal.j = NULL;
+}
+
+/*
+ * Also write the archive to the given file.  Every block goes to the
+ * archive file and all the added ones, concurrently.  This must be
+ * called before cpio_archive_open().
+ */
+int
+cpio_archive_add_output(struct cpio_archive *a, const char *file)
+{
+	char **names;
+
+	if (a->mode != CPIO_ARCHIVE_MODE_WRITE) {
+		fprintf(stderr, "%s: ERROR: extra outputs are only for "
+		    "writing a new archive\n", __func__);
+		return (-1);
+	}
+	names = realloc(a->outputs.names, (a->outputs.n + 1) * sizeof(char *));
+	if (names == NULL) {
+		warn("%s: realloc", __func__);
+		return (-1);
+	}
+	a->outputs.names = names;
+	names[a->outputs.n] = strdup(file);
+	if (names[a->outputs.n] == NULL) {
+		warn("%s: strdup", __func__);
+		return (-1);
+	}
+	a->outputs.n++;
+	return (0);
+}
+
+/*
+ * Open the extra outputs and start the tee writing to them and the
+ * archive fd.
+ */
+static int
+cpio_archive_open_outputs(struct cpio_archive *a)
+{
+	int i;
+
+	a->outputs.fds = calloc(a->outputs.n + 1, sizeof(int));
+	if (a->outputs.fds == NULL) {
+		warn("%s: calloc", __func__);
+		return (-1);
+	}
+	a->outputs.fds[0] = a->fd;
+	for (i = 1; i <= a->outputs.n; i++) {
+		a->outputs.fds[i] = -1;
+	}
+	for (i = 1; i <= a->outputs.n; i++) {
+		if (strcmp(a->outputs.names[i - 1], "-") == 0) {
+			a->outputs.fds[i] = dup(STDOUT_FILENO);
+		} else {
+			a->outputs.fds[i] = open(a->outputs.names[i - 1],
+			    O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		}
+		if (a->outputs.fds[i] < 0) {
+			warn("%s: open (%s)", __func__,
+			    a->outputs.names[i - 1]);
+			return (-1);
+		}
+	}
+
+	a->outputs.tee = tee_create(a->outputs.fds, a->outputs.n + 1,
+	    a->block_size);
+	if (a->outputs.tee == NULL) {
+		return (-1);
+	}
+	return (0);
+}
+
+/*
+ * Wait for the outputs to be written and close them.  The archive
+ * fd itself is left to the caller.
+ */
+static int
+cpio_archive_close_outputs(struct cpio_archive *a)
+{
+	int i, ret = 0;
+
+	if (a->outputs.tee != NULL) {
+		ret = tee_finish(a->outputs.tee);
+		a->stats.tee_wait_ns = a->outputs.tee->wait_ns;
+		tee_free(a->outputs.tee);
+		a->outputs.tee = NULL;
+	}
+	if (a->outputs.fds != NULL) {
+		for (i = 1; i <= a->outputs.n; i++) {
+			if (a->outputs.fds[i] > -1)
+				close(a->outputs.fds[i]);
 		}
+		free(a->outputs.fds);
+		a->outputs.fds = NULL;
+	}
+	return (ret);
+}
+
+/*
+ * Read or write the archive through the given backend rather than
+ * opening archive_filename.  This must be called before
+ * cpio_archive_open().  Appending needs a seekable file, so it isn't
+ * supported here.
+ */
+int
+cpio_archive_set_io(struct cpio_archive *a, const struct cpio_io_ops *ops,
+    void *arg)
+{
+
+	if (a->mode == CPIO_ARCHIVE_MODE_APPEND) {
+		fprintf(stderr, "%s: ERROR: can't append via an I/O backend\n",
+		    __func__);
+		return (-1);
+	}
+	a->io.ops = ops;
+	a->io.arg = arg;
+	return (0);
+}
+
+int
+cpio_archive_open(struct cpio_archive *a)
+{
+	struct stat sb;
+
+	if (a->block_size == 0) {
+		fprintf(stderr, "%s: ERROR: block_size must not be 0\n",
+		    __func__);
+		return -1;
+	}
+
+	/* A caller supplied backend; there's no file to open */
+	if (a->io.ops != NULL) {
+		goto buffers;
 	}
 
 	/*
-	 * If it's not a regular file then override the st_size
-	 * field.  Directories will need it to be a 0 length file;
-	 * later support for symlink/hardlinks will have the
-	 * destination file path as the payload.
+	 * An archive name of "-" means stdin for reading and stdout
+	 * for writing.  Appending needs to seek, so it can't be a pipe.
 	 */
-	if (S_ISDIR(sb.st_mode)) {
-		sb.st_size = 0;
+	if (strcmp(a->archive_filename, "-") == 0) {
+		switch (a->mode) {
+		case CPIO_ARCHIVE_MODE_READ:
+			a->fd = dup(STDIN_FILENO);
+			break;
+		case CPIO_ARCHIVE_MODE_WRITE:
+			a->fd = dup(STDOUT_FILENO);
+			break;
+		default:
+			fprintf(stderr, "%s: ERROR: can't append to stdout\n",
+			    __func__);
+			a->fd = -1;
+			return -1;
+		}
+	} else switch (a->mode) {
+	case CPIO_ARCHIVE_MODE_READ:
+		a->fd = open(a->archive_filename, O_RDONLY);
+		break;
+	case CPIO_ARCHIVE_MODE_WRITE:
+		/* A resumed archive is truncated to the journal's offset */
+		a->fd = open(a->archive_filename, O_WRONLY | O_CREAT |
+		    (a->journal.resume ? 0 : O_TRUNC), 0644);
+		break;
+	case CPIO_ARCHIVE_MODE_APPEND:
+		a->fd = open(a->archive_filename, O_RDWR | O_CREAT, 0644);
+		break;
+	default:
+		a->fd = -1;
+		return -1;
 	}
 
-	c = cpio_header_create(&sb, filename);
-	if (c == NULL) {
-		goto fail;
+	if (a->fd < 0) {
+		warn("%s: open (%s)", __func__, a->archive_filename);
+		return -1;
 	}
+	a->io.ops = &cpio_io_fd_ops;
+	a->io.arg = &a->fd;
 
-	sbuf = cpio_header_serialise(a->fd, c, &slen);
-	if (sbuf == NULL) {
-		goto fail;
+	if ((a->outputs.n > 0) && (cpio_archive_open_outputs(a) != 0)) {
+		return -1;
 	}
-	if (cpio_archive_write_data(a, sbuf, slen) <= 0) {
-		free(sbuf);
-		goto fail;
+
+buffers:
+	if ((a->mode != CPIO_ARCHIVE_MODE_READ) && (a->write.buf == NULL) &&
+	    (cpio_archive_alloc_write(a) != 0)) {
+		return -1;
 	}
-	free(sbuf); sbuf = NULL;
 
-	if (fd != -1) {
+	if (a->mode == CPIO_ARCHIVE_MODE_APPEND) {
+		if (cpio_archive_append_position(a) != 0) {
+			return -1;
+		}
+	}
+
+	if (a->mode == CPIO_ARCHIVE_MODE_READ) {
+		if ((a->read.buf == NULL) &&
+		    (cpio_archive_alloc_read(a) != 0)) {
+			return -1;
+		}
+		a->read.buf_off = a->read.buf_len = 0;
+		a->read.hit_eof = false;
+		a->read.done = false;
+
+		/* Payloads can be seeked over in regular files */
+		a->read.seekable = false;
+		a->read.offset = 0;
+		if ((a->fd > -1) && (fstat(a->fd, &sb) == 0) &&
+		    S_ISREG(sb.st_mode)) {
+			a->read.offset = lseek(a->fd, 0, SEEK_CUR);
+			a->read.seekable = (a->read.offset >= 0);
+			if (! a->read.seekable)
+				a->read.offset = 0;
+		}
+		a->read.start = a->read.offset;
+
 		/*
-		 * Yeah yeah 1k read/write is tiny, but for this use case it's
-		 * fine.
+		 * With a budget the extraction directory cache keeps
+		 * its paths in the space reserved at the start of the
+		 * arena, and is set up now rather than on first use.
 		 */
-		while (1) {
-			/* Note: this reads from the file we opened */
-			rret = read(fd, buf, XCPIO_WRITE_BUF_SIZE);
-			if (rret == 0) {
-				break;
-			}
-			if (rret < 0) {
-				warn("read");
-				goto fail;
-			}
-			wlen = 0;
-			while (wlen < rret) {
-				/*
-				 * Note: this writes to the underlying device
-				 * and THIS must be block sized writes!
-				 */
-				wret = cpio_archive_write_data(a, buf + wlen, rret - wlen);
-				if (wret <= 0) {
-					warn("write");
-					goto fail;
-				}
-				wlen += wret;
+		if (a->budget.arena != NULL) {
+			if (a->base.dc == NULL)
+				a->base.dc = dir_cache_create(a->base.fd);
+			if ((a->base.dc == NULL) ||
+			    (dir_cache_set_pool(a->base.dc, a->budget.arena,
+			    XCPIO_NAME_SIZE) != 0)) {
+				return -1;
 			}
 		}
+	}
 
+	if ((a->journal.path != NULL) && (cpio_archive_journal_open(a) != 0)) {
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Preallocate space for 'size' more bytes of archive output from the
+ * current position.  This is a no-op for non-regular files (eg when
+ * writing to a pipe.)
+ */
+int
+cpio_archive_preallocate(struct cpio_archive *a, off_t size)
+{
+	struct stat sb;
+	off_t offset;
+	int i;
+
+	/* Each output is at the same offset */
+	if ((fstat(a->fd, &sb) != 0) || ! S_ISREG(sb.st_mode)) {
+		return (0);
+	}
+	offset = lseek(a->fd, 0, SEEK_CUR);
+	if (offset < 0) {
+		return (0);
+	}
+	cpio_preallocate(a->fd, offset, size);
+	for (i = 1; (a->outputs.fds != NULL) && (i <= a->outputs.n); i++) {
+		if ((fstat(a->outputs.fds[i], &sb) == 0) &&
+		    S_ISREG(sb.st_mode))
+			cpio_preallocate(a->outputs.fds[i], offset, size);
+	}
+	return (0);
+}
+
+int
+cpio_archive_close(struct cpio_archive *a)
+{
+	struct cpio_header c;
+	struct stat sb;
+	int ret;
+
+	if ((a->mode == CPIO_ARCHIVE_MODE_WRITE) ||
+	    (a->mode == CPIO_ARCHIVE_MODE_APPEND)) {
+		int slen;
+
+		/*
+		 * The checksums go last so they can be collected as the
+		 * files are streamed in.
+		 */
+		if (a->csum.enabled) {
+			bzero(&sb, sizeof(sb));
+			sb.st_mode = S_IFREG | 0444;
+			sb.st_nlink = 1;
+			sb.st_size = a->csum.computed.len;
+			c.st = sb;
+			c.filename = XCPIO_CSUM_MEMBER;
+			slen = cpio_header_serialise_into(&c, a->write.hdr,
+			    a->write.hdr_size);
+			if (slen < 0) {
+				return (-1);
+			}
+			cpio_archive_write_data(a, a->write.hdr, slen);
+			if (a->csum.computed.len > 0) {
+				cpio_archive_write_data(a, a->csum.computed.buf,
+				    a->csum.computed.len);
+			}
+		}
+
+		bzero(&c, sizeof(c));
+		c.filename = "TRAILER!!!";
+		slen = cpio_header_serialise_into(&c, a->write.hdr,
+		    a->write.hdr_size);
+		if (slen < 0) {
+			return (-1);
+		}
+		cpio_archive_write_data(a, a->write.hdr, slen);
+
+		/*
+		 * Flush out any pending data; make sure it's padded.
+		 */
+		cpio_archive_write_flush(a, true);
+		ret = cpio_archive_close_outputs(a);
+
+		/*
+		 * When appending, anything past the new trailer
+		 * block is left over from the old archive; drop it.
+		 */
+		if ((a->mode == CPIO_ARCHIVE_MODE_APPEND) && (a->fd > -1)) {
+			off_t end;
+
+			end = lseek(a->fd, 0, SEEK_CUR);
+			if ((end < 0) || (ftruncate(a->fd, end) != 0)) {
+				warn("%s: ftruncate", __func__);
+			}
+		}
+
+		if (a->fd > -1)
+			close(a->fd);
+		a->fd = -1;
+		if (ret != 0) {
+			return (-1);
+		}
+		cpio_archive_journal_done(a);
+		return (0);
+	}
+
+	/* For read we're not doing anything else */
+
+	return (0);
+}
+
+int
+cpio_archive_free(struct cpio_archive *a)
+{
+	int i;
+
+	if (a->fd > -1)
+		close(a->fd);
+	if (a->base.dc != NULL)
+		dir_cache_free(a->base.dc);
+	if (a->base.fd > -1)
+		close(a->base.fd);
+	file_list_free(a->files.fl);
+	a->files.fl = NULL;
+	free(a->files.st);
+	for (i = 0; i < a->durable.n; i++) {
+		close(a->durable.p[i].fd);
+		free(a->durable.p[i].path);
+	}
+	free(a->durable.p);
+	journal_free(a->journal.j);
+	free(a->journal.path);
+	(void) cpio_archive_close_outputs(a);
+	for (i = 0; i < a->outputs.n; i++) {
+		free(a->outputs.names[i]);
+	}
+	free(a->outputs.names);
+	free(a->outputs.ids);
+	free(a->archive_filename);
+	free(a->base.dirname);
+	cpio_archive_release(a, a->read.buf);
+	cpio_archive_release(a, a->read.name);
+	cpio_archive_release(a, a->read.path);
+	cpio_archive_release(a, a->write.buf);
+	cpio_archive_release(a, a->write.hdr);
+	free(a->budget.arena);
+	free(a->csum.computed.buf);
+	free(a->csum.stored.buf);
+	if (a->lat != NULL)
+		latency_stats_free(a->lat);
+	free(a);
+	return (0);
+}
+
+int
+cpio_archive_set_base_directory(struct cpio_archive *a, const char *dirname)
+{
+	if (a->base.dc != NULL)
+		dir_cache_free(a->base.dc);
+	a->base.dc = NULL;
+	if (a->base.fd > -1)
+		close(a->base.fd);
+	if (a->base.dirname)
+		free(a->base.dirname);
+	a->base.fd = -1;
+	a->base.dirname = NULL;
+
+	a->base.dirname = strdup(dirname);
+	if (a->base.dirname == NULL) {
+		warn("%s: strdup", __func__);
+		return (-1);
+	}
+	a->base.fd = open(dirname, O_RDONLY);
+	if (a->base.fd == -1) {
+		warn("%s: open (%s)", __func__, dirname);
+		return (-1);
+	}
+	return (0);
+}
+
+/*
+ * Write a file into the current archive.
+ *
+ * The file is found as 'name' relative to dirfd and is stored in the
+ * archive as 'filename'.  If the caller already has a stat for the
+ * file it can be passed in as 'st' to avoid looking it up again, and
+ * if it already has a regular file open it can pass that as 'fd'
+ * (which is then closed here); otherwise fd is -1.
+ *
+ * TODO: symlinks/hardlinks need the destination link provided
+ *       as the file payload; that is currently definitely not
+ *       yet implemented!
+ */
+static int
+cpio_archive_write_file_at(struct cpio_archive *a, int dirfd,
+    const char *name, const char *filename, const struct stat *st, int fd)
+{
+	struct cpio_header c;
+	struct stat sb;
+	int ret;
+	ssize_t rret, wret, wlen;
+	/* XXX TODO: make this 4x the block size.. */
+	char buf[XCPIO_WRITE_BUF_SIZE];
+	int slen;
+	uint32_t crc;
+	uint64_t t_open = 0, t_data = 0, t_close = 0;
+
+	if (a->lat != NULL)
+		t_open = cpio_stats_now_ns();
+
+	/*
+	 * Note: we can't open non-regular files; so do fstatat() first.
+	 */
+	if (st != NULL) {
+		sb = *st;
+	} else {
+		ret = fstatat(dirfd, name, &sb, 0);
+		if (ret < 0) {
+			warn("fstatat (%s)", filename);
+			goto fail;
+		}
+	}
+
+	/*
+	 * Only open the file if it's a real file.
+	 */
+	if (S_ISREG(sb.st_mode)) {
+		if (fd < 0)
+			fd = openat(dirfd, name, O_RDONLY);
+		if (fd < 0) {
+			warn("open (%s)", filename);
+			goto fail;
+		}
+
+		/*
+		 * Re-do the fstat now.
+		 */
+		ret = fstat(fd, &sb);
+		if (ret != 0) {
+			warn("stat (%s)", filename);
+			goto fail;
+		}
+	}
+
+	/*
+	 * If it's not a regular file then override the st_size
+	 * field.  Nothing but regular files has a payload written
+	 * (yet); later support for symlink/hardlinks will have the
+	 * destination file path as the payload.
+	 */
+	if (! S_ISREG(sb.st_mode)) {
+		sb.st_size = 0;
+	}
+
+	/* The header is serialised straight from the caller's name */
+	c.st = sb;
+	c.filename = (char *) filename;
+	slen = cpio_header_serialise_into(&c, a->write.hdr, a->write.hdr_size);
+	if (slen < 0) {
+		fprintf(stderr, "%s: header doesn't fit (%s)\n", __func__,
+		    filename);
+		goto fail;
+	}
+	if (cpio_archive_write_data(a, a->write.hdr, slen) <= 0) {
+		goto fail;
+	}
+	cpio_stats_peak_buffer(a, a->write.size + slen + XCPIO_WRITE_BUF_SIZE);
+	if (S_ISDIR(sb.st_mode))
+		a->stats.dirs++;
+	else
+		a->stats.files++;
+
+	if (a->lat != NULL)
+		t_data = t_close = cpio_stats_now_ns();
+
+	crc = 0;
+	if (fd != -1) {
+		/*
+		 * Yeah yeah 1k read/write is tiny, but for this use case it's
+		 * fine.
+		 */
+		while (1) {
+			/* Note: this reads from the file we opened */
+			rret = read(fd, buf, XCPIO_WRITE_BUF_SIZE);
+			a->stats.file_read.calls++;
+			if (rret > 0)
+				a->stats.file_read.bytes += rret;
+			if (rret == 0) {
+				break;
+			}
+			if (rret < 0) {
+				warn("read");
+				goto fail;
+			}
+			if (a->csum.enabled) {
+				crc = crc32c(crc, buf, rret);
+			}
+			wlen = 0;
+			while (wlen < rret) {
+				/*
+				 * Note: this writes to the underlying device
+				 * and THIS must be block sized writes!
+				 */
+				wret = cpio_archive_write_data(a, buf + wlen, rret - wlen);
+				if (wret <= 0) {
+					warn("write");
+					goto fail;
+				}
+				wlen += wret;
+			}
+		}
+
+		if (a->lat != NULL)
+			t_close = cpio_stats_now_ns();
 		close(fd);
 	}
-	cpio_header_free(c);
+	if (a->csum.enabled) {
+		(void) cpio_csum_add(&a->csum.computed, crc, filename);
+	}
+	if (a->lat != NULL) {
+		latency_stats_add(a->lat, filename, t_data - t_open,
+		    t_close - t_data, cpio_stats_now_ns() - t_close);
+	}
 	return (0);
 
 fail:
-	if (c)
-		cpio_header_free(c);
 	if (fd != -1)
 		close(fd);
 	return (-1);
 }
 
-int
-cpio_archive_write_add_manifest(struct cpio_archive *a, const char *filename)
+/*
+ * Write a file into the current archive. filename is either a
+ * full path or a relative to the defined base path / current working
+ * directory.
+ */
+int
+cpio_archive_write_file(struct cpio_archive *a, const char *filename)
+{
+
+	return (cpio_archive_write_file_at(a, a->base.fd, filename, filename,
+	    NULL, -1));
+}
+
+int
+cpio_archive_write_add_manifest(struct cpio_archive *a, const char *filename)
+{
+
+	return (cpio_archive_write_add_manifest_len(a, filename,
+	    strlen(filename)));
+}
+
+/*
+ * As above, but the filename is the len bytes at filename and needn't
+ * be NUL terminated; eg a record in a mapped manifest.
+ */
+int
+cpio_archive_write_add_manifest_len(struct cpio_archive *a,
+    const char *filename, size_t len)
+{
+
+	/* Any cached stats no longer line up with the list */
+	free(a->files.st);
+	a->files.st = NULL;
+	return (file_list_add_entry_len(a->files.fl, filename, len));
+}
+
+struct cpio_archive_stat_job {
+	struct cpio_archive *a;
+	int next;		/* next unclaimed entry */
+};
+
+#define	XCPIO_STAT_BATCH	256
+
+static void *
+cpio_archive_stat_worker(void *arg)
+{
+	struct cpio_archive_stat_job *j = arg;
+	struct cpio_archive *a = j->a;
+	int i, end, n = a->files.fl->nentries;
+
+	while ((i = __atomic_fetch_add(&j->next, XCPIO_STAT_BATCH,
+	    __ATOMIC_RELAXED)) < n) {
+		end = MIN(i + XCPIO_STAT_BATCH, n);
+		for (; i < end; i++) {
+			if (fstatat(a->base.fd, a->files.fl->file_list[i],
+			    &a->files.st[i], 0) != 0) {
+				/* The writer will retry and log it */
+				a->files.st[i].st_mode = 0;
+			}
+		}
+	}
+	return (NULL);
+}
+
+/*
+ * Stat every file in the list up front, using nthreads threads, and
+ * keep the results for planning, ordering and writing.  Each worker
+ * claims batches of entries so the stats run in parallel on storage
+ * that can service many at once (NVMe, network filesystems.)
+ *
+ * This must be done after the base directory is set.
+ */
+int
+cpio_archive_stat_files(struct cpio_archive *a, int nthreads)
+{
+	struct cpio_archive_stat_job job;
+	pthread_t *tids;
+	int i, nstarted = 0, n = a->files.fl->nentries;
+
+	free(a->files.st);
+	a->files.st = calloc(n > 0 ? n : 1, sizeof(struct stat));
+	if (a->files.st == NULL) {
+		warn("%s: calloc", __func__);
+		return (-1);
+	}
+
+	job.a = a;
+	job.next = 0;
+
+	nthreads = MAX(1, MIN(nthreads, n / XCPIO_STAT_BATCH + 1));
+	tids = calloc(nthreads, sizeof(*tids));
+	if (tids != NULL) {
+		for (i = 1; i < nthreads; i++) {
+			if (pthread_create(&tids[nstarted], NULL,
+			    cpio_archive_stat_worker, &job) != 0)
+				break;
+			nstarted++;
+		}
+	}
+
+	/* This thread works too, and finishes alone if none started */
+	(void) cpio_archive_stat_worker(&job);
+
+	for (i = 0; i < nstarted; i++)
+		pthread_join(tids[i], NULL);
+	free(tids);
+	return (0);
+}
+
+/*
+ * The cached stat for entry i, or NULL if there isn't one (or the
+ * stat failed.)
+ */
+static const struct stat *
+cpio_archive_cached_stat(struct cpio_archive *a, int i)
+{
+
+	if ((a->files.st == NULL) || (a->files.st[i].st_mode == 0))
+		return (NULL);
+	return (&a->files.st[i]);
+}
+
+int
+cpio_archive_set_order(struct cpio_archive *a, cpio_archive_order order)
+{
+
+	a->files.order = order;
+	return (0);
+}
+
+/*
+ * An entry in the table of files to read ahead, in read order.
+ */
+struct cpio_archive_order_entry {
+	int idx;		/* index into the manifest */
+	int fd;			/* the open file, handed to the writer */
+	uint64_t dev;
+	uint64_t key;		/* inode or physical offset */
+	off_t size;
+};
+
+/*
+ * Find the physical offset of the first extent of the given file.
+ *
+ * This is only available via FIEMAP on Linux; everywhere else (and
+ * for files with no mapped extents) fall back to the inode number,
+ * which on most filesystems still loosely tracks allocation order.
+ */
+static uint64_t
+cpio_archive_order_extent(int fd, const struct stat *sb)
+{
+#ifdef	__linux__
+	struct {
+		struct fiemap fm;
+		struct fiemap_extent fe;
+	} f;
+
+	memset(&f, 0, sizeof(f));
+	f.fm.fm_start = 0;
+	f.fm.fm_length = FIEMAP_MAX_OFFSET;
+	f.fm.fm_extent_count = 1;
+	if ((ioctl(fd, FS_IOC_FIEMAP, &f.fm) == 0) &&
+	    (f.fm.fm_mapped_extents > 0)) {
+		return (f.fe.fe_physical);
+	}
+#endif
+	return (sb->st_ino);
+}
+
+/*
+ * Sort files by physical locality; ties go back to the manifest
+ * order so the reads are repeatable.
+ */
+static int
+cpio_archive_order_cmp(const void *a, const void *b)
+{
+	const struct cpio_archive_order_entry *ea = a, *eb = b;
+
+	if (ea->dev != eb->dev)
+		return (ea->dev < eb->dev ? -1 : 1);
+	if (ea->key != eb->key)
+		return (ea->key < eb->key ? -1 : 1);
+	return (ea->idx - eb->idx);
+}
+
+/*
+ * Open the window of regular files starting at manifest index 'start'
+ * (up to XCPIO_ORDER_WINDOW entries or XCPIO_ORDER_BYTES of payload)
+ * and ask for them to be read into the page cache in the requested
+ * order, so the writer then finds them there.
+ *
+ * Each file's fd is left in fds[] (indexed from 'start', -1 if there
+ * isn't one) for the writer to read and close, so each file is only
+ * opened once.  Returns the index just past the window.
+ */
+static int
+cpio_archive_order_window(struct cpio_archive *a, int start,
+    struct cpio_archive_order_entry *t, int *fds)
+{
+	struct stat sb;
+	uint64_t bytes = 0;
+	int i, end, nt = 0, n = a->files.fl->nentries;
+
+	for (i = start; (i < n) && (i - start < XCPIO_ORDER_WINDOW); i++) {
+		const char *fn = a->files.fl->file_list[i];
+		const struct stat *cst;
+		int fd;
+
+		fds[i - start] = -1;
+		if (bytes >= XCPIO_ORDER_BYTES) {
+			break;
+		}
+		/* Anything that fails here is left to the writer */
+		if ((cst = cpio_archive_cached_stat(a, i)) != NULL) {
+			sb = *cst;
+		} else if (fstatat(a->base.fd, fn, &sb, 0) != 0) {
+			continue;
+		}
+		if (! S_ISREG(sb.st_mode) || (sb.st_size == 0)) {
+			continue;
+		}
+		fd = openat(a->base.fd, fn, O_RDONLY);
+		if (fd < 0) {
+			continue;
+		}
+		fds[i - start] = fd;
+		t[nt].idx = i;
+		t[nt].fd = fd;
+		t[nt].dev = sb.st_dev;
+		t[nt].size = sb.st_size;
+		if (a->files.order == CPIO_ARCHIVE_ORDER_EXTENT) {
+			t[nt].key = cpio_archive_order_extent(fd, &sb);
+		} else {
+			t[nt].key = sb.st_ino;
+		}
+		bytes += sb.st_size;
+		nt++;
+	}
+
+	end = i;
+
+	qsort(t, nt, sizeof(*t), cpio_archive_order_cmp);
+#ifdef	POSIX_FADV_WILLNEED
+	for (i = 0; i < nt; i++) {
+		(void) posix_fadvise(t[i].fd, 0, t[i].size,
+		    POSIX_FADV_WILLNEED);
+	}
+#endif
+	return (end);
+}
+
+/*
+ * Write the files to the current archive.  This iterates over the file list
+ * but does not flush/empty it.
+ *
+ * Files are always written in manifest order, so the archive doesn't
+ * depend on how the tree is laid out on disk.  If another order was
+ * requested then the manifest is taken a window at a time and each
+ * window's files are read ahead in that order before being written.
+ */
+int
+cpio_archive_write_files(struct cpio_archive *a)
+{
+	struct cpio_archive_order_entry *t = NULL;
+	int fds[XCPIO_ORDER_WINDOW];
+	int i, j, fd, start = 0, end;
+
+	/* XXX TODO: iterator */
+
+	if (a->files.order != CPIO_ARCHIVE_ORDER_MANIFEST) {
+		t = calloc(XCPIO_ORDER_WINDOW, sizeof(*t));
+		if (t == NULL) {
+			warn("%s: calloc", __func__);
+			return (-1);
+		}
+	}
+
+	/* A resumed job has already written the first entries */
+	end = a->journal.entries;
+	for (i = a->journal.entries; i < a->files.fl->nentries; i++) {
+		fd = -1;
+		if (t != NULL) {
+			if (i == end) {
+				start = i;
+				end = cpio_archive_order_window(a, start, t,
+				    fds);
+			}
+			fd = fds[i - start];
+			fds[i - start] = -1;
+		}
+
+		/*
+		 * For now don't error out if we fail to write a file;
+		 * just log a warning and continue.
+		 */
+		if (cpio_archive_write_file_at(a, a->base.fd,
+		    a->files.fl->file_list[i], a->files.fl->file_list[i],
+		    cpio_archive_cached_stat(a, i), fd) != 0) {
+			fprintf(stderr, "%s: failed to write file (%s)\n",
+			    __func__,
+			    a->files.fl->file_list[i]);
+			a->stats.errors++;
+		}
+		a->journal.entries++;
+		if (cpio_archive_journal_progress(a) != 0) {
+			/* Close the rest of the window */
+			for (j = i + 1; (t != NULL) && (j < end) &&
+			    (j < a->files.fl->nentries); j++) {
+				if (fds[j - start] > -1)
+					close(fds[j - start]);
+			}
+			free(t);
+			return (-1);
+		}
+	}
+
+	free(t);
+	return (0);
+}
+
+/*
+ * One output of a sharded create.
+ */
+struct cpio_archive_shard {
+	struct cpio_archive *a;
+	uint64_t bytes;		/* assigned so far */
+	int ret;
+	pthread_t thr;
+};
+
+struct cpio_archive_shard_entry {
+	int idx;		/* index into the manifest */
+	uint64_t bytes;
+};
+
+/*
+ * Biggest first; ties in manifest order so the split is repeatable.
+ */
+static int
+cpio_archive_shard_cmp(const void *a, const void *b)
+{
+	const struct cpio_archive_shard_entry *ea = a, *eb = b;
+
+	if (ea->bytes != eb->bytes)
+		return (ea->bytes > eb->bytes ? -1 : 1);
+	return (ea->idx - eb->idx);
+}
+
+static void *
+cpio_archive_shard_worker(void *arg)
+{
+	struct cpio_archive_shard *s = arg;
+
+	s->ret = -1;
+	if (cpio_archive_open(s->a) < 0) {
+		fprintf(stderr, "%s: failed to open '%s'\n", __func__,
+		    s->a->archive_filename);
+		return (NULL);
+	}
+	/* Leave a failed shard without a trailer */
+	if ((cpio_archive_write_files(s->a) != 0) ||
+	    (cpio_archive_close(s->a) != 0)) {
+		return (NULL);
+	}
+	s->ret = 0;
+	return (NULL);
+}
+
+static void
+cpio_archive_stats_add(struct cpio_archive_stats *d,
+    const struct cpio_archive_stats *s)
+{
+
+	d->archive_write.calls += s->archive_write.calls;
+	d->archive_write.bytes += s->archive_write.bytes;
+	d->file_read.calls += s->file_read.calls;
+	d->file_read.bytes += s->file_read.bytes;
+	d->files += s->files;
+	d->dirs += s->dirs;
+	d->skipped += s->skipped;
+	d->errors += s->errors;
+	d->peak_buffer_bytes += s->peak_buffer_bytes;
+}
+
+/*
+ * Split the manifest into nshards independent archives, named
+ * "<archive>.0" to "<archive>.<nshards - 1>", and write them
+ * concurrently, one thread each.  Every shard is a complete archive
+ * with its own trailer.
+ *
+ * Entries are balanced by size (header plus payload) with a greedy
+ * longest-first assignment: biggest entry to the least loaded shard.
+ * Directories are put in every shard so any shard can be extracted
+ * first and still get their modes right.  Each shard keeps its entries
+ * in manifest order.
+ *
+ * The archive itself isn't opened; it only holds the manifest and
+ * settings.
+ */
+int
+cpio_archive_write_shards(struct cpio_archive *a, int nshards)
+{
+	struct cpio_archive_shard *s;
+	struct cpio_archive_shard_entry *e = NULL;
+	struct cpio_archive *sa;
+	const struct stat *sb;
+	char *name;
+	int *owner = NULL;
+	int i, j, k, ne = 0, best, n = a->files.fl->nentries, ret = 0;
+
+	if ((nshards < 1) || (a->mode != CPIO_ARCHIVE_MODE_WRITE)) {
+		return (-1);
+	}
+	if ((a->files.st == NULL) &&
+	    (cpio_archive_stat_files(a, nshards) != 0)) {
+		return (-1);
+	}
+
+	s = calloc(nshards, sizeof(*s));
+	owner = calloc(n > 0 ? n : 1, sizeof(*owner));
+	e = calloc(n > 0 ? n : 1, sizeof(*e));
+	if ((s == NULL) || (owner == NULL) || (e == NULL)) {
+		warn("%s: calloc", __func__);
+		ret = -1;
+		goto done;
+	}
+
+	for (i = 0; i < nshards; i++) {
+		if (asprintf(&name, "%s.%d", a->archive_filename, i) < 0) {
+			ret = -1;
+			goto done;
+		}
+		sa = s[i].a = cpio_archive_create(name, CPIO_ARCHIVE_MODE_WRITE);
+		free(name);
+		if ((sa == NULL) ||
+		    (cpio_archive_set_base_directory(sa, a->base.dirname != NULL ?
+		    a->base.dirname : ".") != 0)) {
+			ret = -1;
+			goto done;
+		}
+		cpio_archive_set_blocksize(sa, a->block_size);
+		cpio_archive_set_order(sa, a->files.order);
+		cpio_archive_set_checksum(sa, a->csum.enabled);
+	}
+
+	/* Directories everywhere; the rest biggest first */
+	for (i = 0; i < n; i++) {
+		sb = cpio_archive_cached_stat(a, i);
+		if ((sb != NULL) && S_ISDIR(sb->st_mode)) {
+			owner[i] = -1;
+			continue;
+		}
+		e[ne].idx = i;
+		e[ne].bytes = CPIO_HEADER_SIZE +
+		    strlen(a->files.fl->file_list[i]) + 1;
+		if ((sb != NULL) && S_ISREG(sb->st_mode))
+			e[ne].bytes += sb->st_size;
+		ne++;
+	}
+	qsort(e, ne, sizeof(*e), cpio_archive_shard_cmp);
+	for (i = 0; i < ne; i++) {
+		best = 0;
+		for (j = 1; j < nshards; j++) {
+			if (s[j].bytes < s[best].bytes)
+				best = j;
+		}
+		owner[e[i].idx] = best;
+		s[best].bytes += e[i].bytes;
+	}
+
+	/* Hand out the entries, and their cached stats, in order */
+	for (j = 0; j < nshards; j++) {
+		sa = s[j].a;
+		sa->files.st = calloc(n > 0 ? n : 1, sizeof(struct stat));
+		if (sa->files.st == NULL) {
+			warn("%s: calloc", __func__);
+			ret = -1;
+			goto done;
+		}
+		for (i = 0, k = 0; i < n; i++) {
+			if ((owner[i] != -1) && (owner[i] != j))
+				continue;
+			if (file_list_add_entry(sa->files.fl,
+			    a->files.fl->file_list[i]) != 0) {
+				ret = -1;
+				goto done;
+			}
+			sa->files.st[k++] = a->files.st[i];
+		}
+	}
+
+	for (i = 0; i < nshards; i++) {
+		if (pthread_create(&s[i].thr, NULL, cpio_archive_shard_worker,
+		    &s[i]) != 0) {
+			/* Do it here instead */
+			(void) cpio_archive_shard_worker(&s[i]);
+			s[i].thr = pthread_self();
+		}
+	}
+	for (i = 0; i < nshards; i++) {
+		if (! pthread_equal(s[i].thr, pthread_self()))
+			pthread_join(s[i].thr, NULL);
+		if (s[i].ret != 0)
+			ret = -1;
+		cpio_archive_stats_add(&a->stats, &s[i].a->stats);
+	}
+
+done:
+	for (i = 0; (s != NULL) && (i < nshards); i++) {
+		if (s[i].a != NULL)
+			cpio_archive_free(s[i].a);
+	}
+	free(s);
+	free(owner);
+	free(e);
+	return (ret);
+}
+
+/*
+ * Record which files the archive is being written to: the archive and
+ * every extra output.  Open ones are fstat'ed; before opening, whatever
+ * is at each name now is used ("-" being stdout), since that's what a
+ * sizing pass would otherwise count.  Only regular files are kept.
+ */
+static int
+cpio_archive_note_outputs(struct cpio_archive *a)
+{
+	struct stat sb;
+	const char *name;
+	int i, r;
+
+	free(a->outputs.ids);
+	a->outputs.nids = 0;
+	a->outputs.ids = calloc(a->outputs.n + 1, sizeof(*a->outputs.ids));
+	if (a->outputs.ids == NULL) {
+		warn("%s: calloc", __func__);
+		return (-1);
+	}
+
+	for (i = 0; i <= a->outputs.n; i++) {
+		name = (i == 0) ? a->archive_filename : a->outputs.names[i - 1];
+		if ((i == 0) && (a->fd > -1)) {
+			r = fstat(a->fd, &sb);
+		} else if ((i > 0) && (a->outputs.fds != NULL)) {
+			r = fstat(a->outputs.fds[i], &sb);
+		} else if ((i == 0) && (a->io.ops != NULL)) {
+			/* A caller supplied backend; no file */
+			continue;
+		} else if (strcmp(name, "-") == 0) {
+			r = fstat(STDOUT_FILENO, &sb);
+		} else {
+			r = stat(name, &sb);
+		}
+		if ((r != 0) || ! S_ISREG(sb.st_mode)) {
+			continue;
+		}
+		a->outputs.ids[a->outputs.nids].dev = sb.st_dev;
+		a->outputs.ids[a->outputs.nids].ino = sb.st_ino;
+		a->outputs.nids++;
+	}
+	return (0);
+}
+
+/*
+ * Whether sb is one of the files noted by cpio_archive_note_outputs().
+ */
+static bool
+cpio_archive_is_output(const struct cpio_archive *a, const struct stat *sb)
+{
+	int i;
+
+	for (i = 0; i < a->outputs.nids; i++) {
+		if ((a->outputs.ids[i].dev == sb->st_dev) &&
+		    (a->outputs.ids[i].ino == sb->st_ino))
+			return (true);
+	}
+	return (false);
+}
+
+static int
+cpio_archive_write_tree_cb(void *arg, int dirfd, const char *name,
+    const char *path, struct stat *sb)
+{
+	struct cpio_archive *a = arg;
+
+	/* Never archive the archive; it would grow as it's read */
+	if (cpio_archive_is_output(a, sb)) {
+		fprintf(stderr, "%s: skipping the archive itself (%s)\n",
+		    __func__, path);
+		a->stats.skipped++;
+		return (0);
+	}
+
+	/* There's no symlink payload support yet; don't store broken ones */
+	if (S_ISLNK(sb->st_mode)) {
+		fprintf(stderr, "%s: skipping symlink (%s)\n", __func__, path);
+		a->stats.skipped++;
+		return (0);
+	}
+
+	/*
+	 * Like the manifest path, a failure to write one file is
+	 * logged and the walk carries on.
+	 */
+	if (cpio_archive_write_file_at(a, dirfd, name, path, sb, -1) != 0) {
+		fprintf(stderr, "%s: failed to write file (%s)\n",
+		    __func__, path);
+		a->stats.errors++;
+	}
+	return (0);
+}
+
+/*
+ * Walk the base directory and write everything under it to the
+ * archive, instead of using the manifest.
+ *
+ * Directories are written before their contents, so extracting the
+ * result doesn't depend on the ordering of anything external.
+ */
+int
+cpio_archive_write_tree(struct cpio_archive *a)
+{
+
+	if (cpio_archive_note_outputs(a) != 0) {
+		return (-1);
+	}
+	return (tree_walk(a->base.fd, cpio_archive_write_tree_cb, a));
+}
+
+/*
+ * Account for a single entry in the plan, using the same header
+ * serialisation and st_size rules as cpio_archive_write_file_at().
+ */
+static int
+cpio_archive_plan_entry(struct cpio_archive_plan *p, const char *filename,
+    const struct stat *st)
+{
+	struct stat sb;
+	int slen;
+
+	sb = *st;
+	if (! S_ISREG(sb.st_mode)) {
+		sb.st_size = 0;
+	}
+
+	/* Header plus filename and its NUL; no need to serialise it */
+	slen = CPIO_HEADER_SIZE + strlen(filename) + 1;
+
+	p->data_bytes += slen + sb.st_size;
+	p->payload_bytes += sb.st_size;
+	p->max_header_bytes = MAX(p->max_header_bytes, slen);
+	p->entries++;
+	return (0);
+}
+
+struct cpio_archive_plan_walk {
+	struct cpio_archive *a;
+	struct cpio_archive_plan *p;
+};
+
+static int
+cpio_archive_plan_tree_cb(void *arg, int dirfd __unused,
+    const char *name __unused, const char *path, struct stat *sb)
+{
+	struct cpio_archive_plan_walk *w = arg;
+	struct cpio_archive_plan *p = w->p;
+
+	/*
+	 * Symlinks and the archive itself are skipped by
+	 * cpio_archive_write_tree_cb()
+	 */
+	if (S_ISLNK(sb->st_mode) || cpio_archive_is_output(w->a, sb)) {
+		return (0);
+	}
+	if (cpio_archive_plan_entry(p, path, sb) != 0) {
+		p->errors++;
+	}
+	return (0);
+}
+
+/*
+ * Work out exactly how big the archive will be without reading any
+ * file contents.  This stats everything in the manifest (or walks the
+ * base directory if 'walk' is true) and sizes the headers, payloads
+ * and trailer the same way the writer does.
+ *
+ * Entries that can't be stat'ed are counted as errors; the writer
+ * will skip them too.  When appending, archive_bytes also counts the
+ * existing archive up to its trailer.
+ */
+int
+cpio_archive_plan(struct cpio_archive *a, bool walk,
+    struct cpio_archive_plan *p)
+{
+	struct cpio_archive_plan_walk w;
+	struct stat sb;
+	off_t offset;
+	int i, fd;
+
+	bzero(p, sizeof(*p));
+
+	if (walk) {
+		w.a = a;
+		w.p = p;
+		if (cpio_archive_note_outputs(a) != 0) {
+			return (-1);
+		}
+		if (tree_walk(a->base.fd, cpio_archive_plan_tree_cb, &w) != 0) {
+			return (-1);
+		}
+	} else {
+		for (i = 0; i < a->files.fl->nentries; i++) {
+			const char *fn = a->files.fl->file_list[i];
+			const struct stat *cst;
+
+			if ((cst = cpio_archive_cached_stat(a, i)) != NULL) {
+				sb = *cst;
+			} else if (a->files.st != NULL) {
+				/* We already know this one fails */
+				p->errors++;
+				continue;
+			} else if (fstatat(a->base.fd, fn, &sb, 0) != 0) {
+				p->errors++;
+				continue;
+			}
+			if (cpio_archive_plan_entry(p, fn, &sb) != 0) {
+				p->errors++;
+			}
+		}
+	}
+
+	/* The trailer */
+	bzero(&sb, sizeof(sb));
+	if (cpio_archive_plan_entry(p, "TRAILER!!!", &sb) != 0) {
+		return (-1);
+	}
+	p->entries--;
+
+	/* Appending keeps everything up to the existing trailer */
+	if ((a->mode == CPIO_ARCHIVE_MODE_APPEND) && (a->io.ops == NULL) &&
+	    (strcmp(a->archive_filename, "-") != 0)) {
+		fd = open(a->archive_filename, O_RDONLY);
+		if (fd > -1) {
+			if ((fstat(fd, &sb) == 0) && S_ISREG(sb.st_mode) &&
+			    (sb.st_size > 0)) {
+				offset = cpio_archive_find_trailer(a, fd, NULL,
+				    NULL);
+				if (offset < 0) {
+					close(fd);
+					return (-1);
+				}
+				p->existing_bytes = offset;
+			}
+			close(fd);
+		}
+	}
+
+	p->archive_bytes = roundup(p->existing_bytes + p->data_bytes,
+	    (uint64_t) a->block_size);
+
+	/*
+	 * The writer holds one block of staging buffer, one serialised
+	 * header and one file read buffer at a time.
+	 */
+	p->peak_buffer_bytes = a->block_size + p->max_header_bytes +
+	    XCPIO_WRITE_BUF_SIZE;
+	return (0);
+}
+
+/*
+ * Given a plan for an opened archive, make sure the destination has
+ * room for it and preallocate that space.
+ *
+ * This only applies to regular files; pipes and devices are left
+ * alone.  When appending, the partial block that is rewritten is
+ * accounted for.
+ */
+int
+cpio_archive_reserve(struct cpio_archive *a,
+    const struct cpio_archive_plan *p)
+{
+	struct statvfs sv;
+	struct stat sb;
+	uint64_t need, avail;
+
+	if ((fstat(a->fd, &sb) != 0) || ! S_ISREG(sb.st_mode)) {
+		return (0);
+	}
+
+	need = roundup(a->write.len + p->data_bytes, (uint64_t) a->block_size);
+
+	if (fstatvfs(a->fd, &sv) == 0) {
+		avail = (uint64_t) sv.f_bavail * sv.f_frsize;
+		if (need > avail) {
+			fprintf(stderr, "%s: not enough space for archive "
+			    "(%s); need %llu bytes, %llu available\n",
+			    __func__, a->archive_filename,
+			    (unsigned long long) need,
+			    (unsigned long long) avail);
+			return (-1);
+		}
+	}
+
+	return (cpio_archive_preallocate(a, need));
+}
+
+/*
+ * Find the directory the current entry lives in, creating any
+ * missing directories on the way.  *leaf is set to point at the
+ * entry name inside a sanitised copy of the filename.
+ */
+static int
+cpio_archive_destination_parent(struct cpio_archive *a, char **leaf)
+{
+	int parent_fd;
+
+	if (a->base.dc == NULL) {
+		a->base.dc = dir_cache_create(a->base.fd);
+		if (a->base.dc == NULL) {
+			return (-1);
+		}
+	}
+
+	if (cpio_path_sanity_filter(a->read.c->filename, a->read.path,
+	    a->read.name_size) != 0) {
+		/* XXX TODO: log error */
+		return (-1);
+	}
+
+	parent_fd = dir_cache_parent(a->base.dc, a->read.path, true, leaf);
+	if (parent_fd == -1) {
+		fprintf(stderr, "%s: couldn't find parent directory (%s)\n",
+		    __func__, a->read.c->filename);
+		return (-1);
+	}
+	return (parent_fd);
+}
+
+/*
+ * Make sure everything written since the last checkpoint is on disk,
+ * then rename the pending files into place.
+ *
+ * The data is flushed first so a rename never exposes a file whose
+ * contents could still be lost.  On Linux one syncfs() on the
+ * destination filesystem does that for the whole batch; elsewhere
+ * each pending file gets an fdatasync() here rather than as it's
+ * written.
+ */
+static int
+cpio_archive_checkpoint(struct cpio_archive *a)
+{
+	struct cpio_pending *p;
+	char proc[64], *leaf;
+	int i, parent_fd, ret = 0;
+
+	if (a->durable.n == 0) {
+		return (0);
+	}
+
+#ifdef	__linux__
+	a->stats.syncs++;
+	if (syncfs(a->base.fd) != 0) {
+		warn("%s: syncfs", __func__);
+		ret = -1;
+	}
+#else
+	for (i = 0; i < a->durable.n; i++) {
+		a->stats.syncs++;
+		if (fdatasync(a->durable.p[i].fd) != 0) {
+			warn("%s: fdatasync (%s)", __func__,
+			    a->durable.p[i].path);
+			ret = -1;
+		}
+	}
+#endif
+
+	/* The previous checkpoint's renames are on disk now too */
+	if ((ret == 0) && (a->journal.j != NULL) && a->journal.have_prev &&
+	    (cpio_archive_journal_save(a, a->journal.prev_entries,
+	    a->journal.prev_offset) != 0)) {
+		ret = -1;
+	}
+
+	for (i = 0; i < a->durable.n; i++) {
+		p = &a->durable.p[i];
+
+		/* The current member is done with; reuse its path scratch */
+		parent_fd = -1;
+		if (cpio_path_sanity_filter(p->path, a->read.path,
+		    a->read.name_size) == 0) {
+			parent_fd = dir_cache_parent(a->base.dc, a->read.path,
+			    true, &leaf);
+		}
+		if (parent_fd == -1) {
+			fprintf(stderr, "%s: couldn't find parent directory "
+			    "(%s)\n", __func__, p->path);
+			a->stats.errors++;
+			ret = -1;
+			goto next;
+		}
+
+		/* An O_TMPFILE file needs a name before it can be renamed */
+		if (! p->linked) {
+			snprintf(proc, sizeof(proc), "/proc/self/fd/%d", p->fd);
+			if ((linkat(AT_FDCWD, proc, parent_fd, p->tmp,
+			    AT_SYMLINK_FOLLOW) != 0) &&
+			    (linkat(p->fd, "", parent_fd, p->tmp,
+			    AT_EMPTY_PATH) != 0)) {
+				warn("%s: linkat (%s)", __func__, p->path);
+				a->stats.errors++;
+				ret = -1;
+				goto next;
+			}
+		}
+		if (renameat(parent_fd, p->tmp, parent_fd, leaf) != 0) {
+			warn("%s: renameat (%s)", __func__, p->path);
+			(void) unlinkat(parent_fd, p->tmp, 0);
+			a->stats.errors++;
+			ret = -1;
+		}
+next:
+		close(p->fd);
+		free(p->path);
+		p->path = NULL;
+	}
+	a->durable.n = 0;
+	a->durable.bytes = 0;
+	a->stats.checkpoints++;
+
+	/* Called at the end of a member, so this is a member boundary */
+	if (ret == 0) {
+		a->journal.have_prev = true;
+		a->journal.prev_entries = a->journal.entries;
+		a->journal.prev_offset = a->read.offset - a->read.buf_len;
+	}
+	return (ret);
+}
+
+/*
+ * Open an unnamed (O_TMPFILE) or temporary named file in the parent
+ * directory for the current member.  durable.tmp is the name it has,
+ * or will be linked in as at the checkpoint.
+ */
+static int
+cpio_archive_open_temp(struct cpio_archive *a, int parent_fd)
+{
+	mode_t mode = a->read.c->st.st_mode & 07777;
+	int fd;
+
+	snprintf(a->durable.tmp, sizeof(a->durable.tmp), ".xcpio.%ld.%llu",
+	    (long) getpid(), (unsigned long long) ++a->durable.seq);
+
+#ifdef	O_TMPFILE
+	fd = openat(parent_fd, ".", O_TMPFILE | O_WRONLY, mode);
+	if (fd >= 0) {
+		a->durable.linked = false;
+		return (fd);
+	}
+	/* Not supported by this filesystem; fall back to a name */
+#endif
+	a->durable.linked = true;
+	fd = openat(parent_fd, a->durable.tmp, O_WRONLY | O_CREAT | O_EXCL,
+	    mode);
+	if (fd < 0) {
+		warn("%s: openat (%s)", __func__, a->read.c->filename);
+	}
+	return (fd);
+}
+
+/*
+ * Done writing the current member's file.  Normally it's just closed;
+ * in durable mode it's queued for the next checkpoint, which happens
+ * once enough files or data are pending.
+ */
+static int
+cpio_archive_finish_destination(struct cpio_archive *a, int fd)
+{
+	struct cpio_pending *p;
+
+	if (a->durable.every == 0) {
+		close(fd);
+		return (0);
+	}
+
+	p = &a->durable.p[a->durable.n];
+	p->path = strdup(a->read.c->filename);
+	if (p->path == NULL) {
+		warn("%s: strdup", __func__);
+		close(fd);
+		return (-1);
+	}
+	p->fd = fd;
+	p->linked = a->durable.linked;
+	memcpy(p->tmp, a->durable.tmp, sizeof(p->tmp));
+	a->durable.n++;
+	a->durable.bytes += a->read.c->st.st_size;
+
+	if ((a->durable.n == a->durable.every) ||
+	    (a->durable.bytes >= XCPIO_DURABLE_BYTES)) {
+		return (cpio_archive_checkpoint(a));
+	}
+	return (0);
+}
+
+/*
+ * The final checkpoint, then flush again so the renames themselves
+ * are on disk.
+ */
+static int
+cpio_archive_durable_finish(struct cpio_archive *a)
+{
+	int ret;
+
+	if ((a->durable.every == 0) || (a->durable.seq == 0)) {
+		return (0);
+	}
+	ret = cpio_archive_checkpoint(a);
+	a->stats.syncs++;
+#ifdef	__linux__
+	if (syncfs(a->base.fd) != 0) {
+#else
+	if (fsync(a->base.fd) != 0) {
+#endif
+		warn("%s: sync", __func__);
+		ret = -1;
+	}
+	return (ret);
+}
+
+/*
+ * Make extraction crash safe.  Each file is written to a temporary
+ * file and atomically renamed over its destination, but only once a
+ * checkpoint has flushed it; checkpoints happen every 'every' files
+ * (or XCPIO_DURABLE_BYTES of data) and at the end.  0 turns it off.
+ */
+int
+cpio_archive_set_durable(struct cpio_archive *a, int every)
+{
+
+	if ((every < 0) || (every > XCPIO_DURABLE_MAX) ||
+	    (a->durable.n != 0)) {
+		return (-1);
+	}
+	free(a->durable.p);
+	a->durable.p = NULL;
+	a->durable.every = every;
+	if (every == 0) {
+		return (0);
+	}
+	a->durable.p = calloc(every, sizeof(*a->durable.p));
+	if (a->durable.p == NULL) {
+		warn("%s: calloc", __func__);
+		a->durable.every = 0;
+		return (-1);
+	}
+	return (0);
+}
+
+static int
+cpio_archive_open_destination_file(struct cpio_archive *a)
+{
+	int target_fd, parent_fd;
+	char *leaf;
+
+	parent_fd = cpio_archive_destination_parent(a, &leaf);
+	if (parent_fd == -1) {
+		return (-1);
+	}
+
+	/*
+	 * When comparing contents the existing file is kept and only
+	 * rewritten from the first difference; it's truncated to size
+	 * once the payload is done.
+	 *
+	 * In durable mode it's written to a temporary file and renamed
+	 * over the destination at the next checkpoint.
+	 */
+	if (a->durable.every > 0) {
+		target_fd = cpio_archive_open_temp(a, parent_fd);
+		if (target_fd < 0) {
+			return (-1);
+		}
+	} else if (a->extract.skip == CPIO_ARCHIVE_SKIP_CONTENT) {
+		target_fd = openat(parent_fd, leaf, O_RDWR | O_CREAT,
+		    a->read.c->st.st_mode);
+	} else {
+		target_fd = openat(parent_fd, leaf,
+		    O_WRONLY | O_CREAT | O_TRUNC, a->read.c->st.st_mode);
+	}
+	if (target_fd < 0) {
+		warn("%s: openat() (%s)", __func__, a->read.c->filename);
+		return (-1);
+	}
+
+	/* We know exactly how big it'll be, so allocate it all now */
+	cpio_preallocate(target_fd, 0, a->read.c->st.st_size);
+
+	/*
+	 * Set the file ownership.  For now don't warn;
+	 * it'll fail if you're non-root.
+	 */
+	if ((target_fd >= 0) && (fchown(target_fd, a->read.c->st.st_uid,
+	    a->read.c->st.st_gid) != 0)) {
+#if 0
+		warn("%s: fchown (%s) (%llu/%llu)",
+		    __func__,
+		    a->read.c->filename,
+		    (unsigned long long) a->read.c->st.st_uid,
+		    (unsigned long long) a->read.c->st.st_gid);
+#endif
+	}
+
+	return (target_fd);
+}
+
+/*
+ * Is the destination for the current member already a regular file
+ * of the same size and modification time?
+ */
+static bool
+cpio_archive_destination_unchanged(struct cpio_archive *a)
+{
+	struct stat sb;
+	int parent_fd;
+	char *leaf;
+
+	parent_fd = cpio_archive_destination_parent(a, &leaf);
+	if (parent_fd == -1) {
+		return (false);
+	}
+	if (fstatat(parent_fd, leaf, &sb, AT_SYMLINK_NOFOLLOW) != 0) {
+		return (false);
+	}
+	return (S_ISREG(sb.st_mode) &&
+	    (sb.st_size == a->read.c->st.st_size) &&
+	    (sb.st_mtime == a->read.c->st.st_mtime));
+}
+
+/*
+ * Compare len bytes at buf against the file at offset off.
+ *
+ * Returns 1 if they match, 0 if not (including a short file) and -1
+ * on error.
+ */
+static int
+cpio_archive_compare_span(struct cpio_archive *a, int fd, off_t off,
+    const char *buf, size_t len)
+{
+	char cmp[XCPIO_WRITE_BUF_SIZE * 4];
+	size_t n;
+	ssize_t r;
+
+	while (len > 0) {
+		n = MIN(len, sizeof(cmp));
+		r = pread(fd, cmp, n, off);
+		a->stats.file_read.calls++;
+		if (r < 0) {
+			warn("%s: pread (%s)", __func__, a->read.c->filename);
+			return (-1);
+		}
+		a->stats.file_read.bytes += r;
+		if (((size_t) r != n) || (memcmp(cmp, buf, n) != 0)) {
+			return (0);
+		}
+		buf += n;
+		off += n;
+		len -= n;
+	}
+	return (1);
+}
+
+/*
+ * Give an extracted file the member's modification time; that's
+ * also what lets a later extraction see it's unchanged.
+ */
+static void
+cpio_archive_set_destination_mtime(struct cpio_archive *a, int fd)
+{
+	struct timespec ts[2];
+
+	ts[0].tv_sec = 0;
+	ts[0].tv_nsec = UTIME_OMIT;
+	ts[1].tv_sec = a->read.c->st.st_mtime;
+	ts[1].tv_nsec = 0;
+	(void) futimens(fd, ts);
+}
+
+/*
+ * Create a directory.
+ *
+ * Missing parent directories are created with a default mode, so
+ * the manifest doesn't have to list directories before their
+ * contents.  A directory that already exists (eg because a file
+ * inside it was extracted first) isn't an error.
+ */
+static int
+cpio_archive_create_destination_directory(struct cpio_archive *a)
+{
+	int ret, parent_fd;
+	char *leaf;
+
+	parent_fd = cpio_archive_destination_parent(a, &leaf);
+	if (parent_fd == -1) {
+		return (-1);
+	}
+
+	/* XXX TODO: this sets the mode, not the sticky bits */
+	ret = mkdirat(parent_fd, leaf, a->read.c->st.st_mode);
+	if ((ret < 0) && (errno != EEXIST)) {
+		warn("%s: mkdirat '%s'", __func__, a->read.c->filename);
+		return (-1);
+	}
+
+	/* XXX TODO: figure out how to change the dir owner */
+
+	return (0);
+}
+
+
+/*
+ * When extracting over an existing tree, leave files that already
+ * match the archive alone.
+ *
+ * CPIO_ARCHIVE_SKIP_METADATA treats a regular file with the same
+ * size and mtime as unchanged and seeks past its payload.
+ * CPIO_ARCHIVE_SKIP_CONTENT reads each payload and compares it
+ * against the existing file, only writing from the first difference.
+ */
+int
+cpio_archive_set_skip_unchanged(struct cpio_archive *a,
+    cpio_archive_skip skip)
+{
+
+	a->extract.skip = skip;
+	return (0);
+}
+
+int
+cpio_archive_set_checksum(struct cpio_archive *a, bool enable)
+{
+
+	a->csum.enabled = enable;
+	return (0);
+}
+
+/*
+ * Compare the checksums computed whilst reading against the ones
+ * stored in the archive.  The records are in member order, so walk
+ * both lists together.
+ */
+static int
+cpio_archive_verify_checksums(struct cpio_archive *a)
+{
+	const char *c, *s, *c_end, *s_end;
+	size_t cl, sl;
+
+	if (a->csum.found == false) {
+		fprintf(stderr, "%s: no checksums in archive\n", __func__);
+		return (-1);
+	}
+
+	c = a->csum.computed.buf;
+	c_end = c + a->csum.computed.len;
+	s = a->csum.stored.buf;
+	s_end = s + a->csum.stored.len;
+
+	while ((c < c_end) && (s < s_end)) {
+		cl = strnlen(c, c_end - c);
+		sl = strnlen(s, s_end - s);
+		if ((cl < 10) || (sl < 10)) {
+			fprintf(stderr, "%s: malformed checksum record\n",
+			    __func__);
+			return (-1);
+		}
+		if (strcmp(c + 9, s + 9) != 0) {
+			fprintf(stderr, "%s: checksum records out of order "
+			    "('%s' vs '%s')\n", __func__, c + 9, s + 9);
+			return (-1);
+		}
+		a->csum.checked++;
+		if (strncmp(c, s, 8) != 0) {
+			fprintf(stderr, "%s: checksum mismatch (%s): "
+			    "%.8s, expected %.8s\n", __func__, c + 9, c, s);
+			a->csum.mismatched++;
+		}
+		c += cl + 1;
+		s += sl + 1;
+	}
+	if ((c < c_end) || (s < s_end)) {
+		fprintf(stderr, "%s: member count doesn't match checksums\n",
+		    __func__);
+		return (-1);
+	}
+
+	return (a->csum.mismatched == 0 ? 0 : -1);
+}
+
+/*
+ * Print the I/O statistics, either as "name: value" lines or as a
+ * single JSON object.
+ */
+void
+cpio_archive_print_stats(struct cpio_archive *a, FILE *fp, bool json)
+{
+	const struct cpio_archive_stats *s = &a->stats;
+	struct {
+		const char *name;
+		uint64_t val;
+	} v[] = {
+		{ "archive_read_calls", s->archive_read.calls },
+		{ "archive_read_bytes", s->archive_read.bytes },
+		{ "archive_write_calls", s->archive_write.calls },
+		{ "archive_write_bytes", s->archive_write.bytes },
+		{ "file_read_calls", s->file_read.calls },
+		{ "file_read_bytes", s->file_read.bytes },
+		{ "file_write_calls", s->file_write.calls },
+		{ "file_write_bytes", s->file_write.bytes },
+		{ "bytes_memmoved", s->bytes_memmoved },
+		{ "header_parse_ns", s->header_parse_ns },
+		{ "file_write_ns", s->file_write_ns },
+		{ "files", s->files },
+		{ "dirs", s->dirs },
+		{ "skipped", s->skipped },
+		{ "errors", s->errors },
+		{ "peak_buffer_bytes", s->peak_buffer_bytes },
+		{ "unchanged", s->unchanged },
+		{ "bytes_seeked", s->bytes_seeked },
+		{ "checkpoints", s->checkpoints },
+		{ "syncs", s->syncs },
+		{ "journal_saves", s->journal_saves },
+		{ "resumed", s->resumed },
+		{ "bytes_copied", s->bytes_copied },
+		{ "excluded", s->excluded },
+		{ "tee_wait_ns", s->tee_wait_ns },
+	};
+	size_t i;
+
+	if (json)
+		fprintf(fp, "{");
+	for (i = 0; i < nitems(v); i++) {
+		if (json) {
+			fprintf(fp, "%s\"%s\":%llu", i > 0 ? "," : "",
+			    v[i].name, (unsigned long long) v[i].val);
+		} else {
+			fprintf(fp, "%s: %llu\n", v[i].name,
+			    (unsigned long long) v[i].val);
+		}
+	}
+	/* Only known when the allocator is being counted */
+	if (s->allocs >= 0) {
+		if (json)
+			fprintf(fp, ",\"allocs\":%lld", (long long) s->allocs);
+		else
+			fprintf(fp, "allocs: %lld\n", (long long) s->allocs);
+	}
+	if (json)
+		fprintf(fp, "}\n");
+}
+
+/*
+ * Enable per-member latency tracking, keeping the nslow slowest
+ * members for the report.
+ */
+int
+cpio_archive_set_latency(struct cpio_archive *a, int nslow)
+{
+
+	if (a->lat != NULL)
+		latency_stats_free(a->lat);
+	a->lat = latency_stats_create(nslow);
+	return (a->lat == NULL ? -1 : 0);
+}
+
+void
+cpio_archive_print_latency(struct cpio_archive *a, FILE *fp)
 {
 
-	return (file_list_add_entry(a->files.fl, filename));
+	if (a->lat != NULL)
+		latency_stats_print(a->lat, fp);
 }
 
 /*
- * Write the files to the current archive.  This iterates over the file list
- * but does not flush/empty it.
+ * Return a pointer to the next chunk of the current member's payload
+ * in the read buffer.  The chunk is consumed; the pointer is valid
+ * until the next call into the archive.
+ *
+ * Returns the chunk length, 0 at the end of the payload, or -1 on
+ * error (including the archive ending mid-payload.)
  */
-int
-cpio_archive_write_files(struct cpio_archive *a)
+ssize_t
+cpio_archive_read_payload_span(struct cpio_archive *a, const char **ptr)
 {
-	int i;
+	size_t remaining, n;
 
-	/* XXX TODO: iterator */
+	if (a->read.c == NULL) {
+		return (0);
+	}
 
-	for (i = 0; i < a->files.fl->nentries; i++) {
-		/*
-		 * For now don't error out if we fail to write a file;
-		 * just log a warning and continue.
-		 */
-		if (cpio_archive_write_file(a, a->files.fl->file_list[i]) != 0) {
-			fprintf(stderr, "%s: failed to write file (%s)\n",
-			    __func__,
-			    a->files.fl->file_list[i]);
+	remaining = a->read.c->st.st_size - a->read.consumed_bytes;
+	if (remaining == 0) {
+		return (0);
+	}
+
+	if (a->read.buf_len == 0) {
+		if (cpio_archive_read_fill(a) <= 0) {
+			fprintf(stderr, "%s: archive ended inside '%s'\n",
+			    __func__, a->read.c->filename);
+			return (-1);
 		}
 	}
 
-	return (0);
+	n = MIN(remaining, (size_t) a->read.buf_len);
+	*ptr = a->read.buf + a->read.buf_off;
+	cpio_archive_read_consume(a, n);
+	a->read.consumed_bytes += n;
+	return (n);
 }
 
-static int
-cpio_archive_open_destination_file(struct cpio_archive *a)
+/*
+ * Copy up to len bytes of the current member's payload into buf.
+ *
+ * Returns the number of bytes copied, 0 at the end of the payload or
+ * -1 on error.
+ */
+ssize_t
+cpio_archive_read_payload(struct cpio_archive *a, char *buf, size_t len)
 {
-	int target_fd;
-	char *tmp_fn;
+	size_t remaining, n;
 
-	tmp_fn = cpio_path_sanity_filter(a->read.c->filename);
-	if (tmp_fn == NULL) {
-		/* XXX TODO: log error */
-		return (-1);
+	if ((a->read.c == NULL) || (len == 0)) {
+		return (0);
 	}
-	target_fd = openat(a->base.fd, tmp_fn, O_WRONLY | O_CREAT | O_TRUNC,
-	    a->read.c->st.st_mode);
-	if (target_fd < 0) {
-		warn("%s: openat() (%s)", __func__, tmp_fn);
-		free(tmp_fn);
-		return (-1);
+
+	remaining = a->read.c->st.st_size - a->read.consumed_bytes;
+	if (remaining == 0) {
+		return (0);
+	}
+
+	if (a->read.buf_len == 0) {
+		if (cpio_archive_read_fill(a) <= 0) {
+			fprintf(stderr, "%s: archive ended inside '%s'\n",
+			    __func__, a->read.c->filename);
+			return (-1);
+		}
+	}
+
+	n = MIN(MIN(remaining, len), (size_t) a->read.buf_len);
+	memcpy(buf, a->read.buf + a->read.buf_off, n);
+	cpio_archive_read_consume(a, n);
+	a->read.consumed_bytes += n;
+	return (n);
+}
+
+/*
+ * Skip whatever is left of the current member's payload.
+ */
+int
+cpio_archive_skip_payload(struct cpio_archive *a)
+{
+	const char *p;
+	size_t remaining;
+	off_t target, aligned;
+	ssize_t r;
+
+	if (a->read.c == NULL) {
+		return (0);
 	}
-	free(tmp_fn);
 
 	/*
-	 * Set the file ownership.  For now don't warn;
-	 * it'll fail if you're non-root.
+	 * If the payload runs well past what's buffered and the archive
+	 * is a regular file then seek over it rather than reading it.
+	 * The seek goes to the block boundary before the end of the
+	 * payload so reads stay block aligned; the rest is read as
+	 * normal.
 	 */
-	if ((target_fd >= 0) && (fchown(target_fd, a->read.c->st.st_uid,
-	    a->read.c->st.st_gid) != 0)) {
-#if 0
-		warn("%s: fchown (%s) (%llu/%llu)",
-		    __func__,
-		    a->read.c->filename,
-		    (unsigned long long) a->read.c->st.st_uid,
-		    (unsigned long long) a->read.c->st.st_gid);
-#endif
+	remaining = a->read.c->st.st_size - a->read.consumed_bytes;
+	if (a->read.seekable && ! a->read.hit_eof &&
+	    (remaining > (size_t) a->read.buf_len + a->block_size)) {
+		target = a->read.offset + (remaining - a->read.buf_len);
+		aligned = target - ((target - a->read.start) % a->block_size);
+		if (lseek(a->fd, aligned, SEEK_SET) == aligned) {
+			a->stats.bytes_seeked += aligned - a->read.offset;
+			a->read.consumed_bytes += remaining - (target - aligned);
+			a->read.offset = aligned;
+			a->read.buf_off = a->read.buf_len = 0;
+		}
 	}
 
-	return (target_fd);
+	while ((r = cpio_archive_read_payload_span(a, &p)) > 0)
+		;
+	return (r < 0 ? -1 : 0);
 }
 
 /*
- * Create a directory.
+ * Move on to the next member of an archive opened for reading.
  *
- * Note: this doesn't (yet?) create the subdirectory paths, so the
- * manifest has to have these in the right order!
+ * Any unread payload of the current member is skipped first.  On
+ * success *hdr points at the new member's header, which stays valid
+ * until the next call.
+ *
+ * Returns 1 if there's a member, 0 once the trailer is reached and
+ * -1 on error.
  */
-static int
-cpio_archive_create_destination_directory(struct cpio_archive *a)
+int
+cpio_archive_next_entry(struct cpio_archive *a,
+    const struct cpio_header **hdr)
 {
-	int ret;
-	char *tmp_fn;
+	struct cpio_header *c = &a->read.hdr;
+	uint64_t t;
+	int rr;
 
-	tmp_fn = cpio_path_sanity_filter(a->read.c->filename);
-	if (tmp_fn == NULL) {
-		/* XXX TODO: log error */
-		return (-1);
+	if (a->read.c != NULL) {
+		if (cpio_archive_skip_payload(a) != 0) {
+			return (-1);
+		}
+		a->read.c = NULL;
+	}
+	if (a->read.done) {
+		return (0);
 	}
 
-	/* XXX TODO: this sets the mode, not the sticky bits */
-	ret = mkdirat(a->base.fd, tmp_fn, a->read.c->st.st_mode);
-	if (ret < 0) {
-		warn("%s: mkdirat '%s'", __func__, tmp_fn);
-		free(tmp_fn);
-		return (-1);
+	while (1) {
+		t = cpio_stats_now_ns();
+		rr = cpio_header_deserialise_into(a->read.buf + a->read.buf_off,
+		    a->read.buf_len, c, a->read.name, a->read.name_size);
+		a->stats.header_parse_ns += cpio_stats_now_ns() - t;
+		if (rr < 0) {
+			return (-1);
+		}
+		if (rr > 0) {
+			break;
+		}
+
+		/*
+		 * Not enough data yet.  If no more can be read (EOF, or
+		 * the header/filename doesn't fit in the buffer) then
+		 * someone's playing bad games.
+		 */
+		if (cpio_archive_read_fill(a) <= 0) {
+			if (a->read.hit_eof) {
+				fprintf(stderr, "%s: archive ended without "
+				    "a trailer\n", __func__);
+			} else {
+				fprintf(stderr, "%s: failed; didn't complete "
+				    "header/filename within %d bytes\n",
+				    __func__, a->read.buf_size);
+			}
+			return (-1);
+		}
 	}
-	free(tmp_fn);
 
-	/* XXX TODO: figure out how to change the dir owner */
+	/* consume the header */
+	cpio_archive_read_consume(a, rr);
+	a->read.consumed_bytes = 0;
 
-	return (0);
-}
+	/* Check for end of archive marker */
+	if ((c->st.st_size == 0) &&
+	    (strncmp(c->filename, "TRAILER!!!", 10) == 0)) {
+		a->read.done = true;
+		return (0);
+	}
 
+	a->read.c = c;
+	*hdr = c;
+	return (1);
+}
 
 /*
  * Begin reading from an archive.
+ *
+ * This iterates over every member, extracting it if do_extract is
+ * true.  If checksums are enabled then each member's payload is
+ * checksummed and compared against the stored checksums at the end.
  */
 int
 cpio_archive_begin_read(struct cpio_archive *a, bool do_extract)
 {
-	char *buf;
-	int buf_len = 0;
-	int buf_size = a->block_size * 4;
-	ssize_t r;
-	size_t cs, cr;
+	const struct cpio_header *c;
+	const char *p;
+	ssize_t n;
 	int rr, retval = 0;
 	int target_fd = -1;
-	bool hit_eof = false;
+	bool compare = false;
+	uint64_t t = 0, lat_start = 0, lat_data = 0;
+
+	while ((rr = cpio_archive_next_entry(a, &c)) > 0) {
+		a->csum.crc = 0;
+		a->csum.in_member =
+		    (strcmp(c->filename, XCPIO_CSUM_MEMBER) == 0);
+		if (a->csum.in_member) {
+			a->csum.found = true;
+		}
 
-	/*
-	 * Note: the buf size is greater than block_size so
-	 * we can read in block_size reads and potentially
-	 * read over the block boundary whilst accumulating
-	 * data like header info.
-	 *
-	 * Yes, the important thing here is that stuff like
-	 * the individual files in the archive aren't aligned
-	 * to block sizes; only the actual archive itself
-	 * is block size aligned.
-	 *
-	 * Hopefully (!) nothing dumb like file names will
-	 * cause the header parsing to exceed 4x the block size.
-	 */
-	buf = calloc(1, buf_size);
-	if (buf == NULL) {
-		warn("%s: calloc(%d)", __func__, buf_size);
-		return (-1);
-	}
+		if (a->lat != NULL)
+			lat_start = cpio_stats_now_ns();
 
-	while (1) {
+		/*
+		 * Note: this logic ONLY handles creating files for
+		 * now.
+		 * This needs to be extended to handle block/char
+		 * devices, directories, symlinks and hardlinks.
+		 */
+		if (do_extract && a->csum.in_member) {
+			/* Archive metadata; don't create it */
+			target_fd = -1;
+		} else if (do_extract) {
+			/* If it's a file then create a file */
+			if (S_ISREG(c->st.st_mode) &&
+			    (a->extract.skip == CPIO_ARCHIVE_SKIP_METADATA) &&
+			    cpio_archive_destination_unchanged(a)) {
+				/* Already there; don't touch it */
+				a->stats.unchanged++;
+				target_fd = -1;
+			} else if (S_ISREG(c->st.st_mode)) {
+				target_fd = cpio_archive_open_destination_file(a);
+				if (target_fd < 0)
+					a->stats.errors++;
+				compare = (target_fd != -1) &&
+				    (a->extract.skip == CPIO_ARCHIVE_SKIP_CONTENT);
+			}
 
-		/* Consume data if we have space */
-		if (buf_len < (buf_size - a->block_size)) {
-			/*
-			 * This is where we need to make sure
-			 * that the blocks are read in a fixed block size,
-			 * rather than "always fill the buffer."
-			 *
-			 * Note: EOF here isn't the problem; it's EOF /and/
-			 * being empty that's the problem.
-			 */
-			if (hit_eof == false) {
-				r = read(a->fd, buf + buf_len, a->block_size);
-				if (r == 0) {
-					hit_eof = true;
-				}
-				/*
-				 * Note: error is a problem; consume what we
-				 * can from the buffer and let it run out.
-				 */
-				if (r < 0) {
-					warn("%s: read", __func__);
-					hit_eof = true;
-				}
+			/* If it's a directory then create a directory */
+			else if (S_ISDIR(c->st.st_mode)) {
+				if (cpio_archive_create_destination_directory(a) != 0)
+					a->stats.errors++;
+				else
+					a->stats.dirs++;
+				target_fd = -1;
+			} else {
+				/* Log an error; we don't handle this */
+				fprintf(stderr,
+				    "%s: unsupported mode/type for file '%s' (%o)\n",
+				    __func__,
+				    c->filename,
+				    c->st.st_mode);
+				a->stats.skipped++;
+				target_fd = -1;
 			}
 		}
 
-		buf_len += r;
-
-		if (a->read.c == NULL) {
-			char *tmp_fn;
+		if (a->lat != NULL)
+			lat_data = cpio_stats_now_ns();
 
-			/*
-			 * We don't yet have a header; attempt to parse a header.
-			 */
-			rr = cpio_header_deserialise(buf, buf_len, &a->read.c);
-			if (rr < 0) {
-				break;
-			}
-			if (rr == 0 && buf_len < buf_size) {
-				/* Not enough data left in the buffer */
-				continue;
-			}
-			/*
-			 * Check if we've got our header before we ran out
-			 * of incoming space.
-			 *
-			 * Importantly, we need to make sure that we can't
-			 * read any FURTHER data, rather than it's full.
-			 */
-			if (rr == 0 && (buf_len > (buf_size - a->block_size) || hit_eof == true)) {
-				/*
-				 * No header parsable yet? Bail out, someone's
-				 * playing bad games!
-				 */
-				printf("%s: failed; didn't complete header/filename within %d bytes\n",
-				    __func__, buf_size);
+		/*
+		 * If nothing needs the payload then skip it; that seeks
+		 * over it where the archive allows.
+		 */
+		if ((target_fd == -1) && ! a->csum.enabled) {
+			if (cpio_archive_skip_payload(a) != 0) {
 				retval = -1;
 				break;
 			}
+		}
 
+		while ((n = cpio_archive_read_payload_span(a, &p)) > 0) {
 			/*
-			 * If we have a header then 'rr' is now how many bytes
-			 * to consume and the st_size in our header is how many
-			 * bytes to consume for the file contents.
+			 * Compare against what's there until the first
+			 * difference, then write from there on.
 			 */
-			printf("%s: parsed; got filename %s\n", __func__,
-			    a->read.c->filename);
-
-			/* consume the header */
-			memmove(buf, buf + rr, buf_len - rr);
-			buf_len -= rr;
-
-			a->read.consumed_bytes = 0;
-
-			/* Check for end of archive marker */
-			if ((a->read.c->st.st_size == 0) &&
-			    (strncmp(a->read.c->filename, "TRAILER!!!", 10)
-			      == 0)) {
-				/* We're done! */
-				break;
+			if (compare) {
+				off_t off = a->read.consumed_bytes - n;
+				int cr;
+
+				cr = cpio_archive_compare_span(a, target_fd,
+				    off, p, n);
+				if (cr == 0) {
+					compare = false;
+					if (lseek(target_fd, off, SEEK_SET) < 0)
+						cr = -1;
+				}
+				if (cr < 0) {
+					a->stats.errors++;
+					close(target_fd);
+					target_fd = -1;
+					compare = false;
+				}
 			}
 
 			/*
-			 * Note: this logic ONLY handles creating files for
-			 * now.
-			 * This needs to be extended to handle block/char
-			 * devices, directories, symlinks and hardlinks.
+			 * Again, I'm going to be cheap and not loop over
+			 * the buffer until it's written; I want to get the
+			 * rest of this fleshed out before I worry about
+			 * better IO pipelines.
 			 */
-			if (do_extract) {
-				/* If it's a file then create a file */
-				if (S_ISREG(a->read.c->st.st_mode)) {
-					target_fd = cpio_archive_open_destination_file(a);
+			if ((target_fd != -1) && ! compare) {
+				ssize_t wr;
+
+				t = cpio_stats_now_ns();
+				wr = write(target_fd, p, n);
+				a->stats.file_write_ns +=
+				    cpio_stats_now_ns() - t;
+				a->stats.file_write.calls++;
+				if (wr > 0)
+					a->stats.file_write.bytes += wr;
+				if (wr != n) {
+					a->stats.errors++;
+					fprintf(stderr, "%s: write size "
+					  "mismatch to destination file (%s) - "
+					  "wanted %llu bytes, wrote %llu bytes\n",
+					  __func__,
+					  c->filename,
+					  (unsigned long long) n,
+					  (unsigned long long) wr);
+
+					/*
+					 * Close target_fd; we'll just consume
+					 * but not write the rest of this file
+					 * contents out.
+					 */
+					close(target_fd);
+					target_fd = -1;
 				}
+			}
 
-				/* If it's a directory then create a directory */
-				else if (S_ISDIR(a->read.c->st.st_mode)) {
-					(void) cpio_archive_create_destination_directory(a);
-					target_fd = -1;
+			/*
+			 * Checksum it, or hang on to the checksums we're
+			 * given.
+			 */
+			if (a->csum.enabled) {
+				if (a->csum.in_member) {
+					(void) cpio_buf_append(&a->csum.stored,
+					    p, n);
 				} else {
-					/* Log an error; we don't handle this */
-					fprintf(stderr,
-					    "%s: unsupported mode/type for file '%s' (%o)\n",
-					    __func__,
-					    a->read.c->filename,
-					    a->read.c->st.st_mode);
-					target_fd = -1;
+					a->csum.crc = crc32c(a->csum.crc, p, n);
 				}
 			}
 		}
+		if (n < 0) {
+			retval = -1;
+			break;
+		}
 
 		/*
-		 * If we have a header here then attempt to consume bytes up
-		 * until our read limit.  See how much data we have left to
-		 * consume and only consume up to THAT from the input buffer.
-		 */
-		cs = a->read.c->st.st_size - a->read.consumed_bytes;
-		cr = MIN(cs, buf_len);
-
-		/*
-		 * Here is where we could write this to the destination file.
-		 * Again, I'm going to be cheap and not loop over the buffer
-		 * until it's written; I want to get the rest of this fleshed
-		 * out before I worry about better IO pipelines.
+		 * We've hit the end; close this file.  It counts as done
+		 * for the journal before it's queued for a checkpoint.
 		 */
+		a->journal.entries++;
+		if (a->csum.enabled && ! a->csum.in_member) {
+			(void) cpio_csum_add(&a->csum.computed,
+			    a->csum.crc, c->filename);
+		}
+		if (a->lat != NULL)
+			t = cpio_stats_now_ns();
 		if (target_fd != -1) {
-			ssize_t wr;
-			/*
-			 * Note: this is the write to the target file.
-			 *
-			 * Ideally this would also be buffered in memory and
-			 * do larger writes for efficiency.
-			 */
-			wr = write(target_fd, buf, cr);
-			if (wr != cr) {
-				fprintf(stderr, "%s: write size mismatch to "
-				  "destination file (%s) - wanted %llu bytes, "
-				  "wrote %llu bytes\n",
-				  __func__,
-				  a->read.c->filename,
-				  (unsigned long long) cr,
-				  (unsigned long long) wr);
+			struct stat sb;
 
-				/*
-				 * Close target_fd; we'll just consume but
-				 * not write the rest of this file contents
-				 * out.
-				 */
-				close(target_fd);
-				target_fd = -1;
+			/* Trimming a longer file is still a change */
+			if (compare && ((fstat(target_fd, &sb) != 0) ||
+			    (sb.st_size != c->st.st_size))) {
+				compare = false;
 			}
-		}
-
-
-		/* Consume data */
-		memmove(buf, buf + cr, buf_len - cr);
-		buf_len -= cr;
-		a->read.consumed_bytes += cr;
-
-		/*
-		 * If we've hit the end then close this file, free the header.
-		 */
-		if (a->read.c != NULL && a->read.consumed_bytes == a->read.c->st.st_size) {
-			/* close the destination file */
-			printf("closing %s\n", a->read.c->filename);
-			/* close the state */
-			cpio_header_free(a->read.c);
-			a->read.c = NULL;
-			if (target_fd != -1) {
-				close(target_fd);
-				target_fd = -1;
+			if (compare) {
+				a->stats.unchanged++;
+			} else {
+				a->stats.files++;
 			}
+			/* An existing file may have been longer */
+			if ((a->extract.skip == CPIO_ARCHIVE_SKIP_CONTENT) &&
+			    (ftruncate(target_fd, c->st.st_size) != 0)) {
+				warn("%s: ftruncate (%s)", __func__,
+				    c->filename);
+			}
+			cpio_archive_set_destination_mtime(a, target_fd);
+			if (cpio_archive_finish_destination(a, target_fd) != 0)
+				retval = -1;
+			target_fd = -1;
 		}
-
-		/*
-		 * Finally, if we are consuming data and we've not hit
-		 * the end of the filesize BUT we're out of data to
-		 * consume then error out.
-		 */
-		if ((a->read.c != NULL) && (a->read.consumed_bytes < a->read.c->st.st_size) &&
-		    (buf_len == 0) && (hit_eof)) {
-			retval = 0;
+		compare = false;
+		if (a->lat != NULL) {
+			latency_stats_add(a->lat, c->filename,
+			    lat_data - lat_start, t - lat_data,
+			    cpio_stats_now_ns() - t);
+		}
+		if (cpio_archive_journal_progress(a) != 0) {
+			retval = -1;
 			break;
 		}
 	}
+	if (rr < 0) {
+		retval = -1;
+	}
 
 	/* Final cleanup */
-	if (a->read.c != NULL) {
-		cpio_header_free(a->read.c);
-		a->read.c = NULL;
-	}
 	if (target_fd != -1) {
 		close(target_fd);
 		target_fd = -1;
 	}
-	if (buf != NULL) {
-		free(buf);
+	if (cpio_archive_durable_finish(a) != 0) {
+		retval = -1;
+	}
+
+	if (a->csum.enabled && (cpio_archive_verify_checksums(a) != 0)) {
+		retval = -1;
+	}
+	if (retval == 0) {
+		cpio_archive_journal_done(a);
 	}
 
 	return retval;
 }
+
+/*
+ * Copy the rest of the current member's payload from 'in' into 'out'.
+ *
+ * When both archives are regular files, whole output blocks of a
+ * large payload are moved with copy_file_range() rather than through
+ * the buffers.  The output is first topped up to a block boundary so
+ * its writes stay block aligned; the reader is then moved past what
+ * was copied.
+ */
+static int
+cpio_archive_repack_payload(struct cpio_archive *in, struct cpio_archive *out,
+    bool direct, uint32_t *crc)
+{
+	const char *p;
+	ssize_t n;
+#ifdef	__linux__
+	size_t remaining, k;
+	loff_t in_pos;
+	ssize_t r;
+
+	remaining = in->read.c->st.st_size - in->read.consumed_bytes;
+	if (direct && (remaining >= XCPIO_REPACK_DIRECT_MIN) &&
+	    (remaining >= 2 * (size_t) out->block_size)) {
+		/* Top the output up to a block boundary */
+		while (out->write.len != 0) {
+			n = cpio_archive_read_payload(in,
+			    out->write.buf + out->write.len,
+			    out->write.size - out->write.len);
+			if (n <= 0) {
+				return (-1);
+			}
+			out->write.len += n;
+			if (cpio_archive_write_flush(out, false) < 0) {
+				return (-1);
+			}
+		}
+
+		remaining = in->read.c->st.st_size - in->read.consumed_bytes;
+		k = remaining - (remaining % out->block_size);
+		in_pos = in->read.offset - in->read.buf_len;
+		while (k > 0) {
+			r = copy_file_range(in->fd, &in_pos, out->fd, NULL, k, 0);
+			if (r <= 0) {
+				/* Not supported here; the buffers do the rest */
+				break;
+			}
+			k -= r;
+			in->read.consumed_bytes += r;
+			out->stats.bytes_copied += r;
+		}
+		if (cpio_archive_read_skip_to(in, in_pos) != 0) {
+			return (-1);
+		}
+	}
+#endif
+
+	while ((n = cpio_archive_read_payload_span(in, &p)) > 0) {
+		if (cpio_archive_write_data(out, p, n) != n) {
+			return (-1);
+		}
+		if (crc != NULL) {
+			*crc = crc32c(*crc, p, n);
+		}
+	}
+	return (n < 0 ? -1 : 0);
+}
+
+/*
+ * Should a member with this name be copied?  It must match one of
+ * the include patterns, if there are any, and none of the excludes.
+ * Like cpio, '*' matches '/' too.
+ */
+bool
+cpio_archive_filter_match(const struct cpio_archive_filter *f,
+    const char *filename)
+{
+	int i;
+
+	if (f == NULL) {
+		return (true);
+	}
+	for (i = 0; i < f->nexclude; i++) {
+		if (fnmatch(f->exclude[i], filename, 0) == 0)
+			return (false);
+	}
+	if (f->ninclude == 0) {
+		return (true);
+	}
+	for (i = 0; i < f->ninclude; i++) {
+		if (fnmatch(f->include[i], filename, 0) == 0)
+			return (true);
+	}
+	return (false);
+}
+
+/*
+ * Copy the members of 'in' that pass the filter into 'out'.
+ *
+ * An input's checksum member is copied only if keep_csum is set;
+ * otherwise it's dropped, as it may not describe what's in 'out'.
+ * If 'out' has checksums enabled they're computed as the payloads
+ * pass through, so the payloads aren't copied directly.
+ */
+static int
+cpio_archive_copy_members(struct cpio_archive *in, struct cpio_archive *out,
+    const struct cpio_archive_filter *f, bool keep_csum)
+{
+	const struct cpio_header *c;
+	struct stat sb;
+	uint32_t crc;
+	bool direct, is_csum;
+	int rr, slen;
+
+	if ((in->mode != CPIO_ARCHIVE_MODE_READ) ||
+	    (out->mode != CPIO_ARCHIVE_MODE_WRITE)) {
+		return (-1);
+	}
+
+	/*
+	 * Direct copies need both sides to be plain files; the reader's
+	 * fd offset is only in step with its buffer when seekable.
+	 */
+	direct = in->read.seekable && (out->fd > -1) &&
+	    (out->io.ops == &cpio_io_fd_ops) && ! out->csum.enabled &&
+	    (out->outputs.tee == NULL) &&
+	    (fstat(out->fd, &sb) == 0) && S_ISREG(sb.st_mode);
+
+	while ((rr = cpio_archive_next_entry(in, &c)) > 0) {
+		is_csum = (strcmp(c->filename, XCPIO_CSUM_MEMBER) == 0);
+		if ((is_csum && ! keep_csum) ||
+		    (! is_csum && ! cpio_archive_filter_match(f, c->filename))) {
+			/* next_entry skips (or seeks over) the payload */
+			out->stats.excluded++;
+			continue;
+		}
+
+		slen = cpio_header_serialise_into(c, out->write.hdr,
+		    out->write.hdr_size);
+		if ((slen < 0) ||
+		    (cpio_archive_write_data(out, out->write.hdr, slen) != slen)) {
+			fprintf(stderr, "%s: failed to write header (%s)\n",
+			    __func__, c->filename);
+			return (-1);
+		}
+		crc = 0;
+		if (cpio_archive_repack_payload(in, out, direct,
+		    out->csum.enabled ? &crc : NULL) != 0) {
+			fprintf(stderr, "%s: failed to copy '%s'\n", __func__,
+			    c->filename);
+			return (-1);
+		}
+		if (out->csum.enabled &&
+		    (cpio_csum_add(&out->csum.computed, crc, c->filename) != 0)) {
+			return (-1);
+		}
+		out->stats.files++;
+	}
+	return (rr < 0 ? -1 : 0);
+}
+
+/*
+ * Append the members of 'in' that pass the filter (which may be NULL)
+ * to 'out'.  Calling this for several inputs merges them into one
+ * archive, with the one trailer written when 'out' is closed.
+ *
+ * Headers are copied as they are; payloads are streamed as for
+ * cpio_archive_repack().  Members with the same name aren't merged;
+ * whichever comes last wins when extracting.
+ */
+int
+cpio_archive_merge(struct cpio_archive *out, struct cpio_archive *in,
+    const struct cpio_archive_filter *f)
+{
+
+	return (cpio_archive_copy_members(in, out, f, false));
+}
+
+/*
+ * Copy every member of 'in' into 'out' as is; only the block size
+ * (and so the padding) of the archive changes.  A checksum member is
+ * copied like any other, so the checksums still verify.
+ *
+ * 'in' must be open for reading and 'out' for writing; the trailer
+ * is written when 'out' is closed.
+ */
+int
+cpio_archive_repack(struct cpio_archive *in, struct cpio_archive *out)
+{
+
+	return (cpio_archive_copy_members(in, out, NULL, true));
+}
@@ -1,56 +1,338 @@
 #ifndef	__CPIO_ARCHIVE_H__
 #define	__CPIO_ARCHIVE_H__
 
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <limits.h>
+#include <sys/types.h>
+
+#include "cpio_format.h"
+#include "cpio_io.h"
+
 #define	XCPIO_WRITE_BUF_SIZE	1024
 #define	XCPIO_READ_BUF_SIZE	1024
 
+/* Longest filename (including NUL) handled when reading */
+#define	XCPIO_NAME_SIZE		(PATH_MAX + 1)
+
 #define	DEFAULT_CPIO_BLOCK_SIZE	512
 
+/* Durable extraction checkpoints at least every this many bytes */
+#define	XCPIO_DURABLE_BYTES	(64ULL * 1024 * 1024)
+
+/* ... and at most this many files, each held open until then */
+#define	XCPIO_DURABLE_MAX	65536
+#define	XCPIO_TMPNAME_SIZE	48
+
+/* The restart journal is updated at least this often */
+#define	XCPIO_JOURNAL_EVERY	256
+#define	XCPIO_JOURNAL_BYTES	(64ULL * 1024 * 1024)
+
+/* Repacked payloads at least this big are copied file to file */
+#define	XCPIO_REPACK_DIRECT_MIN	(64 * 1024)
+
+/* With an -O order, read ahead this many entries or bytes at a time */
+#define	XCPIO_ORDER_WINDOW	64
+#define	XCPIO_ORDER_BYTES	(32ULL * 1024 * 1024)
+
+/*
+ * The name of the member holding the per-member checksums.  Like the
+ * trailer it is just a regular member, so other cpio tools will see
+ * it as a small file.
+ */
+#define	XCPIO_CSUM_MEMBER	"XCPIO!!!CRC32C"
+
 typedef enum {
 	CPIO_ARCHIVE_MODE_NONE,
 	CPIO_ARCHIVE_MODE_READ,
 	CPIO_ARCHIVE_MODE_WRITE,
+	CPIO_ARCHIVE_MODE_APPEND,
 } cpio_archive_mode;
 
+/*
+ * How to decide an existing file needn't be extracted again.
+ */
+typedef enum {
+	CPIO_ARCHIVE_SKIP_NONE,		/* always rewrite */
+	CPIO_ARCHIVE_SKIP_METADATA,	/* same size and mtime */
+	CPIO_ARCHIVE_SKIP_CONTENT,	/* same contents */
+} cpio_archive_skip;
+
+/*
+ * The order in which files from the manifest are read ahead when
+ * creating an archive.  Members are always written in manifest order.
+ */
+typedef enum {
+	CPIO_ARCHIVE_ORDER_MANIFEST,	/* as listed */
+	CPIO_ARCHIVE_ORDER_INODE,	/* by device/inode number */
+	CPIO_ARCHIVE_ORDER_EXTENT,	/* by first physical extent */
+} cpio_archive_order;
+
+/*
+ * The result of a dry-run sizing pass over the files to archive.
+ */
+struct cpio_archive_plan {
+	uint64_t entries;		/* not including the trailer */
+	uint64_t errors;		/* entries that couldn't be stat'ed */
+	uint64_t payload_bytes;		/* file contents */
+	uint64_t data_bytes;		/* headers + payloads + trailer */
+	uint64_t existing_bytes;	/* kept ahead of them when appending */
+	uint64_t archive_bytes;		/* all of it, padded to a block */
+	uint64_t max_header_bytes;	/* largest header + filename */
+	uint64_t peak_buffer_bytes;	/* writer buffers at any one time */
+};
+
+/*
+ * Which members to copy when merging archives; see
+ * cpio_archive_filter_match().
+ */
+struct cpio_archive_filter {
+	char **include;
+	int ninclude;
+	char **exclude;
+	int nexclude;
+};
+
+/*
+ * A simple growable byte buffer.
+ */
+struct cpio_buf {
+	char *buf;
+	size_t len, size;
+};
+
+/*
+ * Identifies a file by device and inode.
+ */
+struct cpio_file_id {
+	dev_t dev;
+	ino_t ino;
+};
+
+/*
+ * Syscall and byte counts for one kind of I/O.
+ */
+struct cpio_io_stats {
+	uint64_t calls;
+	uint64_t bytes;
+};
+
+/*
+ * Counters collected while reading or writing an archive.
+ */
+struct cpio_archive_stats {
+	struct cpio_io_stats archive_read;	/* from the archive */
+	struct cpio_io_stats archive_write;	/* to the archive */
+	struct cpio_io_stats file_read;		/* from files being archived */
+	struct cpio_io_stats file_write;	/* to files being extracted */
+	uint64_t bytes_memmoved;		/* shuffled in the read buffer */
+	uint64_t header_parse_ns;		/* in cpio_header_deserialise */
+	uint64_t file_write_ns;			/* blocked writing extracted files */
+	uint64_t files;
+	uint64_t dirs;
+	uint64_t skipped;			/* unsupported types */
+	uint64_t errors;
+	uint64_t peak_buffer_bytes;
+	uint64_t unchanged;			/* left alone when extracting */
+	uint64_t bytes_seeked;			/* payload skipped by seeking */
+	uint64_t checkpoints;			/* durable extraction */
+	uint64_t syncs;
+	uint64_t journal_saves;
+	uint64_t resumed;			/* members skipped by --resume */
+	uint64_t bytes_copied;			/* by copy_file_range */
+	uint64_t excluded;			/* members filtered out */
+	uint64_t tee_wait_ns;			/* waiting on the slowest output */
+	int64_t allocs;				/* -1 if not counted */
+};
+
+/*
+ * An extracted file waiting for a checkpoint.  'tmp' is its name in
+ * the destination directory until it's renamed; an O_TMPFILE file
+ * isn't linked in under it until the checkpoint.
+ */
+struct cpio_pending {
+	char *path;
+	char tmp[XCPIO_TMPNAME_SIZE];
+	int fd;
+	bool linked;
+};
+
 struct cpio_archive {
 	char *archive_filename;
 	int fd;
+
+	/* Where archive bytes go; the archive fd unless set_io was used */
+	struct {
+		const struct cpio_io_ops *ops;
+		void *arg;
+	} io;
 	cpio_archive_mode mode;
 	int block_size;
 
 	struct {
 		char *dirname;
 		int fd;
+		struct dir_cache *dc;	/* extraction parent dir cache */
 	} base;
 
+	/*
+	 * The read buffer and the current member being read.
+	 * buf_len bytes of unconsumed data start at buf_off.
+	 */
 	struct {
-		struct cpio_header *c;
+		struct cpio_header *c;	/* NULL, or points at hdr */
+		struct cpio_header hdr;
 		size_t consumed_bytes;
+		char *buf;
+		int buf_size, buf_off, buf_len;
+		bool hit_eof;
+		bool done;		/* seen the trailer */
+		bool seekable;		/* payloads can be seeked over */
+		off_t start;		/* archive fd offset of the archive */
+		off_t offset;		/* archive fd offset after the buffer */
+		char *name;		/* hdr's filename */
+		char *path;		/* sanitised extraction path */
+		size_t name_size;
 	} read;
 
 	/*
 	 * This is the write buffer to ensure things are done
-	 * in block-size IO transactions.
+	 * in block-size IO transactions, and the scratch space
+	 * headers are serialised into.
 	 */
 	struct {
 		char *buf;
 		int size, len;
+		char *hdr;
+		size_t hdr_size;
 	} write;
 
+	/*
+	 * Extra archive files written alongside archive_filename; each
+	 * block goes to all of them through the tee.  'ids' are the
+	 * regular files among the archive and these, which a tree walk
+	 * mustn't archive while they're being written.
+	 */
+	struct {
+		char **names;
+		int *fds;
+		int n;
+		struct tee *tee;
+		struct cpio_file_id *ids;
+		int nids;
+	} outputs;
+
+	/*
+	 * With a memory budget, every buffer is carved out of a single
+	 * arena up front and nothing is allocated per entry.
+	 */
+	struct {
+		size_t limit;
+		char *arena;
+		size_t used;
+	} budget;
+
 	struct {
 		struct file_list *fl;
+		cpio_archive_order order;
+		struct stat *st;	/* per entry, if stat_files was run */
 	} files;
+
+	struct {
+		cpio_archive_skip skip;
+	} extract;
+
+	/*
+	 * Durable extraction: files written since the last checkpoint,
+	 * waiting to be flushed and renamed into place.
+	 */
+	struct {
+		int every;		/* files per checkpoint; 0 if off */
+		int n;
+		uint64_t bytes;
+		struct cpio_pending *p;
+		uint64_t seq;		/* for temporary names */
+		char tmp[XCPIO_TMPNAME_SIZE];	/* the current file's */
+		bool linked;		/* ... and whether it has it yet */
+	} durable;
+
+	/*
+	 * The restart journal.  'entries' counts completed members
+	 * (manifest entries when writing), starting from wherever a
+	 * resumed job left off.  When extracting durably a checkpoint's
+	 * renames are only on disk after the next one, so the journal
+	 * lags a checkpoint behind ('prev').
+	 */
+	struct {
+		char *path;
+		bool resume;
+		struct journal *j;
+		uint64_t entries;
+		uint64_t saved_entries;
+		uint64_t saved_bytes;
+		bool have_prev;
+		uint64_t prev_entries;
+		off_t prev_offset;
+	} journal;
+
+	struct cpio_archive_stats stats;
+	struct latency_stats *lat;	/* per-member timing, if enabled */
+
+	/*
+	 * Per-member CRC32C checksums.  When writing these are collected
+	 * in 'computed' and stored as the XCPIO_CSUM_MEMBER member just
+	 * before the trailer.  When verifying, they're computed as the
+	 * members are read and compared against the 'stored' copy.
+	 *
+	 * Each record is "<8 hex digits> <filename>\0".
+	 */
+	struct {
+		bool enabled;
+		bool in_member;		/* reading XCPIO_CSUM_MEMBER */
+		bool found;
+		uint32_t crc;		/* of the current member */
+		struct cpio_buf computed;
+		struct cpio_buf stored;
+		uint64_t checked;
+		uint64_t mismatched;
+	} csum;
 };
 
 extern	struct cpio_archive * cpio_archive_create(const char *file, cpio_archive_mode mode);
 extern	int cpio_archive_set_blocksize(struct cpio_archive *a, int block_size);
+extern	int cpio_archive_set_memory_budget(struct cpio_archive *a, size_t bytes);
+extern	int cpio_archive_add_output(struct cpio_archive *a, const char *file);
+extern	int cpio_archive_set_io(struct cpio_archive *a, const struct cpio_io_ops *ops, void *arg);
 extern	int cpio_archive_open(struct cpio_archive *a);
+extern	int cpio_archive_preallocate(struct cpio_archive *a, off_t size);
 extern	int cpio_archive_close(struct cpio_archive *a);
 extern	int cpio_archive_free(struct cpio_archive *a);
 extern	int cpio_archive_write_file(struct cpio_archive *a, const char *filename);
 extern	int cpio_archive_write_files(struct cpio_archive *a);
+extern	int cpio_archive_write_shards(struct cpio_archive *a, int nshards);
+extern	int cpio_archive_write_tree(struct cpio_archive *a);
 extern	int cpio_archive_write_add_manifest(struct cpio_archive *a, const char *filename);
+extern	int cpio_archive_write_add_manifest_len(struct cpio_archive *a, const char *filename, size_t len);
+extern	int cpio_archive_stat_files(struct cpio_archive *a, int nthreads);
+extern	int cpio_archive_set_order(struct cpio_archive *a, cpio_archive_order order);
+extern	int cpio_archive_plan(struct cpio_archive *a, bool walk, struct cpio_archive_plan *p);
+extern	int cpio_archive_reserve(struct cpio_archive *a, const struct cpio_archive_plan *p);
 extern	int cpio_archive_begin_read(struct cpio_archive *a, bool do_extract);
+extern	int cpio_archive_next_entry(struct cpio_archive *a, const struct cpio_header **hdr);
+extern	ssize_t cpio_archive_read_payload(struct cpio_archive *a, char *buf, size_t len);
+extern	ssize_t cpio_archive_read_payload_span(struct cpio_archive *a, const char **ptr);
+extern	int cpio_archive_skip_payload(struct cpio_archive *a);
+extern	int cpio_archive_repack(struct cpio_archive *in, struct cpio_archive *out);
+extern	int cpio_archive_merge(struct cpio_archive *out, struct cpio_archive *in, const struct cpio_archive_filter *f);
+extern	bool cpio_archive_filter_match(const struct cpio_archive_filter *f, const char *filename);
+extern	int cpio_archive_set_skip_unchanged(struct cpio_archive *a, cpio_archive_skip skip);
+extern	int cpio_archive_set_journal(struct cpio_archive *a, const char *path, bool resume);
+extern	int cpio_archive_set_durable(struct cpio_archive *a, int every);
+extern	int cpio_archive_set_checksum(struct cpio_archive *a, bool enable);
+extern	void cpio_archive_print_stats(struct cpio_archive *a, FILE *fp, bool json);
+extern	int cpio_archive_set_latency(struct cpio_archive *a, int nslow);
+extern	void cpio_archive_print_latency(struct cpio_archive *a, FILE *fp);
 extern	int cpio_archive_set_base_directory(struct cpio_archive *a, const char *dir);
 
 #endif	/* _CPIO_ARCHIVE_H__ */
@@ -68,27 +68,22 @@ cpio_header_free(struct cpio_header *c)
 }
 
 /*
- * Serialise the given struct stat header to the output stream.
+ * Serialise the given header into buf, which is size bytes long.
+ *
+ * Returns the serialised length, or -1 if it doesn't fit.
  */
-char *
-cpio_header_serialise(int fd, struct cpio_header *c, int *buf_len)
+int
+cpio_header_serialise_into(const struct cpio_header *c, char *buf,
+    size_t size)
 {
-	char buf[256];
-	char *ret_buf;
+	char hbuf[256];
+	size_t fn_len;
 	int len;
-	ssize_t r;
-	int ret_len = 0;
 
 	if (c->filename == NULL) {
-		return (NULL);
-	}
-
-	/* Allocate buffer, plenty of padding */
-	ret_buf = calloc(1, 256 + 256 + strlen(c->filename) + 1);
-	if (ret_buf == NULL) {
-		warn("calloc (%d bytes)", (int) (256 + 256 + strlen(c->filename) + 1));
-		return NULL;
+		return (-1);
 	}
+	fn_len = strlen(c->filename) + 1;
 
 	/*
 	 * This is more annoying than it should be.
@@ -98,7 +93,7 @@ cpio_header_serialise(int fd, struct cpio_header *c, int *buf_len)
 	 *
 	 * So, let's cheat. 6 octal digits is 6*3 = 18 bits long. 11*3 = 33 bits long.
 	 */
-	len = snprintf(buf, 256, "%6.6llo%6.6llo%6.6llo%6.6llo%6.6llo%6.6llo%6.6llo%6.6llo%11.11llo%6.6llo%11.11llo",
+	len = snprintf(hbuf, 256, "%6.6llo%6.6llo%6.6llo%6.6llo%6.6llo%6.6llo%6.6llo%6.6llo%11.11llo%6.6llo%11.11llo",
 		(unsigned long long)070707,
 		(unsigned long long)(c->st.st_dev & 0x3ffff),
 		(unsigned long long)(c->st.st_ino & 0x3ffff),
@@ -108,49 +103,75 @@ cpio_header_serialise(int fd, struct cpio_header *c, int *buf_len)
 		((unsigned long long) c->st.st_nlink) & 0x3ffff,
 		((unsigned long long) c->st.st_rdev) & 0x3ffff,
 		((unsigned long long) (c->st.st_mtime)) & 0x1ffffffffULL,
-		((unsigned long long) strlen(c->filename) + 1) & 0x3ffff,
+		((unsigned long long) fn_len) & 0x3ffff,
 		((unsigned long long) (c->st.st_size)) & 0x1ffffffffULL);
 
 	/*
 	 * We should error out if the length doesn't exactly match the
 	 * expected header size, when we DO have that header size..
 	 */
-	if (len != (6+6+6+6+6+6+6+6+11+6+11)) {
+	if (len != CPIO_HEADER_SIZE) {
 		warn("%s: snprintf (%d bytes)", __func__, len);
-		free(ret_buf);
-		return (NULL);
+		return (-1);
 	}
-	ret_len = len;
-	memcpy(ret_buf, buf, len);
+	if (len + fn_len > size) {
+		return (-1);
+	}
+	memcpy(buf, hbuf, len);
 
 	/* Now write the filename + trailing NUL; it's part of the header */
-	memcpy(ret_buf + ret_len, c->filename, strlen(c->filename) + 1);
-	ret_len += strlen(c->filename) + 1;
+	memcpy(buf + len, c->filename, fn_len);
+
+	return (len + fn_len);
+}
+
+/*
+ * Serialise the given struct stat header to the output stream.
+ */
+char *
+cpio_header_serialise(int fd, struct cpio_header *c, int *buf_len)
+{
+	char *ret_buf;
+	size_t size;
+	int len;
+
+	if (c->filename == NULL) {
+		return (NULL);
+	}
+
+	size = CPIO_HEADER_SIZE + strlen(c->filename) + 1;
+	ret_buf = calloc(1, size);
+	if (ret_buf == NULL) {
+		warn("calloc (%d bytes)", (int) size);
+		return NULL;
+	}
+
+	len = cpio_header_serialise_into(c, ret_buf, size);
+	if (len < 0) {
+		free(ret_buf);
+		return (NULL);
+	}
 
 	/* Return it! */
-	*buf_len = ret_len;
+	*buf_len = len;
 	return (ret_buf);
 }
 
 /*
- * Parse the given input stream buffer and populate a cpio_header
- * struct.
+ * Parse the fixed size part of a header into st, and the length of
+ * the filename (including its NUL) that follows it.
  *
- * Returns -1 on error, 0 on "not enough data", and a positive number
- * indiciating the header size (ie, what to skip to get to the file contenst)
- * + a cpio_header if the entire header and filename was read.
+ * Returns -1 on error, 0 on "not enough data" and 1 on success.
  */
-int
-cpio_header_deserialise(const char *buf, int len,
-	    struct cpio_header **hdr)
+static int
+cpio_header_parse_fixed(const char *buf, int len, struct stat *st,
+    int *filename_len)
 {
-	struct cpio_header *h = NULL;
 	char pbuf[32];
 	unsigned long long n;
-	int filename_len;
 
 	/* We need at least this many bytes for a CPIO header */
-	if (len < 76) {
+	if (len < CPIO_HEADER_SIZE) {
 		return (0);
 	}
 
@@ -160,102 +181,154 @@ cpio_header_deserialise(const char *buf, int len,
 	 * for each value, then strtoull() to convert it to the
 	 * octal value.
 	 */
-	h = cpio_header_allocate();
-	if (h == NULL) {
-		return (-1);
-	}
+	memset(st, 0, sizeof(*st));
 
 	/* magic */
 	memcpy(pbuf, buf + 0, 6); pbuf[6] = '\0';
 	n = strtoull(pbuf, NULL, 8);
 	if (n != 070707) {
 		fprintf(stderr, "%s; bad magic\n", __func__);
-		goto fail;
+		return (-1);
 	}
 
 	/* dev */
 	memcpy(pbuf, buf + 6, 6); pbuf[6] = '\0';
 	n = strtoull(pbuf, NULL, 8);
-	h->st.st_dev = (dev_t) n;
+	st->st_dev = (dev_t) n;
 
 	/* inode */
 	memcpy(pbuf, buf + 12, 6); pbuf[6] = '\0';
 	n = strtoull(pbuf, NULL, 8);
-	h->st.st_ino = (ino_t) n;
+	st->st_ino = (ino_t) n;
 
 	/* mode */
 	memcpy(pbuf, buf + 18, 6); pbuf[6] = '\0';
 	n = strtoull(pbuf, NULL, 8);
-	h->st.st_mode = (mode_t) n;
+	st->st_mode = (mode_t) n;
 
 	/* uid */
 	memcpy(pbuf, buf + 24, 6); pbuf[6] = '\0';
 	n = strtoull(pbuf, NULL, 8);
-	h->st.st_uid = (uid_t) n;
+	st->st_uid = (uid_t) n;
 
 	/* gid */
 	memcpy(pbuf, buf + 30, 6); pbuf[6] = '\0';
 	n = strtoull(pbuf, NULL, 8);
-	h->st.st_gid = (gid_t) n;
+	st->st_gid = (gid_t) n;
 
 	/* nlink */
 	memcpy(pbuf, buf + 36, 6); pbuf[6] = '\0';
 	n = strtoull(pbuf, NULL, 8);
-	h->st.st_nlink = (nlink_t) n;
+	st->st_nlink = (nlink_t) n;
 
 	/* rdev */
 	memcpy(pbuf, buf + 42, 6); pbuf[6] = '\0';
 	n = strtoull(pbuf, NULL, 8);
-	h->st.st_rdev = (dev_t) n;
+	st->st_rdev = (dev_t) n;
 
 	/* mtime - 11 */
 	memcpy(pbuf, buf + 48, 11); pbuf[11] = '\0';
 	n = strtoull(pbuf, NULL, 8);
-	h->st.st_mtime = (time_t) n;
+	st->st_mtime = (time_t) n;
 
 	/* filename length */
 	memcpy(pbuf, buf + 59, 6); pbuf[6] = '\0';
 	n = strtoull(pbuf, NULL, 8);
-	filename_len = n;
+	if (n > CPIO_NAME_MAX) {
+		fprintf(stderr, "%s: namesize %llu is too long\n", __func__,
+		    (unsigned long long) n);
+		return (-1);
+	}
+	*filename_len = n;
 
 	/* file length - 11 */
 	memcpy(pbuf, buf + 65, 11); pbuf[11] = '\0';
-	h->st.st_size = strtoull(pbuf, NULL, 8);
+	st->st_size = strtoull(pbuf, NULL, 8);
 
 	/*
 	 * Check that we have enough bytes for the filename size
 	 * that was provided.  If not then we need more data.
 	 */
-	if (len < 76 + filename_len) {
-		cpio_header_free(h);
+	if (len < CPIO_HEADER_SIZE + *filename_len) {
 		return (0);
 	}
+	return (1);
+}
+
+/*
+ * Parse the given input stream buffer and populate a cpio_header
+ * struct.
+ *
+ * Returns -1 on error, 0 on "not enough data", and a positive number
+ * indiciating the header size (ie, what to skip to get to the file contenst)
+ * + a cpio_header if the entire header and filename was read.
+ */
+int
+cpio_header_deserialise(const char *buf, int len,
+	    struct cpio_header **hdr)
+{
+	struct cpio_header *h = NULL;
+	struct stat st;
+	int filename_len, r;
+
+	r = cpio_header_parse_fixed(buf, len, &st, &filename_len);
+	if (r <= 0) {
+		return (r);
+	}
+
+	h = cpio_header_allocate();
+	if (h == NULL) {
+		return (-1);
+	}
+	h->st = st;
 
 	/*
 	 * Ok, our temporary cpio_header has all the bits.
 	 * Return it and how many bytes we consumed.
+	 *
+	 * The namesize includes the trailing NUL; strndup() copies up
+	 * to it and terminates the copy even if the archive's is
+	 * missing.
 	 */
-	h->filename = strndup(buf + 76, filename_len);
+	h->filename = strndup(buf + CPIO_HEADER_SIZE, filename_len);
 	if (h->filename == NULL) {
 		warn("%s: strndup (%d bytes)", __func__, filename_len);
-		goto fail;
+		cpio_header_free(h);
+		return (-1);
 	}
 
-	/*
-	 * Paranoia!
-	 */
-	h->filename[filename_len] = '\0';
-
 	*hdr = h;
 
 	/*
 	 * And finally, how much data to skip!
 	 */
-	return (76 + filename_len);
+	return (CPIO_HEADER_SIZE + filename_len);
+}
 
-fail:
-	if (h) {
-		cpio_header_free(h);
+/*
+ * As cpio_header_deserialise(), but fill in the caller's header and
+ * copy the filename into name (name_size bytes) rather than
+ * allocating.  A filename that doesn't fit is an error.
+ */
+int
+cpio_header_deserialise_into(const char *buf, int len,
+    struct cpio_header *h, char *name, size_t name_size)
+{
+	int filename_len, r;
+
+	r = cpio_header_parse_fixed(buf, len, &h->st, &filename_len);
+	if (r <= 0) {
+		return (r);
 	}
-	return (-1);
+	/* The length includes the NUL */
+	if ((filename_len < 1) || ((size_t) filename_len > name_size)) {
+		fprintf(stderr, "%s: bad filename length (%d bytes, have %zu)\n",
+		    __func__, filename_len, name_size);
+		return (-1);
+	}
+	memcpy(name, buf + CPIO_HEADER_SIZE, filename_len);
+	name[filename_len - 1] = '\0';
+	h->filename = name;
+
+	return (CPIO_HEADER_SIZE + filename_len);
 }
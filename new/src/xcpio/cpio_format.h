@@ -1,6 +1,16 @@
 #ifndef	__CPIO_FORMAT_H__
 #define	__CPIO_FORMAT_H__
 
+#include <limits.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+/* The fixed size part of an odc header, before the filename */
+#define	CPIO_HEADER_SIZE	76
+
+/* The longest namesize (including the NUL) accepted when parsing */
+#define	CPIO_NAME_MAX		(PATH_MAX + 1)
+
 struct cpio_header {
 	struct stat st;
 	char *filename;
@@ -21,15 +31,32 @@ extern	void cpio_header_free(struct cpio_header *);
  */
 extern	char * cpio_header_serialise(int fd, struct cpio_header *c, int *buf_len);
 
+/*
+ * Serialise the header into the given buffer without allocating.
+ *
+ * Returns the length written or -1 if it doesn't fit.
+ */
+extern	int cpio_header_serialise_into(const struct cpio_header *c,
+	    char *buf, size_t size);
+
 /*
  * Parse the given input stream buffer and populate a cpio_header
  * struct.
  *
  * Returns -1 on error, 0 on "not enough data", and a positive number
- * + a cpio_header if the entire header and filename was read.
+ * + a cpio_header if the entire header and filename was read.  A
+ * namesize over CPIO_NAME_MAX is an error, so a corrupt header can't
+ * have the caller buffer without bound.
  */
 extern	int cpio_header_deserialise(const char *buf, int len,
 	    struct cpio_header **hdr);
 
+/*
+ * As above, but parse into the caller's header and filename buffer
+ * without allocating.  h->filename is pointed at name.
+ */
+extern	int cpio_header_deserialise_into(const char *buf, int len,
+	    struct cpio_header *h, char *name, size_t name_size);
+
 
 #endif	/* __CPIO_FORMAT_H__ */
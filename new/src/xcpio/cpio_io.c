@@ -0,0 +1,127 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/param.h>
+#include <sys/uio.h>
+
+#include "cpio_io.h"
+
+static ssize_t
+cpio_io_fd_read(void *arg, void *buf, size_t len)
+{
+
+	return (read(*(int *) arg, buf, len));
+}
+
+static ssize_t
+cpio_io_fd_write(void *arg, const void *buf, size_t len)
+{
+
+	return (write(*(int *) arg, buf, len));
+}
+
+const struct cpio_io_ops cpio_io_fd_ops = {
+	.read = cpio_io_fd_read,
+	.write = cpio_io_fd_write,
+};
+
+static ssize_t
+cpio_io_mem_read(void *arg, void *buf, size_t len)
+{
+	struct cpio_io_mem *m = arg;
+	size_t n;
+
+	if (m->off >= m->len)
+		return (0);
+	n = MIN(len, m->len - m->off);
+	memcpy(buf, m->buf + m->off, n);
+	m->off += n;
+	return (n);
+}
+
+static ssize_t
+cpio_io_mem_write(void *arg, const void *buf, size_t len)
+{
+	struct cpio_io_mem *m = arg;
+	size_t size;
+	char *p;
+
+	if (m->len + len > m->size) {
+		if (m->fixed) {
+			errno = ENOSPC;
+			return (-1);
+		}
+		/* Double, so building a large archive stays linear */
+		size = MAX(m->size * 2, 4096);
+		while (size < m->len + len)
+			size *= 2;
+		p = realloc(m->buf, size);
+		if (p == NULL)
+			return (-1);
+		m->buf = p;
+		m->size = size;
+	}
+	memcpy(m->buf + m->len, buf, len);
+	m->len += len;
+	return (len);
+}
+
+const struct cpio_io_ops cpio_io_mem_ops = {
+	.read = cpio_io_mem_read,
+	.write = cpio_io_mem_write,
+};
+
+static ssize_t
+cpio_io_iov_read(void *arg, void *buf, size_t len)
+{
+	struct cpio_io_iov *v = arg;
+	size_t n = 0, c;
+
+	while ((n < len) && (v->idx < v->iovcnt)) {
+		c = MIN(len - n, v->iov[v->idx].iov_len - v->off);
+		memcpy((char *) buf + n,
+		    (const char *) v->iov[v->idx].iov_base + v->off, c);
+		n += c;
+		v->off += c;
+		if (v->off == v->iov[v->idx].iov_len) {
+			v->idx++;
+			v->off = 0;
+		}
+	}
+	v->len += n;
+	return (n);
+}
+
+static ssize_t
+cpio_io_iov_write(void *arg, const void *buf, size_t len)
+{
+	struct cpio_io_iov *v = arg;
+	size_t n = 0, c;
+
+	while ((n < len) && (v->idx < v->iovcnt)) {
+		c = MIN(len - n, v->iov[v->idx].iov_len - v->off);
+		memcpy((char *) v->iov[v->idx].iov_base + v->off,
+		    (const char *) buf + n, c);
+		n += c;
+		v->off += c;
+		if (v->off == v->iov[v->idx].iov_len) {
+			v->idx++;
+			v->off = 0;
+		}
+	}
+	v->len += n;
+	if ((n == 0) && (len > 0)) {
+		errno = ENOSPC;
+		return (-1);
+	}
+	return (n);
+}
+
+const struct cpio_io_ops cpio_io_iov_ops = {
+	.read = cpio_io_iov_read,
+	.write = cpio_io_iov_write,
+};
@@ -0,0 +1,55 @@
+#ifndef	__CPIO_IO_H__
+#define	__CPIO_IO_H__
+
+#include <stdbool.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+/*
+ * Where archive bytes come from and go to.
+ *
+ * read() and write() behave like their syscall namesakes: they may
+ * transfer less than asked, return 0 at end of input and -1 with
+ * errno set on error.  A backend only needs the operation(s) it is
+ * used for.
+ */
+struct cpio_io_ops {
+	ssize_t (*read)(void *arg, void *buf, size_t len);
+	ssize_t (*write)(void *arg, const void *buf, size_t len);
+};
+
+/*
+ * A file descriptor; arg is a pointer to the int fd.
+ */
+extern	const struct cpio_io_ops cpio_io_fd_ops;
+
+/*
+ * A memory buffer.  Writes append at len, growing buf as needed
+ * unless fixed is set (then they fail with ENOSPC.)  Reads start
+ * at off and stop at len.
+ */
+struct cpio_io_mem {
+	char *buf;
+	size_t len, size;
+	size_t off;
+	bool fixed;
+};
+
+extern	const struct cpio_io_ops cpio_io_mem_ops;
+
+/*
+ * A caller-supplied iovec list.  Reads gather from it and writes
+ * scatter into it, in order; writes past the end fail with ENOSPC.
+ * idx/off track the current position and len the bytes done.
+ */
+struct cpio_io_iov {
+	const struct iovec *iov;
+	int iovcnt;
+	int idx;
+	size_t off;
+	size_t len;
+};
+
+extern	const struct cpio_io_ops cpio_io_iov_ops;
+
+#endif	/* __CPIO_IO_H__ */
@@ -0,0 +1,102 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <limits.h>
+#include <err.h>
+#include <sys/types.h>
+#include <sys/param.h>
+
+#include "cpio_format.h"
+#include "cpio_reader.h"
+
+struct cpio_reader *
+cpio_reader_create(void)
+{
+	struct cpio_reader *r;
+
+	r = calloc(1, sizeof(*r));
+	if (r == NULL) {
+		warn("%s: calloc", __func__);
+		return (NULL);
+	}
+	return (r);
+}
+
+void
+cpio_reader_free(struct cpio_reader *r)
+{
+
+	if (r == NULL)
+		return;
+	if (r->c != NULL)
+		cpio_header_free(r->c);
+	free(r);
+}
+
+ssize_t
+cpio_reader_feed(struct cpio_reader *r, const char *buf, size_t len,
+    struct cpio_reader_event *ev)
+{
+	struct cpio_header *c = NULL;
+	size_t remaining;
+	int rr;
+
+	memset(ev, 0, sizeof(*ev));
+
+	/* Anything after the trailer is block padding */
+	if (r->done) {
+		ev->type = CPIO_READER_END;
+		return (0);
+	}
+
+	/* Hand back payload for the current member, straight from buf */
+	if (r->c != NULL) {
+		remaining = r->c->st.st_size - r->consumed_bytes;
+		if (remaining > 0) {
+			ev->hdr = r->c;
+			if (len == 0) {
+				ev->type = CPIO_READER_NEED_MORE;
+				return (0);
+			}
+			ev->type = CPIO_READER_DATA;
+			ev->data = buf;
+			ev->len = MIN(remaining, len);
+			r->consumed_bytes += ev->len;
+			return (ev->len);
+		}
+	}
+
+	/*
+	 * The finished member's header is kept until the next header
+	 * or the trailer has been parsed, as the caller may still be
+	 * using it.
+	 */
+	rr = cpio_header_deserialise(buf, MIN(len, (size_t) INT_MAX), &c);
+	if (rr < 0) {
+		return (-1);
+	}
+	if (rr == 0) {
+		ev->type = CPIO_READER_NEED_MORE;
+		return (0);
+	}
+	if (r->c != NULL) {
+		cpio_header_free(r->c);
+		r->c = NULL;
+	}
+
+	/* Check for end of archive marker */
+	if ((c->st.st_size == 0) &&
+	    (strncmp(c->filename, "TRAILER!!!", 10) == 0)) {
+		cpio_header_free(c);
+		r->done = true;
+		ev->type = CPIO_READER_END;
+		return (rr);
+	}
+
+	r->c = c;
+	r->consumed_bytes = 0;
+	ev->type = CPIO_READER_HEADER;
+	ev->hdr = c;
+	return (rr);
+}
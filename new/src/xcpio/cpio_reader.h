@@ -0,0 +1,52 @@
+#ifndef	__CPIO_READER_H__
+#define	__CPIO_READER_H__
+
+#include <stdbool.h>
+#include <sys/types.h>
+
+/*
+ * A push-style archive parser.
+ *
+ * The caller does its own I/O and feeds whatever bytes it has;
+ * each call reports one event and how many bytes it consumed.
+ * Unconsumed bytes must be fed again (with more appended) on the
+ * next call.  Nothing is buffered or copied by the reader, so it
+ * is suitable for non-blocking sockets and event loops.
+ */
+enum cpio_reader_event_type {
+	CPIO_READER_NEED_MORE = 0,	/* header incomplete; feed more */
+	CPIO_READER_HEADER,		/* a new member; see hdr */
+	CPIO_READER_DATA,		/* payload for the current member */
+	CPIO_READER_END,		/* saw the trailer */
+};
+typedef enum cpio_reader_event_type cpio_reader_event_type;
+
+struct cpio_reader_event {
+	cpio_reader_event_type type;
+	const struct cpio_header *hdr;	/* current member, if any */
+	const char *data;		/* DATA: points into the fed buffer */
+	size_t len;			/* DATA: payload bytes */
+};
+
+struct cpio_reader {
+	struct cpio_header *c;
+	size_t consumed_bytes;
+	bool done;
+};
+
+extern	struct cpio_reader * cpio_reader_create(void);
+extern	void cpio_reader_free(struct cpio_reader *r);
+
+/*
+ * Feed len bytes at buf to the reader.
+ *
+ * Returns the number of bytes consumed (possibly 0) and fills in
+ * *ev, or -1 on a malformed header.  A namesize over CPIO_NAME_MAX
+ * is malformed, so the caller never has to buffer more than
+ * CPIO_HEADER_SIZE + CPIO_NAME_MAX bytes for a header.  Headers
+ * handed back stay valid until the following HEADER or END event.
+ */
+extern	ssize_t cpio_reader_feed(struct cpio_reader *r, const char *buf,
+	    size_t len, struct cpio_reader_event *ev);
+
+#endif	/* __CPIO_READER_H__ */
@@ -0,0 +1,112 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define	CRC32C_X86	1
+#include <nmmintrin.h>
+#endif
+
+#if defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+#define	CRC32C_ARM	1
+#include <arm_acle.h>
+#endif
+
+#include "crc32c.h"
+
+/* Reflected Castagnoli polynomial */
+#define	CRC32C_POLY	0x82f63b78
+
+static uint32_t crc32c_table[256];
+static uint32_t (*crc32c_impl)(uint32_t, const uint8_t *, size_t);
+static pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
+
+static uint32_t
+crc32c_sw(uint32_t crc, const uint8_t *p, size_t len)
+{
+
+	while (len-- > 0) {
+		crc = crc32c_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+	}
+	return (crc);
+}
+
+#ifdef	CRC32C_X86
+__attribute__((target("sse4.2")))
+static uint32_t
+crc32c_hw(uint32_t crc, const uint8_t *p, size_t len)
+{
+	uint64_t c = crc, v;
+
+	while ((len > 0) && (((uintptr_t) p & 7) != 0)) {
+		c = _mm_crc32_u8((uint32_t) c, *p++);
+		len--;
+	}
+	while (len >= 8) {
+		memcpy(&v, p, 8);
+		c = _mm_crc32_u64(c, v);
+		p += 8;
+		len -= 8;
+	}
+	while (len-- > 0) {
+		c = _mm_crc32_u8((uint32_t) c, *p++);
+	}
+	return ((uint32_t) c);
+}
+#endif
+
+#ifdef	CRC32C_ARM
+static uint32_t
+crc32c_hw(uint32_t crc, const uint8_t *p, size_t len)
+{
+	uint64_t v;
+
+	while ((len > 0) && (((uintptr_t) p & 7) != 0)) {
+		crc = __crc32cb(crc, *p++);
+		len--;
+	}
+	while (len >= 8) {
+		memcpy(&v, p, 8);
+		crc = __crc32cd(crc, v);
+		p += 8;
+		len -= 8;
+	}
+	while (len-- > 0) {
+		crc = __crc32cb(crc, *p++);
+	}
+	return (crc);
+}
+#endif
+
+static void
+crc32c_init(void)
+{
+	uint32_t c;
+	int i, j;
+
+	for (i = 0; i < 256; i++) {
+		c = i;
+		for (j = 0; j < 8; j++) {
+			c = (c & 1) ? (c >> 1) ^ CRC32C_POLY : (c >> 1);
+		}
+		crc32c_table[i] = c;
+	}
+
+	crc32c_impl = crc32c_sw;
+#if defined(CRC32C_X86)
+	if (__builtin_cpu_supports("sse4.2"))
+		crc32c_impl = crc32c_hw;
+#elif defined(CRC32C_ARM)
+	crc32c_impl = crc32c_hw;
+#endif
+}
+
+uint32_t
+crc32c(uint32_t crc, const void *buf, size_t len)
+{
+
+	pthread_once(&crc32c_once, crc32c_init);
+	return (~crc32c_impl(~crc, buf, len));
+}
@@ -0,0 +1,15 @@
+#ifndef	__CRC32C_H__
+#define	__CRC32C_H__
+
+/*
+ * Update a CRC32C (Castagnoli) checksum with the given data.
+ *
+ * Start with a crc of 0; the result of one call can be passed back
+ * in to checksum data that arrives in pieces.
+ *
+ * This uses the SSE4.2 / ARMv8 CRC32 instructions where available
+ * and a lookup table otherwise.
+ */
+extern	uint32_t crc32c(uint32_t crc, const void *buf, size_t len);
+
+#endif	/* __CRC32C_H__ */
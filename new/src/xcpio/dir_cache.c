@@ -0,0 +1,261 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "dir_cache.h"
+
+struct dir_cache *
+dir_cache_create(int base_fd)
+{
+	struct dir_cache *dc;
+
+	dc = calloc(1, sizeof(*dc));
+	if (dc == NULL) {
+		warn("%s: calloc", __func__);
+		return (NULL);
+	}
+	dc->base_fd = base_fd;
+	return (dc);
+}
+
+void
+dir_cache_flush(struct dir_cache *dc)
+{
+	int i;
+
+	for (i = 0; i < dc->nentries; i++) {
+		close(dc->e[i].fd);
+		if (dc->pool == NULL)
+			free(dc->e[i].path);
+	}
+	dc->nentries = 0;
+}
+
+/*
+ * Use the given memory for the cached paths and the lookup scratch
+ * path from now on, rather than allocating them.  It must be
+ * DIR_CACHE_POOL_SIZE(path_size) bytes long; longer paths can't be
+ * looked up.
+ */
+int
+dir_cache_set_pool(struct dir_cache *dc, char *pool, size_t path_size)
+{
+
+	if (dc->nentries != 0) {
+		fprintf(stderr, "%s: cache isn't empty\n", __func__);
+		return (-1);
+	}
+	dc->pool = pool;
+	dc->path_size = path_size;
+	return (0);
+}
+
+void
+dir_cache_free(struct dir_cache *dc)
+{
+
+	dir_cache_flush(dc);
+	free(dc);
+}
+
+/*
+ * Add a directory descriptor to the cache, evicting the least
+ * recently used entry if it's full.  The cache takes ownership of
+ * fd.
+ *
+ * Note: the entry the caller is walking from was touched before the
+ * walk began so it's never the one evicted here.
+ */
+static int
+dir_cache_insert(struct dir_cache *dc, const char *path, int fd)
+{
+	struct dir_cache_entry *e;
+	char *p;
+	int i;
+
+	if (dc->pool != NULL) {
+		p = NULL;
+	} else {
+		p = strdup(path);
+		if (p == NULL) {
+			warn("%s: strdup", __func__);
+			close(fd);
+			return (-1);
+		}
+	}
+
+	if (dc->nentries < DIR_CACHE_NENTRIES) {
+		e = &dc->e[dc->nentries];
+		if (p == NULL)
+			p = dc->pool + dc->nentries * dc->path_size;
+		dc->nentries++;
+	} else {
+		e = &dc->e[0];
+		for (i = 1; i < dc->nentries; i++) {
+			if (dc->e[i].last_used < e->last_used)
+				e = &dc->e[i];
+		}
+		close(e->fd);
+		if (p == NULL)
+			p = e->path;
+		else
+			free(e->path);
+	}
+
+	/* The lookup checked it fits */
+	if (dc->pool != NULL)
+		strcpy(p, path);
+	e->path = p;
+	e->fd = fd;
+	e->last_used = ++dc->clock;
+	return (fd);
+}
+
+int
+dir_cache_lookup(struct dir_cache *dc, const char *dirpath, bool create)
+{
+	struct dir_cache_entry *best = NULL;
+	size_t len, blen = 0, elen, start, end;
+	char *p = NULL, *comp;
+	int i, fd, parent_fd;
+
+	/* Everything is relative to the base, so drop leading slashes */
+	while (*dirpath == '/')
+		dirpath++;
+	len = strlen(dirpath);
+	while ((len > 0) && (dirpath[len - 1] == '/'))
+		len--;
+	if (len == 0) {
+		return (dc->base_fd);
+	}
+
+	/* Find the longest cached prefix of this path */
+	for (i = 0; i < dc->nentries; i++) {
+		elen = strlen(dc->e[i].path);
+		if ((elen <= len) && (elen > blen) &&
+		    (strncmp(dc->e[i].path, dirpath, elen) == 0) &&
+		    ((elen == len) || (dirpath[elen] == '/'))) {
+			best = &dc->e[i];
+			blen = elen;
+		}
+	}
+	if (best != NULL) {
+		best->last_used = ++dc->clock;
+		if (blen == len) {
+			return (best->fd);
+		}
+		parent_fd = best->fd;
+	} else {
+		parent_fd = dc->base_fd;
+	}
+
+	/* Walk the remaining components from the cached parent */
+	if (dc->pool != NULL) {
+		if (len >= dc->path_size) {
+			fprintf(stderr, "%s: path too long (%.*s)\n",
+			    __func__, (int) len, dirpath);
+			return (-1);
+		}
+		p = dc->pool + DIR_CACHE_NENTRIES * dc->path_size;
+		memcpy(p, dirpath, len);
+		p[len] = '\0';
+	} else {
+		p = strndup(dirpath, len);
+		if (p == NULL) {
+			warn("%s: strndup", __func__);
+			return (-1);
+		}
+	}
+
+	start = blen;
+	while (start < len) {
+		if (p[start] == '/') {
+			start++;
+			continue;
+		}
+		for (end = start; (end < len) && (p[end] != '/'); end++)
+			;
+		p[end] = '\0';
+		comp = p + start;
+
+		if (strcmp(comp, ".") == 0) {
+			goto next;
+		}
+		if (strcmp(comp, "..") == 0) {
+			fprintf(stderr, "%s: refusing '..' in path (%s)\n",
+			    __func__, p);
+			goto fail;
+		}
+
+		fd = openat(parent_fd, comp, O_RDONLY | O_DIRECTORY);
+		if ((fd < 0) && (errno == ENOENT) && create) {
+			if ((mkdirat(parent_fd, comp, 0755) != 0) &&
+			    (errno != EEXIST)) {
+				warn("%s: mkdirat (%s)", __func__, p);
+				goto fail;
+			}
+			fd = openat(parent_fd, comp, O_RDONLY | O_DIRECTORY);
+		}
+		if (fd < 0) {
+			warn("%s: openat (%s)", __func__, p);
+			goto fail;
+		}
+
+		parent_fd = dir_cache_insert(dc, p, fd);
+		if (parent_fd < 0) {
+			goto fail;
+		}
+next:
+		if (end < len)
+			p[end] = '/';
+		start = end + 1;
+	}
+
+	if (dc->pool == NULL)
+		free(p);
+	return (parent_fd);
+
+fail:
+	if (dc->pool == NULL)
+		free(p);
+	return (-1);
+}
+
+int
+dir_cache_parent(struct dir_cache *dc, char *path, bool create, char **leaf)
+{
+	size_t len;
+	char *s;
+
+	len = strlen(path);
+	while ((len > 1) && (path[len - 1] == '/'))
+		path[--len] = '\0';
+
+	s = strrchr(path, '/');
+	if (s == NULL) {
+		if (strcmp(path, "..") == 0) {
+			fprintf(stderr, "%s: refusing '..' as a path\n",
+			    __func__);
+			return (-1);
+		}
+		*leaf = path;
+		return (dc->base_fd);
+	}
+	*s = '\0';
+	*leaf = s + 1;
+	if (strcmp(*leaf, "..") == 0) {
+		fprintf(stderr, "%s: refusing '..' in path (%s)\n",
+		    __func__, path);
+		return (-1);
+	}
+	return (dir_cache_lookup(dc, path, create));
+}
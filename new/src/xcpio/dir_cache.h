@@ -0,0 +1,76 @@
+#ifndef	__DIR_CACHE_H__
+#define	__DIR_CACHE_H__
+
+/*
+ * A small LRU cache of open directory descriptors, keyed by their
+ * path relative to a base directory.
+ *
+ * This lets extraction open/create files relative to their parent
+ * directory rather than walking the full path from the base every
+ * time, and creates any missing parent directories ("mkdir -p")
+ * along the way.
+ */
+
+#define	DIR_CACHE_NENTRIES	16
+
+/* Pool size for dir_cache_set_pool(); the entries plus a scratch path */
+#define	DIR_CACHE_POOL_SIZE(path_size)	((DIR_CACHE_NENTRIES + 1) * (path_size))
+
+struct dir_cache_entry {
+	char *path;
+	int fd;
+	uint64_t last_used;
+};
+
+struct dir_cache {
+	int base_fd;
+	uint64_t clock;
+	int nentries;
+	struct dir_cache_entry e[DIR_CACHE_NENTRIES];
+	char *pool;		/* if set, path storage; see set_pool */
+	size_t path_size;
+};
+
+/*
+ * Create a directory cache for paths relative to base_fd.
+ * The cache doesn't own base_fd.
+ */
+extern	struct dir_cache * dir_cache_create(int base_fd);
+
+/*
+ * Close all cached directory descriptors and free the cache.
+ */
+extern	void dir_cache_free(struct dir_cache *);
+
+/*
+ * Close all cached directory descriptors.
+ */
+extern	void dir_cache_flush(struct dir_cache *);
+
+/*
+ * Keep paths in caller supplied memory rather than allocating.
+ */
+extern	int dir_cache_set_pool(struct dir_cache *, char *, size_t);
+
+/*
+ * Return a descriptor for the given directory, relative to the base.
+ * If create is true then any missing directories along the way are
+ * created.
+ *
+ * The descriptor belongs to the cache; it must not be closed and is
+ * only valid until the next call into the cache.
+ *
+ * Returns -1 on error.
+ */
+extern	int dir_cache_lookup(struct dir_cache *, const char *, bool);
+
+/*
+ * Split the given path into its parent directory and leaf name and
+ * return a descriptor for the parent, as per dir_cache_lookup().
+ *
+ * The path is modified in place; *leaf is set to point at the leaf
+ * name within it.
+ */
+extern	int dir_cache_parent(struct dir_cache *, char *, bool, char **);
+
+#endif	/* __DIR_CACHE_H__ */
@@ -10,7 +10,6 @@ static int
 file_list_grow(struct file_list *f, int size)
 {
 	char **fl;
-	int i;
 
 	if (f->nentries > f->nsize) {
 		fprintf(stderr, "%s: inconsitent internal sizing\n", __func__);
@@ -22,17 +21,11 @@ file_list_grow(struct file_list *f, int size)
 		return (0);
 	}
 
-	fl = calloc(size, sizeof(char *));
+	fl = realloc(f->file_list, size * sizeof(char *));
 	if (fl == NULL) {
-		warn("%s: calloc", __func__);
+		warn("%s: realloc", __func__);
 		return (-1);
 	}
-
-	for (i = 0; i < f->nentries; i++) {
-		fl[i] = f->file_list[i];
-	}
-
-	free(f->file_list);
 	f->file_list = fl;
 	f->nsize = size;
 	return (0);
@@ -56,7 +49,7 @@ void
 file_list_free(struct file_list *f)
 {
 	file_list_flush(f);
-	if (f->file_list) {
+	if (f->file_list && (f->pool == NULL)) {
 		free(f->file_list);
 	}
 	free(f);
@@ -67,30 +60,120 @@ file_list_flush(struct file_list *f)
 {
 	int i;
 
-	for (i = 0; i < f->nentries; i++) {
-		free(f->file_list[i]);
+	if (f->pool == NULL) {
+		for (i = 0; i < f->nentries; i++) {
+			free(f->file_list[i]);
+		}
 	}
 	f->nentries = 0;
+	f->pool_used = 0;
 }
 
+/*
+ * Carve entries out of the given memory from now on rather than
+ * allocating them.  The list must be empty; the memory must be
+ * pointer aligned and outlive the list.
+ */
 int
-file_list_add_entry(struct file_list *f, const char *str)
+file_list_set_pool(struct file_list *f, void *pool, size_t size)
+{
+
+	if (f->nentries != 0) {
+		fprintf(stderr, "%s: list isn't empty\n", __func__);
+		return (-1);
+	}
+	free(f->file_list);
+	f->file_list = pool;
+	f->nsize = 0;
+	f->pool = pool;
+	f->pool_size = size;
+	f->pool_used = 0;
+	return (0);
+}
+
+static int
+file_list_pool_add_entry(struct file_list *f, const char *str, size_t slen)
 {
+	size_t len = slen + 1;
+	char *p;
+
+	if ((f->nentries + 1) * sizeof(char *) + f->pool_used + len >
+	    f->pool_size) {
+		fprintf(stderr, "%s: out of pool space for '%.*s'\n",
+		    __func__, (int) slen, str);
+		return (-1);
+	}
+	f->pool_used += len;
+	p = f->pool + f->pool_size - f->pool_used;
+	memcpy(p, str, slen);
+	p[slen] = '\0';
+	f->file_list[f->nentries] = p;
+	f->nentries++;
+	f->nsize = f->nentries;
+	return (0);
+}
+
+/*
+ * Add the len bytes at str (which needn't be NUL terminated) as an
+ * entry.
+ */
+int
+file_list_add_entry_len(struct file_list *f, const char *str, size_t len)
+{
+	char *p;
 	int r;
 
+	if (f->pool != NULL) {
+		return (file_list_pool_add_entry(f, str, len));
+	}
+
 	/*
-	 * If there's not enough space then add 16 more entries.
-	 * It's an arbitrary number but right now we're running
-	 * on little embedded things with limited RAM and this
-	 * should be used for small archives.
+	 * If there's not enough space then double it, starting at
+	 * 16 entries.  Small lists on little embedded things stay
+	 * small, and multi-million entry manifests don't spend their
+	 * time copying the array.
 	 */
 	if (f->nentries == f->nsize) {
-		r = file_list_grow(f, f->nsize + 16);
+		r = file_list_grow(f, f->nsize == 0 ? 16 : f->nsize * 2);
 		if (r != 0) {
 			return (r);
 		}
 	}
-	f->file_list[f->nentries] = strdup(str);
+	p = malloc(len + 1);
+	if (p == NULL) {
+		warn("%s: malloc", __func__);
+		return (-1);
+	}
+	memcpy(p, str, len);
+	p[len] = '\0';
+	f->file_list[f->nentries] = p;
 	f->nentries++;
 	return (0);
 }
+
+int
+file_list_add_entry(struct file_list *f, const char *str)
+{
+
+	return (file_list_add_entry_len(f, str, strlen(str)));
+}
+
+static int
+file_list_cmp(const void *a, const void *b)
+{
+
+	return (strcmp(*(char * const *) a, *(char * const *) b));
+}
+
+/*
+ * Sort the entries by name.
+ */
+void
+file_list_sort(struct file_list *f)
+{
+
+	if (f->nentries > 1) {
+		qsort(f->file_list, f->nentries, sizeof(char *),
+		    file_list_cmp);
+	}
+}
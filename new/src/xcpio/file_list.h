@@ -1,16 +1,29 @@
 #ifndef	__FILE_LIST_H__
 #define	__FILE_LIST_H__
 
+#include <stddef.h>
+
+/*
+ * If a pool is set then the entry array and the strings are carved
+ * out of it instead of being allocated: the array grows up from
+ * the start and the strings are packed down from the end.
+ */
 struct file_list {
 	int nentries;
 	int nsize;
 	char **file_list;
+	char *pool;
+	size_t pool_size;
+	size_t pool_used;	/* string bytes at the end of the pool */
 };
 
 extern	struct file_list * file_list_create(void);
 extern	void file_list_free(struct file_list *);
 extern	void file_list_flush(struct file_list *);
 extern	int file_list_add_entry(struct file_list *, const char *);
+extern	int file_list_add_entry_len(struct file_list *, const char *, size_t);
+extern	int file_list_set_pool(struct file_list *, void *, size_t);
+extern	void file_list_sort(struct file_list *);
 /* For now, hard-code iteration; will replace with an iterator function later */
 
 #endif
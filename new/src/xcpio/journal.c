@@ -0,0 +1,179 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <string.h>
+#include <err.h>
+#include <fcntl.h>
+
+#include "journal.h"
+#include "crc32c.h"
+
+#define	JOURNAL_MAGIC		"XCPIOJN1"
+
+/*
+ * The on-disk record at the start of each slot, followed by tail_len
+ * bytes of tail.  The CRC covers the record (with crc as 0) and the
+ * tail.  It's only ever read back by the same build that wrote it,
+ * so it's stored in native byte order.
+ */
+struct journal_record {
+	char magic[8];
+	uint64_t seq;
+	uint32_t mode;
+	uint32_t block_size;
+	uint64_t entries;
+	uint64_t offset;
+	uint32_t tail_len;
+	uint32_t crc;
+};
+
+struct journal *
+journal_open(const char *path, size_t max_tail, bool resume)
+{
+	struct journal *j;
+
+	j = calloc(1, sizeof(*j));
+	if (j == NULL) {
+		warn("%s: calloc", __func__);
+		return (NULL);
+	}
+	j->fd = -1;
+	j->max_tail = max_tail;
+	j->slot_size = sizeof(struct journal_record) + max_tail;
+	j->path = strdup(path);
+	j->buf = malloc(j->slot_size);
+	if ((j->path == NULL) || (j->buf == NULL)) {
+		warn("%s: malloc", __func__);
+		goto error;
+	}
+
+	j->fd = open(path, O_RDWR | O_CREAT | (resume ? 0 : O_TRUNC), 0644);
+	if (j->fd < 0) {
+		warn("%s: open (%s)", __func__, path);
+		goto error;
+	}
+	return (j);
+
+error:
+	journal_free(j);
+	return (NULL);
+}
+
+void
+journal_free(struct journal *j)
+{
+
+	if (j == NULL)
+		return;
+	if (j->fd > -1)
+		close(j->fd);
+	free(j->path);
+	free(j->buf);
+	free(j);
+}
+
+static uint32_t
+journal_crc(struct journal_record *r, const char *tail)
+{
+	uint32_t crc, saved = r->crc;
+
+	r->crc = 0;
+	crc = crc32c(0, r, sizeof(*r));
+	crc = crc32c(crc, tail, r->tail_len);
+	r->crc = saved;
+	return (crc);
+}
+
+int
+journal_load(struct journal *j, struct journal_state *st)
+{
+	struct journal_record r, best = { 0 };
+	ssize_t n;
+	int slot;
+	bool found = false;
+
+	for (slot = 0; slot < 2; slot++) {
+		n = pread(j->fd, j->buf, j->slot_size, slot * j->slot_size);
+		if (n < 0) {
+			warn("%s: pread (%s)", __func__, j->path);
+			return (-1);
+		}
+		if ((size_t) n < sizeof(r)) {
+			continue;
+		}
+		memcpy(&r, j->buf, sizeof(r));
+		if ((memcmp(r.magic, JOURNAL_MAGIC, sizeof(r.magic)) != 0) ||
+		    (r.tail_len > j->max_tail) ||
+		    ((size_t) n < sizeof(r) + r.tail_len) ||
+		    (journal_crc(&r, j->buf + sizeof(r)) != r.crc)) {
+			continue;
+		}
+		if (found && (r.seq < best.seq)) {
+			continue;
+		}
+		best = r;
+		found = true;
+		memcpy(st->tail, j->buf + sizeof(r), r.tail_len);
+	}
+	if (! found) {
+		return (0);
+	}
+
+	j->seq = best.seq;
+	st->mode = best.mode;
+	st->block_size = best.block_size;
+	st->entries = best.entries;
+	st->offset = best.offset;
+	st->tail_len = best.tail_len;
+	return (1);
+}
+
+int
+journal_save(struct journal *j, const struct journal_state *st)
+{
+	struct journal_record r;
+	size_t len;
+
+	if (st->tail_len > j->max_tail) {
+		return (-1);
+	}
+
+	bzero(&r, sizeof(r));
+	memcpy(r.magic, JOURNAL_MAGIC, sizeof(r.magic));
+	r.seq = ++j->seq;
+	r.mode = st->mode;
+	r.block_size = st->block_size;
+	r.entries = st->entries;
+	r.offset = st->offset;
+	r.tail_len = st->tail_len;
+	r.crc = journal_crc(&r, st->tail);
+
+	memcpy(j->buf, &r, sizeof(r));
+	if (st->tail_len > 0)
+		memcpy(j->buf + sizeof(r), st->tail, st->tail_len);
+	len = sizeof(r) + st->tail_len;
+
+	if (pwrite(j->fd, j->buf, len, (r.seq % 2) * j->slot_size) !=
+	    (ssize_t) len) {
+		warn("%s: pwrite (%s)", __func__, j->path);
+		return (-1);
+	}
+	if (fdatasync(j->fd) != 0) {
+		warn("%s: fdatasync (%s)", __func__, j->path);
+		return (-1);
+	}
+	return (0);
+}
+
+int
+journal_remove(struct journal *j)
+{
+
+	if (unlink(j->path) != 0) {
+		warn("%s: unlink (%s)", __func__, j->path);
+		return (-1);
+	}
+	return (0);
+}
@@ -0,0 +1,65 @@
+#ifndef	__JOURNAL_H__
+#define	__JOURNAL_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+ * A small restart journal for long running archive jobs.
+ *
+ * It holds a single record of how far a job got: how many members
+ * were completed, the archive offset that corresponds to and (when
+ * writing) the partial block still sitting in the write buffer.
+ *
+ * There are two record slots, written alternately, each with a
+ * sequence number and a CRC32C.  A torn write only ever damages the
+ * slot being written, so loading picks the newest intact one.
+ */
+
+struct journal_state {
+	int mode;		/* cpio_archive_mode of the job */
+	int block_size;
+	uint64_t entries;	/* members completed */
+	uint64_t offset;	/* archive fd offset they end at */
+	char *tail;		/* unwritten partial block, if any */
+	size_t tail_len;
+};
+
+struct journal {
+	char *path;
+	int fd;
+	uint64_t seq;
+	size_t max_tail;
+	size_t slot_size;
+	char *buf;
+};
+
+/*
+ * Open (creating if needed) the journal at path.  Unless resuming,
+ * any existing contents are discarded.  Records carry at most
+ * max_tail bytes of tail.
+ */
+extern	struct journal * journal_open(const char *, size_t, bool);
+extern	void journal_free(struct journal *);
+
+/*
+ * Load the newest intact record.  st->tail must have room for
+ * max_tail bytes.
+ *
+ * Returns 1 if there was one, 0 if not and -1 on error.
+ */
+extern	int journal_load(struct journal *, struct journal_state *);
+
+/*
+ * Write a new record and flush it to disk.  The caller must have made
+ * sure everything it describes is already on disk.
+ */
+extern	int journal_save(struct journal *, const struct journal_state *);
+
+/*
+ * The job is done; remove the journal.
+ */
+extern	int journal_remove(struct journal *);
+
+#endif	/* __JOURNAL_H__ */
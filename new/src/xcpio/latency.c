@@ -0,0 +1,233 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <err.h>
+
+#include "latency.h"
+
+static int
+latency_msb(uint64_t v)
+{
+
+	return (63 - __builtin_clzll(v));
+}
+
+static int
+latency_bucket(uint64_t v)
+{
+	int k;
+
+	if (v < LATENCY_SUB_BUCKETS)
+		return (v);
+	k = latency_msb(v);
+	return ((k - LATENCY_SUB_BITS + 1) * LATENCY_SUB_BUCKETS +
+	    ((v >> (k - LATENCY_SUB_BITS)) & (LATENCY_SUB_BUCKETS - 1)));
+}
+
+/*
+ * The highest value that lands in the given bucket.
+ */
+static uint64_t
+latency_bucket_value(int idx)
+{
+	uint64_t sub;
+	int k;
+
+	if (idx < LATENCY_SUB_BUCKETS)
+		return (idx);
+	k = idx / LATENCY_SUB_BUCKETS + LATENCY_SUB_BITS - 1;
+	sub = idx % LATENCY_SUB_BUCKETS;
+	return (((LATENCY_SUB_BUCKETS + sub + 1) << (k - LATENCY_SUB_BITS)) - 1);
+}
+
+void
+latency_hist_add(struct latency_hist *h, uint64_t ns)
+{
+
+	h->buckets[latency_bucket(ns)]++;
+	h->count++;
+	if (ns > h->max)
+		h->max = ns;
+}
+
+/*
+ * Return the value at the given percentile (0..100).  This is the
+ * upper bound of the bucket it falls in, clamped to the real max.
+ */
+uint64_t
+latency_hist_percentile(const struct latency_hist *h, double pct)
+{
+	uint64_t target, seen = 0, v;
+	int i;
+
+	if (h->count == 0)
+		return (0);
+	target = (uint64_t) (h->count * pct / 100.0 + 0.5);
+	if (target == 0)
+		target = 1;
+
+	for (i = 0; i < LATENCY_NBUCKETS; i++) {
+		seen += h->buckets[i];
+		if (seen >= target) {
+			v = latency_bucket_value(i);
+			return (v < h->max ? v : h->max);
+		}
+	}
+	return (h->max);
+}
+
+struct latency_stats *
+latency_stats_create(int nslow)
+{
+	struct latency_stats *l;
+
+	l = calloc(1, sizeof(*l));
+	if (l == NULL) {
+		warn("%s: calloc", __func__);
+		return (NULL);
+	}
+	if (nslow > 0) {
+		l->slow.e = calloc(nslow, sizeof(struct latency_slow_entry));
+		if (l->slow.e == NULL) {
+			warn("%s: calloc", __func__);
+			free(l);
+			return (NULL);
+		}
+	}
+	l->slow.size = nslow;
+	return (l);
+}
+
+void
+latency_stats_free(struct latency_stats *l)
+{
+	int i;
+
+	for (i = 0; i < l->slow.n; i++)
+		free(l->slow.e[i].path);
+	free(l->slow.e);
+	free(l);
+}
+
+static void
+latency_slow_swap(struct latency_slow *s, int i, int j)
+{
+	struct latency_slow_entry t;
+
+	t = s->e[i];
+	s->e[i] = s->e[j];
+	s->e[j] = t;
+}
+
+static void
+latency_slow_sift_down(struct latency_slow *s, int i)
+{
+	int l, r, m;
+
+	while (1) {
+		l = 2 * i + 1;
+		r = l + 1;
+		m = i;
+		if ((l < s->n) && (s->e[l].ns < s->e[m].ns))
+			m = l;
+		if ((r < s->n) && (s->e[r].ns < s->e[m].ns))
+			m = r;
+		if (m == i)
+			break;
+		latency_slow_swap(s, i, m);
+		i = m;
+	}
+}
+
+/*
+ * Offer a member to the slowest-N list.  Only the path of members
+ * that make it in is copied.
+ */
+static void
+latency_slow_add(struct latency_slow *s, const char *path, uint64_t ns)
+{
+	char *p;
+	int i;
+
+	if (s->size == 0)
+		return;
+	if ((s->n == s->size) && (ns <= s->e[0].ns))
+		return;
+
+	p = strdup(path);
+	if (p == NULL)
+		return;
+
+	if (s->n < s->size) {
+		/* Sift up */
+		i = s->n++;
+		s->e[i].ns = ns;
+		s->e[i].path = p;
+		while ((i > 0) && (s->e[(i - 1) / 2].ns > s->e[i].ns)) {
+			latency_slow_swap(s, i, (i - 1) / 2);
+			i = (i - 1) / 2;
+		}
+	} else {
+		/* Replace the fastest of the slow entries */
+		free(s->e[0].path);
+		s->e[0].ns = ns;
+		s->e[0].path = p;
+		latency_slow_sift_down(s, 0);
+	}
+}
+
+void
+latency_stats_add(struct latency_stats *l, const char *path,
+    uint64_t open_ns, uint64_t data_ns, uint64_t close_ns)
+{
+	uint64_t total = open_ns + data_ns + close_ns;
+
+	latency_hist_add(&l->open, open_ns);
+	latency_hist_add(&l->data, data_ns);
+	latency_hist_add(&l->close, close_ns);
+	latency_hist_add(&l->total, total);
+	latency_slow_add(&l->slow, path, total);
+}
+
+static int
+latency_slow_cmp(const void *a, const void *b)
+{
+	const struct latency_slow_entry *ea = a, *eb = b;
+
+	if (ea->ns == eb->ns)
+		return (0);
+	return (ea->ns > eb->ns ? -1 : 1);
+}
+
+static void
+latency_hist_print(const char *name, const struct latency_hist *h, FILE *fp)
+{
+
+	fprintf(fp, "%-6s n=%llu p50=%.1fus p99=%.1fus max=%.1fus\n", name,
+	    (unsigned long long) h->count,
+	    latency_hist_percentile(h, 50.0) / 1000.0,
+	    latency_hist_percentile(h, 99.0) / 1000.0,
+	    h->max / 1000.0);
+}
+
+void
+latency_stats_print(struct latency_stats *l, FILE *fp)
+{
+	int i;
+
+	latency_hist_print("open", &l->open, fp);
+	latency_hist_print("data", &l->data, fp);
+	latency_hist_print("close", &l->close, fp);
+	latency_hist_print("total", &l->total, fp);
+
+	/* This destroys the heap ordering; it's only done at the end */
+	qsort(l->slow.e, l->slow.n, sizeof(struct latency_slow_entry),
+	    latency_slow_cmp);
+	if (l->slow.n > 0)
+		fprintf(fp, "slowest:\n");
+	for (i = 0; i < l->slow.n; i++) {
+		fprintf(fp, "  %10.1fus %s\n", l->slow.e[i].ns / 1000.0,
+		    l->slow.e[i].path);
+	}
+}
@@ -0,0 +1,67 @@
+#ifndef	__LATENCY_H__
+#define	__LATENCY_H__
+
+/*
+ * A log-bucketed latency histogram, in the style of HdrHistogram.
+ *
+ * Each power of two range of nanoseconds is split into
+ * LATENCY_SUB_BUCKETS linear buckets, so any recorded value is
+ * reported to within 1/LATENCY_SUB_BUCKETS of its real value while
+ * the whole 64 bit range fits in a fixed size table.
+ */
+#define	LATENCY_SUB_BITS	4
+#define	LATENCY_SUB_BUCKETS	(1 << LATENCY_SUB_BITS)
+#define	LATENCY_NBUCKETS	((64 - LATENCY_SUB_BITS + 1) * LATENCY_SUB_BUCKETS)
+
+struct latency_hist {
+	uint64_t count;
+	uint64_t max;
+	uint64_t buckets[LATENCY_NBUCKETS];
+};
+
+/*
+ * The N slowest entries seen, kept as a min-heap on ns.
+ */
+struct latency_slow_entry {
+	uint64_t ns;
+	char *path;
+};
+
+struct latency_slow {
+	int n, size;
+	struct latency_slow_entry *e;
+};
+
+/*
+ * Per-member timings, split into the open/create, data transfer
+ * and close/metadata phases, plus the total.
+ */
+struct latency_stats {
+	struct latency_hist open;
+	struct latency_hist data;
+	struct latency_hist close;
+	struct latency_hist total;
+	struct latency_slow slow;
+};
+
+extern	void latency_hist_add(struct latency_hist *, uint64_t);
+extern	uint64_t latency_hist_percentile(const struct latency_hist *, double);
+
+/*
+ * Create latency stats tracking the nslow slowest members.
+ */
+extern	struct latency_stats * latency_stats_create(int nslow);
+extern	void latency_stats_free(struct latency_stats *);
+
+/*
+ * Record one member's phase timings.
+ */
+extern	void latency_stats_add(struct latency_stats *, const char *,
+	    uint64_t, uint64_t, uint64_t);
+
+/*
+ * Print p50/p99/max for each phase and the slowest members.
+ */
+extern	void latency_stats_print(struct latency_stats *, FILE *);
+
+#endif	/* __LATENCY_H__ */
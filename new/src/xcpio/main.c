@@ -8,50 +8,187 @@
 #include <err.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <getopt.h>
+#include <pthread.h>
 
+#include <sys/param.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
 
 #include "file_list.h"
 #include "cpio_format.h"
 #include "cpio_archive.h"
+#include "catalog.h"
 
-static void
-char_trim_crlf(char *s)
+#ifndef	__unused
+#define	__unused	__attribute__((__unused__))
+#endif
+
+/*
+ * Count allocations so --stats can show how many were made while
+ * creating or extracting.  This needs the allocator wrapped at link
+ * time (-Wl,--wrap); otherwise the count is reported as unknown.
+ */
+#ifdef	XCPIO_WRAP_ALLOC
+static int64_t xcpio_allocs;
+
+extern	void * __real_malloc(size_t);
+extern	void * __real_calloc(size_t, size_t);
+extern	void * __real_realloc(void *, size_t);
+extern	char * __real_strdup(const char *);
+extern	char * __real_strndup(const char *, size_t);
+
+void *
+__wrap_malloc(size_t size)
+{
+
+	xcpio_allocs++;
+	return (__real_malloc(size));
+}
+
+void *
+__wrap_calloc(size_t n, size_t size)
+{
+
+	xcpio_allocs++;
+	return (__real_calloc(n, size));
+}
+
+void *
+__wrap_realloc(void *p, size_t size)
 {
-	int l;
 
-	l = strlen(s);
-	if (l == 0) {
-		return;
+	xcpio_allocs++;
+	return (__real_realloc(p, size));
+}
+
+char *
+__wrap_strdup(const char *s)
+{
+
+	xcpio_allocs++;
+	return (__real_strdup(s));
+}
+
+char *
+__wrap_strndup(const char *s, size_t n)
+{
+
+	xcpio_allocs++;
+	return (__real_strndup(s, n));
+}
+#define	XCPIO_ALLOCS()	(xcpio_allocs)
+#else
+#define	XCPIO_ALLOCS()	((int64_t) -1)
+#endif
+
+/* With a memory budget stdout is given a buffer up front too */
+static char xcpio_stdout_buf[BUFSIZ];
+
+/*
+ * Options from the command line.
+ */
+struct xcpio_opts {
+	char *manifest_file;
+	char *archive_file;
+	char *base_directory;
+	int block_size;
+	bool do_append;
+	bool do_walk;
+	bool do_plan;
+	bool do_checksum;
+	bool do_stats;
+	bool stats_json;
+	int latency_nslow;	/* -1 if latency tracking is off */
+	cpio_archive_order order;
+	size_t mem_budget;	/* 0 if there's no budget */
+	int manifest_delim;	/* '\n', or '\0' with -0 */
+	int stat_threads;
+	bool verbose;
+	cpio_archive_skip skip;
+	int durable;		/* files per checkpoint; 0 if off */
+	const char *journal_file;
+	bool resume;
+	const char *repack_file;
+	int repack_block_size;	/* 0 for the same as block_size */
+	char **outputs;		/* any more -f archives to create */
+	int noutputs;
+	char **inputs;		/* -f and any more archives to merge */
+	int ninputs;
+	struct cpio_archive_filter filter;
+	int shards;		/* 0 for a single archive */
+	const char *catalog_build;
+	const char *catalog_lookup;
+};
+
+/* Open files left over for other things with --durable, per archive */
+#define	XCPIO_DURABLE_FD_SPARE	32
+
+/* Keeps the reports of shards being read in parallel apart */
+static pthread_mutex_t xcpio_print_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * List the archive's members, one per line.  The iterator skips each
+ * payload (seeking over it where it can) on the way to the next.
+ */
+static int
+cpio_archive_list(struct cpio_archive *a, FILE *fp)
+{
+	const struct cpio_header *c;
+	int rr;
+
+	while ((rr = cpio_archive_next_entry(a, &c)) > 0) {
+		if (strcmp(c->filename, XCPIO_CSUM_MEMBER) != 0)
+			fprintf(fp, "%s\n", c->filename);
 	}
-	l--;
-	do {
-		if (s[l] == '\r' || s[l] == '\n') {
-			s[l] = '\0';
-			l--;
-		} else {
-			break;
-		}
-	} while (l > 0);
+	return (rr < 0 ? -1 : 0);
 }
+
+/*
+ * Read an archive; extracting it, listing it or (with checksums
+ * enabled and do_extract false) verifying it.  Listing goes through
+ * the entry iterator; the rest is done by cpio_archive_begin_read().
+ */
 static int
-cpio_archive_extract(const char *base_directory, const char *archive_file,
-    bool do_extract, int block_size)
+cpio_archive_extract(const struct xcpio_opts *o, const char *file,
+    bool do_extract)
 {
 	struct cpio_archive *a = NULL;
+	FILE *out = stdout;
+	char *listing = NULL;
+	size_t listing_len = 0;
+	int64_t allocs;
 	int r;
 
 	/* XXX TODO: any error handling! */
-	a = cpio_archive_create(archive_file, CPIO_ARCHIVE_MODE_READ);
+	a = cpio_archive_create(file, CPIO_ARCHIVE_MODE_READ);
 	if (a == NULL) {
 		goto error;
 	}
-	cpio_archive_set_blocksize(a, block_size);
+	cpio_archive_set_blocksize(a, o->block_size);
+	cpio_archive_set_checksum(a, o->do_checksum);
+	cpio_archive_set_skip_unchanged(a, o->skip);
+	if (do_extract && (cpio_archive_set_durable(a, o->durable) != 0)) {
+		goto error;
+	}
+	if ((o->journal_file != NULL) &&
+	    (cpio_archive_set_journal(a, o->journal_file, o->resume) != 0)) {
+		goto error;
+	}
+	if ((o->latency_nslow >= 0) &&
+	    (cpio_archive_set_latency(a, o->latency_nslow) != 0)) {
+		goto error;
+	}
+	if ((o->mem_budget > 0) &&
+	    (cpio_archive_set_memory_budget(a, o->mem_budget) != 0)) {
+		goto error;
+	}
 
-	if (base_directory == NULL) {
+	if (o->base_directory == NULL) {
 		r = cpio_archive_set_base_directory(a, ".");
 	} else {
-		r = cpio_archive_set_base_directory(a, base_directory);
+		r = cpio_archive_set_base_directory(a, o->base_directory);
 	}
 	if (r != 0) {
 		fprintf(stderr, "ERROR: couldn't set base directory\n");
@@ -62,141 +199,836 @@ cpio_archive_extract(const char *base_directory, const char *archive_file,
 		fprintf(stderr, "ERROR: failed to open archive\n");
 		goto error;
 	}
-	cpio_archive_begin_read(a, do_extract);
+
+	/*
+	 * Shards are read in parallel, so each one's listing is kept
+	 * until it can be printed whole under its heading.
+	 */
+	if ((o->shards > 0) && ! do_extract && ! o->do_checksum) {
+		out = open_memstream(&listing, &listing_len);
+		if (out == NULL) {
+			warn("%s: open_memstream", __func__);
+			goto error;
+		}
+	}
+	allocs = XCPIO_ALLOCS();
+	if (! do_extract && ! o->do_checksum) {
+		r = cpio_archive_list(a, out);
+	} else {
+		r = cpio_archive_begin_read(a, do_extract);
+	}
+	if (allocs >= 0)
+		a->stats.allocs = XCPIO_ALLOCS() - allocs;
+	if ((out != stdout) && (fclose(out) != 0)) {
+		warn("%s: fclose", __func__);
+		r = -1;
+	}
+	pthread_mutex_lock(&xcpio_print_lock);
+	if (o->shards > 0) {
+		printf("%s:\n", file);
+	}
+	if (listing != NULL) {
+		fwrite(listing, 1, listing_len, stdout);
+		free(listing);
+	}
+	if (o->do_checksum) {
+		printf("verified %llu members; %llu mismatched\n",
+		    (unsigned long long) a->csum.checked,
+		    (unsigned long long) a->csum.mismatched);
+	}
+	if (o->do_stats) {
+		cpio_archive_print_stats(a, stderr, o->stats_json);
+	}
+	cpio_archive_print_latency(a, stderr);
+	fflush(stdout);
+	pthread_mutex_unlock(&xcpio_print_lock);
 	cpio_archive_close(a);
 	cpio_archive_free(a);
-	return (0);
+	return (r);
 error:
 	if (a != NULL)
 		cpio_archive_free(a);
 	return (-1);
 }
 
+/*
+ * Add one manifest record.  Newline separated manifests may have
+ * DOS line endings; blank records are skipped.
+ */
 static int
-cpio_archive_output_create(const char *base_directory, const char *manifest,
-    const char *outfile, int block_size)
+cpio_archive_add_record(struct cpio_archive *a, const struct xcpio_opts *o,
+    const char *p, size_t len)
 {
-	struct cpio_archive *a = NULL;
-	FILE *fp = NULL;
-	int r;
 
-	a = cpio_archive_create(outfile, CPIO_ARCHIVE_MODE_WRITE);
-	if (a == NULL) {
-		fprintf(stderr, "ERROR: couldn't create archive for output\n");
+	if (o->manifest_delim == '\n') {
+		while ((len > 0) && (p[len - 1] == '\r'))
+			len--;
+	}
+	if (len == 0) {
+		return (0);
+	}
+	if (o->verbose) {
+		fprintf(stderr, "adding: '%.*s'\n", (int) len, p);
+	}
+	if (cpio_archive_write_add_manifest_len(a, p, len) != 0) {
+		fprintf(stderr, "ERROR: couldn't add file '%.*s' to archive\n",
+		    (int) len, p);
 		return (-1);
 	}
-	cpio_archive_set_blocksize(a, block_size);
+	return (0);
+}
+
+/*
+ * Load the manifest file into the archive's file list.
+ *
+ * Records are separated by newlines, or NULs with -0 (as from
+ * find -print0.)  The manifest is mapped and split in place where
+ * possible; pipes and the like are read with getdelim() instead.
+ */
+static int
+cpio_archive_load_manifest(struct cpio_archive *a, const struct xcpio_opts *o)
+{
+	const char *manifest = o->manifest_file;
+	struct stat sb;
+	const char *buf, *p, *end, *e;
+	char *line = NULL;
+	size_t line_size = 0;
+	ssize_t len;
+	FILE *fp;
+	int fd, r = 0;
+
+	fd = open(manifest, O_RDONLY);
+	if (fd < 0) {
+		warn("%s: open('%s')", __func__, manifest);
+		return (-1);
+	}
+	if ((fstat(fd, &sb) == 0) && S_ISREG(sb.st_mode) && (sb.st_size > 0)) {
+		buf = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (buf != MAP_FAILED) {
+			close(fd);
+			(void) madvise((void *) buf, sb.st_size,
+			    MADV_SEQUENTIAL);
+			end = buf + sb.st_size;
+			for (p = buf; (p < end) && (r == 0); p = e + 1) {
+				e = memchr(p, o->manifest_delim, end - p);
+				if (e == NULL)
+					e = end;
+				r = cpio_archive_add_record(a, o, p, e - p);
+			}
+			munmap((void *) buf, sb.st_size);
+			return (r);
+		}
+	}
 
-	fp = fopen(manifest, "r");
+	/* Not mappable; stream it */
+	fp = fdopen(fd, "r");
 	if (fp == NULL) {
-		warn("%s: fopen('%s')", __func__, manifest);
-		cpio_archive_free(a);
+		warn("%s: fdopen('%s')", __func__, manifest);
+		close(fd);
 		return (-1);
 	}
+	while ((r == 0) &&
+	    ((len = getdelim(&line, &line_size, o->manifest_delim, fp)) > 0)) {
+		if (line[len - 1] == o->manifest_delim)
+			len--;
+		r = cpio_archive_add_record(a, o, line, len);
+	}
+	free(line);
+	fclose(fp);
+	return (r);
+}
 
-	while (!feof(fp)) {
-		char filename[PATH_MAX];
-		char *p;
+/*
+ * Whether any of the create targets is (or will be created as) a
+ * regular file, so is worth sizing and preallocating.  Pipes and
+ * devices aren't.
+ */
+static bool
+xcpio_regular_target(const struct xcpio_opts *o)
+{
+	struct stat sb;
+	const char *name;
+	int i;
 
-		p = fgets(filename, PATH_MAX - 1, fp);
-		/* Handle EOF here too */
-		if (p == NULL) {
-			break;
+	for (i = -1; i < o->noutputs; i++) {
+		name = (i < 0) ? o->archive_file : o->outputs[i];
+		if ((name == NULL) || (strcmp(name, "-") == 0)) {
+			continue;
 		}
+		if ((stat(name, &sb) != 0) || S_ISREG(sb.st_mode)) {
+			return (true);
+		}
+	}
+	return (false);
+}
+
+static void
+cpio_archive_print_plan(const struct cpio_archive_plan *p)
+{
 
-		/* Trim trailing \r\n */
-		char_trim_crlf(p);
+	printf("entries: %llu\n", (unsigned long long) p->entries);
+	printf("errors: %llu\n", (unsigned long long) p->errors);
+	printf("payload_bytes: %llu\n", (unsigned long long) p->payload_bytes);
+	printf("existing_bytes: %llu\n",
+	    (unsigned long long) p->existing_bytes);
+	printf("archive_bytes: %llu\n", (unsigned long long) p->archive_bytes);
+	printf("max_header_bytes: %llu\n",
+	    (unsigned long long) p->max_header_bytes);
+	printf("peak_buffer_bytes: %llu\n",
+	    (unsigned long long) p->peak_buffer_bytes);
+}
 
-		fprintf(stderr, "adding: '%s'\n", p);
+/*
+ * --durable=N keeps up to N extracted files open per archive until
+ * they're checkpointed, so make sure that fits in the open file limit
+ * with some to spare for the archive, directories and the like.
+ */
+static bool
+xcpio_durable_fits(const struct xcpio_opts *o)
+{
+	struct rlimit rl;
+	uint64_t need, avail;
+	int n = MAX(o->shards, 1);
 
-		if (cpio_archive_write_add_manifest(a, p) != 0) {
-			fprintf(stderr,
-			    "ERROR: couldn't add file '%s' to archive\n",
-			    filename);
-			continue;
+	if (getrlimit(RLIMIT_NOFILE, &rl) != 0) {
+		warn("%s: getrlimit", __func__);
+		return (false);
+	}
+	need = (uint64_t) o->durable * n;
+	avail = (uint64_t) rl.rlim_cur;
+	if ((rl.rlim_cur == RLIM_INFINITY) ||
+	    (need + XCPIO_DURABLE_FD_SPARE * n <= avail)) {
+		return (true);
+	}
+	fprintf(stderr, "ERROR: --durable=%d needs %llu open files but the "
+	    "limit is %llu; use a smaller N\n", o->durable,
+	    (unsigned long long) (need + XCPIO_DURABLE_FD_SPARE * n),
+	    (unsigned long long) avail);
+	return (false);
+}
+
+/*
+ * A shard being read by cpio_archive_extract_shards().
+ */
+struct xcpio_shard {
+	const struct xcpio_opts *o;
+	char *file;
+	bool do_extract;
+	int r;
+	pthread_t thr;
+};
+
+static void *
+xcpio_shard_read(void *arg)
+{
+	struct xcpio_shard *s = arg;
+
+	s->r = cpio_archive_extract(s->o, s->file, s->do_extract);
+	return (NULL);
+}
+
+/*
+ * Read "<archive>.0" .. "<archive>.<shards - 1>" in parallel, one
+ * thread each.
+ */
+static int
+cpio_archive_extract_shards(const struct xcpio_opts *o, bool do_extract)
+{
+	struct xcpio_shard *s;
+	int i, nstarted, r = 0;
+
+	s = calloc(o->shards, sizeof(*s));
+	if (s == NULL) {
+		warn("%s: calloc", __func__);
+		return (-1);
+	}
+	for (i = 0; i < o->shards; i++) {
+		s[i].o = o;
+		s[i].do_extract = do_extract;
+		if (asprintf(&s[i].file, "%s.%d", o->archive_file, i) < 0) {
+			s[i].file = NULL;
+			r = -1;
+			goto done;
+		}
+	}
+	for (nstarted = 0; nstarted < o->shards; nstarted++) {
+		if (pthread_create(&s[nstarted].thr, NULL, xcpio_shard_read,
+		    &s[nstarted]) != 0) {
+			warnx("%s: pthread_create", __func__);
+			r = -1;
+			break;
 		}
 	}
+	for (i = 0; i < nstarted; i++) {
+		pthread_join(s[i].thr, NULL);
+		if (s[i].r != 0)
+			r = -1;
+	}
+
+done:
+	for (i = 0; i < o->shards; i++)
+		free(s[i].file);
+	free(s);
+	return (r);
+}
+
+/*
+ * Create an archive.  If no manifest was given then the base directory
+ * is walked instead.
+ *
+ * When writing to a regular file, a sizing pass is done first so the
+ * output can be preallocated and so we fail before writing anything
+ * if it won't fit.
+ */
+static int
+cpio_archive_output_create(const struct xcpio_opts *o)
+{
+	struct cpio_archive *a = NULL;
+	struct cpio_archive_plan plan;
+	bool have_plan = false;
+	int64_t allocs;
+	int i, r;
+
+	a = cpio_archive_create(o->archive_file != NULL ? o->archive_file : "-",
+	    o->do_append ? CPIO_ARCHIVE_MODE_APPEND : CPIO_ARCHIVE_MODE_WRITE);
+	if (a == NULL) {
+		fprintf(stderr, "ERROR: couldn't create archive for output\n");
+		return (-1);
+	}
+	cpio_archive_set_blocksize(a, o->block_size);
+	cpio_archive_set_order(a, o->order);
+	for (i = 0; i < o->noutputs; i++) {
+		if (cpio_archive_add_output(a, o->outputs[i]) != 0)
+			goto error;
+	}
+	cpio_archive_set_checksum(a, o->do_checksum);
+	if ((o->latency_nslow >= 0) &&
+	    (cpio_archive_set_latency(a, o->latency_nslow) != 0)) {
+		goto error;
+	}
+	if ((o->mem_budget > 0) &&
+	    (cpio_archive_set_memory_budget(a, o->mem_budget) != 0)) {
+		goto error;
+	}
+	if ((o->journal_file != NULL) &&
+	    (cpio_archive_set_journal(a, o->journal_file, o->resume) != 0)) {
+		goto error;
+	}
+
+	if ((o->manifest_file != NULL) &&
+	    (cpio_archive_load_manifest(a, o) != 0)) {
+		goto error;
+	}
 
-	if (base_directory == NULL) {
+	if (o->base_directory == NULL) {
 		r = cpio_archive_set_base_directory(a, ".");
 	} else {
-		r = cpio_archive_set_base_directory(a, base_directory);
+		r = cpio_archive_set_base_directory(a, o->base_directory);
 	}
 	if (r != 0) {
 		fprintf(stderr, "ERROR: couldn't set base directory\n");
 		goto error;
 	}
 
+	/*
+	 * Stat the manifest entries in parallel now rather than one at
+	 * a time in each pass.  The stat cache grows with the manifest,
+	 * so not with a memory budget.
+	 */
+	if ((o->manifest_file != NULL) && (o->mem_budget == 0) &&
+	    (cpio_archive_stat_files(a, o->stat_threads) != 0)) {
+		goto error;
+	}
+
+	if (o->do_plan || xcpio_regular_target(o)) {
+		if (cpio_archive_plan(a, o->do_walk, &plan) != 0) {
+			fprintf(stderr, "ERROR: couldn't size the archive\n");
+			goto error;
+		}
+		have_plan = true;
+	}
+	if (o->do_plan) {
+		cpio_archive_print_plan(&plan);
+		(void) cpio_archive_free(a);
+		return (0);
+	}
+
+	/* The shards are opened and written by the library */
+	if (o->shards > 0) {
+		r = cpio_archive_write_shards(a, o->shards);
+		if (r != 0) {
+			fprintf(stderr, "ERROR: failed to write the shards\n");
+		}
+		if (o->do_stats) {
+			cpio_archive_print_stats(a, stderr, o->stats_json);
+		}
+		(void) cpio_archive_free(a);
+		return (r);
+	}
+
 	/* XXX TODO: handle errors here; clean up */
 	if (cpio_archive_open(a) < 0) {
 		fprintf(stderr, "ERROR: failed to open archive\n");
 		goto error;
 	}
-	/* Files are added to the manifest list, create things */
-	(void) cpio_archive_write_files(a);
-	(void) cpio_archive_close(a);
+	if (have_plan && (cpio_archive_reserve(a, &plan) != 0)) {
+		fprintf(stderr, "ERROR: archive won't fit; not writing it\n");
+		goto error;
+	}
+	allocs = XCPIO_ALLOCS();
+	r = 0;
+	if (o->manifest_file != NULL) {
+		/*
+		 * Files are added to the manifest list, create things.
+		 * If that fails partway then don't finish the archive;
+		 * a journal is left to resume from.
+		 */
+		if (cpio_archive_write_files(a) != 0) {
+			fprintf(stderr, "ERROR: failed to write the archive\n");
+			goto error;
+		}
+	} else if (cpio_archive_write_tree(a) != 0) {
+		/* Files that fail are only warned about; this is the walk */
+		fprintf(stderr, "ERROR: failed to walk the base directory\n");
+		r = -1;
+	}
+	if (cpio_archive_close(a) != 0) {
+		fprintf(stderr, "ERROR: failed to finish writing the archive\n");
+		r = -1;
+	}
+	if (allocs >= 0)
+		a->stats.allocs = XCPIO_ALLOCS() - allocs;
+	if (o->do_stats) {
+		cpio_archive_print_stats(a, stderr, o->stats_json);
+	}
+	cpio_archive_print_latency(a, stderr);
 	(void) cpio_archive_free(a);
-	fclose(fp);
-	return (0);
+	return (r);
 error:
 	if (a != NULL)
 		cpio_archive_free(a);
-	if (fp != NULL)
-		fclose(fp);
 	return (-1);
 }
 
+/*
+ * Copy the archive(s) into a new one, without going through the
+ * filesystem.  A single unfiltered archive is repacked as is (which
+ * may just change the block size); otherwise the members that pass
+ * the filter are merged, in order, into the one output archive.
+ *
+ * The output is written to a temporary file next to it and renamed
+ * into place once complete, so it can replace one of the inputs and
+ * a failed repack leaves nothing half written.
+ */
+static int
+cpio_archive_output_repack(const struct xcpio_opts *o)
+{
+	struct cpio_archive *in = NULL, *out;
+	char *tmp = NULL;
+	bool merge;
+	int i, fd, r = -1;
+
+	merge = (o->ninputs > 1) || (o->filter.ninclude > 0) ||
+	    (o->filter.nexclude > 0) || o->do_checksum;
+
+	if ((strcmp(o->repack_file, "-") != 0) &&
+	    (asprintf(&tmp, "%s.tmp.%ld", o->repack_file,
+	    (long) getpid()) < 0)) {
+		warn("%s: asprintf", __func__);
+		return (-1);
+	}
+	out = cpio_archive_create(tmp != NULL ? tmp : o->repack_file,
+	    CPIO_ARCHIVE_MODE_WRITE);
+	if (out == NULL) {
+		free(tmp);
+		return (-1);
+	}
+	cpio_archive_set_blocksize(out, o->repack_block_size);
+	cpio_archive_set_checksum(out, o->do_checksum);
+	if (cpio_archive_open(out) < 0) {
+		fprintf(stderr, "ERROR: failed to open archive\n");
+		goto done;
+	}
+
+	for (i = 0; i < o->ninputs; i++) {
+		in = cpio_archive_create(o->inputs[i], CPIO_ARCHIVE_MODE_READ);
+		if (in == NULL) {
+			goto done;
+		}
+		cpio_archive_set_blocksize(in, o->block_size);
+		if (cpio_archive_open(in) < 0) {
+			fprintf(stderr, "ERROR: failed to open archive\n");
+			goto done;
+		}
+		if (merge) {
+			r = cpio_archive_merge(out, in, &o->filter);
+		} else {
+			r = cpio_archive_repack(in, out);
+		}
+		if (r != 0) {
+			/* Don't make it look complete */
+			fprintf(stderr, "ERROR: failed to copy '%s'\n",
+			    o->inputs[i]);
+			goto done;
+		}
+		if (o->do_stats) {
+			cpio_archive_print_stats(in, stderr, o->stats_json);
+		}
+		cpio_archive_free(in);
+		in = NULL;
+	}
+	r = -1;
+	if (cpio_archive_close(out) != 0) {
+		fprintf(stderr, "ERROR: failed to finish writing the archive\n");
+		goto done;
+	}
+	if (tmp != NULL) {
+		/* Make sure it's on disk before it replaces anything */
+		fd = open(tmp, O_RDONLY);
+		if ((fd < 0) || (fsync(fd) != 0)) {
+			warn("%s: fsync (%s)", __func__, tmp);
+			if (fd > -1)
+				close(fd);
+			goto done;
+		}
+		close(fd);
+		if (rename(tmp, o->repack_file) != 0) {
+			warn("%s: rename (%s)", __func__, o->repack_file);
+			goto done;
+		}
+		free(tmp);
+		tmp = NULL;
+	}
+	if (o->do_stats) {
+		cpio_archive_print_stats(out, stderr, o->stats_json);
+	}
+	r = 0;
+
+done:
+	if (in != NULL)
+		cpio_archive_free(in);
+	cpio_archive_free(out);
+	if (tmp != NULL) {
+		(void) unlink(tmp);
+		free(tmp);
+	}
+	return (r);
+}
+
+/*
+ * Build a catalog of the given archives.
+ */
+static int
+xcpio_catalog_build(const struct xcpio_opts *o, int argc, char *argv[])
+{
+	struct catalog_builder *b;
+	int i, r = -1;
+
+	b = catalog_builder_create();
+	if (b == NULL) {
+		return (-1);
+	}
+	for (i = 0; i < argc; i++) {
+		if (catalog_builder_add_archive(b, argv[i], o->block_size) != 0)
+			goto done;
+	}
+	r = catalog_builder_write(b, o->catalog_build);
+	if (r == 0) {
+		printf("catalogued %llu members of %d archives\n",
+		    (unsigned long long) b->nentries, b->narchives);
+	}
+done:
+	catalog_builder_free(b);
+	return (r);
+}
+
+static void
+xcpio_catalog_print(void *arg __unused, const char *name,
+    const struct catalog_match *m)
+{
+
+	printf("%s\t%s\t%llu\t%llu\n", name, m->archive,
+	    (unsigned long long) m->offset, (unsigned long long) m->size);
+}
+
+/*
+ * Print "<path> <archive> <header offset> <size>" for each archive
+ * holding each path.  Returns 1 if any path wasn't found.
+ */
+static int
+xcpio_catalog_lookup(const struct xcpio_opts *o, int argc, char *argv[])
+{
+	struct catalog *cat;
+	int64_t n;
+	int i, r = 0;
+
+	cat = catalog_open(o->catalog_lookup);
+	if (cat == NULL) {
+		return (-1);
+	}
+	for (i = 0; i < argc; i++) {
+		n = catalog_lookup(cat, argv[i], xcpio_catalog_print, NULL);
+		if (n < 0) {
+			r = -1;
+			break;
+		}
+		if (n == 0) {
+			fprintf(stderr, "%s: not found\n", argv[i]);
+			r = 1;
+		}
+	}
+	catalog_close(cat);
+	return (r);
+}
+
+static int
+xcpio_list_add(char ***list, int *n, const char *pattern)
+{
+	char **l;
+
+	l = realloc(*list, (*n + 1) * sizeof(char *));
+	if (l == NULL) {
+		warn("%s: realloc", __func__);
+		return (-1);
+	}
+	l[(*n)++] = (char *) pattern;
+	*list = l;
+	return (0);
+}
+
 static void
 usage(void)
 {
-	printf("Usage: xcpio [-b <blocksize>] [-c] [-e] [-f <archive>] [-m <manifest>] [-d <directory>]\n");
+	printf("Usage: xcpio [-b <blocksize>] [-c] [-A] [-K] [-M <bytes>] [-n] [-e] [-t] [-f <archive>] [-m <manifest> [-0] [-j <threads>] | -R] [-d <directory>] [-v]\n");
+	printf("  -A             : append to an existing archive (with -c)\n");
 	printf("  -b <blocksize> : archive read/write block size in bytes\n");
+	printf("  -B <blocksize> : block size of the --repack output (default -b)\n");
 	printf("  -c             : create an archive\n");
 	printf("  -d <directory> : base directory for creating/extracting archives\n");
 	printf("  -e             : extract from archive\n");
-	printf("  -f <archive>   : filename of the archive\n");
+	printf("  -f <archive>   : filename of the archive ('-' for stdin/stdout);\n");
+	printf("                   with -c, may be repeated to write several\n");
+	printf("                   copies at once\n");
+	printf("  -K             : store per-member CRC32C checksums (with -c);\n");
+	printf("                   -A -K only appends to an archive made\n");
+	printf("                   with -K, and -A without it only to one\n");
+	printf("                   made without\n");
 	printf("  -l             : list files in archive\n");
+	printf("  -j <threads>   : threads used to stat manifest entries\n");
 	printf("  -m <manifest>  : archive manifest to create with\n");
+	printf("  -M <bytes>     : allocate all buffers up front within this\n");
+	printf("                   memory budget (not with -R, -O, -K or --latency)\n");
+	printf("  -n, --plan     : report the size of the archive -c would create\n");
+	printf("  -O <order>     : read-ahead order when creating; manifest\n");
+	printf("                   (default), inode or extent.  Members are\n");
+	printf("                   still written in manifest order\n");
+	printf("  -R             : create from a walk of the base directory\n");
+	printf("  --stats[=json] : print I/O statistics to stderr when done\n");
+	printf("  --latency[=N]  : print per-member latency percentiles and the\n");
+	printf("                   N (default 10) slowest members to stderr\n");
+	printf("                   (not with -l)\n");
+	printf("  --skip-unchanged[=content]\n");
+	printf("                 : when extracting, leave files with the same size\n");
+	printf("                   and mtime alone, or with =content compare the\n");
+	printf("                   contents and only rewrite from the first change\n");
+	printf("  --durable[=N]  : when extracting, write each file to a temporary\n");
+	printf("                   file and rename it into place after flushing\n");
+	printf("                   every N (default 128, at most 65536 and\n");
+	printf("                   within the open file limit) files\n");
+	printf("  --journal=<file> : keep a restart journal while creating (with -m)\n");
+	printf("                   or extracting; it's removed once done\n");
+	printf("  --resume       : carry on from where the journal left off\n");
+	printf("  --repack=<archive> [<archive> ...]\n");
+	printf("                 : copy the -f archive, and any more given, into\n");
+	printf("                   a new one, re-blocked with -B\n");
+	printf("  --include=<pattern>, --exclude=<pattern>\n");
+	printf("                 : only --repack members matching a pattern, or\n");
+	printf("                   not matching; may be repeated\n");
+	printf("  --shards=N     : with -c, split the manifest by size into N\n");
+	printf("                   archives <archive>.0 .. <archive>.N-1 written\n");
+	printf("                   in parallel; with -e, -l or -t read them in\n");
+	printf("                   parallel\n");
+	printf("  --build-catalog=<catalog> <archive> ...\n");
+	printf("                 : record which of the archives hold which paths\n");
+	printf("  --lookup=<catalog> <path> ...\n");
+	printf("                 : print the archive(s), header offset and size\n");
+	printf("                   of each path\n");
+	printf("  -t             : verify archive checksums without extracting\n");
+	printf("  -v             : list files as they're added to the manifest\n");
+	printf("  -0             : manifest entries are NUL separated\n");
 	exit(127);
 }
 
+static struct option longopts[] = {
+	{ "plan",	no_argument,	NULL,	'n' },
+	{ "stats",	optional_argument, NULL, 'S' },
+	{ "latency",	optional_argument, NULL, 'L' },
+	{ "skip-unchanged", optional_argument, NULL, 'U' },
+	{ "durable",	optional_argument, NULL, 'D' },
+	{ "journal",	required_argument, NULL, 'J' },
+	{ "resume",	no_argument,	NULL,	'Y' },
+	{ "repack",	required_argument, NULL, 'P' },
+	{ "include",	required_argument, NULL, 'I' },
+	{ "exclude",	required_argument, NULL, 'X' },
+	{ "shards",	required_argument, NULL, 'H' },
+	{ "build-catalog", required_argument, NULL, 'G' },
+	{ "lookup",	required_argument, NULL, 'W' },
+	{ NULL,		0,		NULL,	0 },
+};
+
 int
 main(int argc, char *argv[])
 {
-	char *manifest_file = NULL;
-	char *archive_file = NULL;
-	char *base_directory = NULL;
+	struct xcpio_opts o;
 	bool is_extract = false;
 	bool is_create = false;
 	bool is_list = false;
-	int block_size = DEFAULT_CPIO_BLOCK_SIZE;
-	int ch;
+	bool is_verify = false;
+	int ch, r = 0;
+
+	bzero(&o, sizeof(o));
+	o.block_size = DEFAULT_CPIO_BLOCK_SIZE;
+	o.order = CPIO_ARCHIVE_ORDER_MANIFEST;
+	o.latency_nslow = -1;
+	o.manifest_delim = '\n';
+	o.stat_threads = MIN(MAX(sysconf(_SC_NPROCESSORS_ONLN), 1), 16);
 
-	while ((ch = getopt(argc, argv, "b:cd:ef:lm:")) != -1) {
+	while ((ch = getopt_long(argc, argv, "0Ab:B:cd:ef:j:Klm:M:nO:Rtv", longopts,
+	    NULL)) != -1) {
 		switch (ch) {
+		case '0':
+			o.manifest_delim = '\0';
+			break;
+		case 'A':
+			o.do_append = true;
+			break;
 		case 'b':
-			block_size = atoi(optarg);
+			o.block_size = atoi(optarg);
 			break;
 		case 'c':
 			is_create = true;
 			break;
 		case 'd':
-			free(base_directory);
-			base_directory = strdup(optarg);
+			free(o.base_directory);
+			o.base_directory = strdup(optarg);
 			break;
 		case 'e':
 			is_extract = true;
 			break;
 		case 'f':
-			free(archive_file);
-			archive_file = strdup(optarg);
+			if (o.archive_file == NULL) {
+				o.archive_file = strdup(optarg);
+			} else if (xcpio_list_add(&o.outputs, &o.noutputs,
+			    optarg) != 0) {
+				exit(1);
+			}
+			break;
+		case 'j':
+			o.stat_threads = atoi(optarg);
+			if (o.stat_threads <= 0)
+				usage();
+			break;
+		case 'K':
+			o.do_checksum = true;
 			break;
 		case 'l':
 			is_list = true;
 			break;
 		case 'm':
-			free(manifest_file);
-			manifest_file = strdup(optarg);
+			free(o.manifest_file);
+			o.manifest_file = strdup(optarg);
+			break;
+		case 'M':
+			o.mem_budget = strtoull(optarg, NULL, 0);
+			if (o.mem_budget == 0)
+				usage();
+			break;
+		case 'n':
+			o.do_plan = true;
+			break;
+		case 'O':
+			if (strcmp(optarg, "manifest") == 0) {
+				o.order = CPIO_ARCHIVE_ORDER_MANIFEST;
+			} else if (strcmp(optarg, "inode") == 0) {
+				o.order = CPIO_ARCHIVE_ORDER_INODE;
+			} else if (strcmp(optarg, "extent") == 0) {
+				o.order = CPIO_ARCHIVE_ORDER_EXTENT;
+			} else {
+				usage();
+			}
+			break;
+		case 'R':
+			o.do_walk = true;
+			break;
+		case 't':
+			is_verify = true;
+			break;
+		case 'v':
+			o.verbose = true;
+			break;
+		case 'L':
+			o.latency_nslow = (optarg == NULL) ? 10 : atoi(optarg);
+			if (o.latency_nslow < 0)
+				usage();
+			break;
+		case 'U':
+			if (optarg == NULL) {
+				o.skip = CPIO_ARCHIVE_SKIP_METADATA;
+			} else if (strcmp(optarg, "content") == 0) {
+				o.skip = CPIO_ARCHIVE_SKIP_CONTENT;
+			} else {
+				usage();
+			}
+			break;
+		case 'D':
+			o.durable = (optarg == NULL) ? 128 : atoi(optarg);
+			if ((o.durable <= 0) || (o.durable > XCPIO_DURABLE_MAX))
+				usage();
+			break;
+		case 'B':
+			o.repack_block_size = atoi(optarg);
+			if (o.repack_block_size <= 0)
+				usage();
+			break;
+		case 'P':
+			o.repack_file = optarg;
+			break;
+		case 'G':
+			o.catalog_build = optarg;
+			break;
+		case 'W':
+			o.catalog_lookup = optarg;
+			break;
+		case 'H':
+			o.shards = atoi(optarg);
+			if (o.shards <= 0)
+				usage();
+			break;
+		case 'I':
+			if (xcpio_list_add(&o.filter.include,
+			    &o.filter.ninclude, optarg) != 0)
+				exit(1);
+			break;
+		case 'X':
+			if (xcpio_list_add(&o.filter.exclude,
+			    &o.filter.nexclude, optarg) != 0)
+				exit(1);
+			break;
+		case 'J':
+			o.journal_file = optarg;
+			break;
+		case 'Y':
+			o.resume = true;
+			break;
+		case 'S':
+			o.do_stats = true;
+			if (optarg == NULL) {
+				o.stats_json = false;
+			} else if (strcmp(optarg, "json") == 0) {
+				o.stats_json = true;
+			} else {
+				usage();
+			}
 			break;
 		default:
 			usage();
@@ -206,40 +1038,182 @@ main(int argc, char *argv[])
 	argc -= optind;
 	argv += optind;
 
+	/* The catalog modes just take archives or paths */
+	if ((o.catalog_build != NULL) || (o.catalog_lookup != NULL)) {
+		if (is_extract || is_create || is_list || is_verify ||
+		    (o.repack_file != NULL) || (argc == 0) ||
+		    ((o.catalog_build != NULL) && (o.catalog_lookup != NULL))) {
+			fprintf(stderr, "ERROR: --build-catalog and --lookup "
+			    "take a list of archives or paths, and nothing "
+			    "else\n");
+			exit(127);
+		}
+		if (o.catalog_build != NULL)
+			r = xcpio_catalog_build(&o, argc, argv);
+		else
+			r = xcpio_catalog_lookup(&o, argc, argv);
+		exit(r == 0 ? 0 : 1);
+	}
+
 	/* Hack! */
 	if (is_list == true)
 		is_extract = true;
 
+	/* Verifying is a checksumming listing */
+	if (is_verify == true) {
+		is_list = true;
+		is_extract = true;
+		o.do_checksum = true;
+	}
+
+	/* A plan is a dry run of a create */
+	if (o.do_plan)
+		is_create = true;
+
 	if (is_extract && is_create) {
 		fprintf(stderr, "ERROR: only one of -c and -e is valid.\n");
 		exit(127);
 	}
+	if (o.do_append && ! is_create) {
+		fprintf(stderr, "ERROR: -A is only valid with -c\n");
+		exit(127);
+	}
+	if ((o.skip != CPIO_ARCHIVE_SKIP_NONE) && ! is_extract) {
+		fprintf(stderr, "ERROR: --skip-unchanged is only valid with -e\n");
+		exit(127);
+	}
+	if ((o.latency_nslow >= 0) && is_list && ! is_verify) {
+		fprintf(stderr, "ERROR: --latency isn't valid with -l\n");
+		exit(127);
+	}
+	if ((o.durable > 0) && (! is_extract || is_list)) {
+		fprintf(stderr, "ERROR: --durable is only valid with -e\n");
+		exit(127);
+	}
+	if ((o.durable > 0) && (xcpio_durable_fits(&o) == false)) {
+		exit(127);
+	}
+	if ((o.durable > 0) && ((o.mem_budget > 0) ||
+	    (o.skip == CPIO_ARCHIVE_SKIP_CONTENT))) {
+		fprintf(stderr, "ERROR: --durable can't be used with -M or "
+		    "--skip-unchanged=content\n");
+		exit(127);
+	}
+	if (o.resume && (o.journal_file == NULL)) {
+		fprintf(stderr, "ERROR: --resume needs --journal\n");
+		exit(127);
+	}
+
+	/*
+	 * A resumed job doesn't have the checksums of what it wrote or
+	 * read before, and a walk has no stable index to resume at.
+	 */
+	if ((o.journal_file != NULL) && (is_list || o.do_walk ||
+	    o.do_append || o.do_plan || o.do_checksum || (o.mem_budget > 0))) {
+		fprintf(stderr, "ERROR: --journal is only valid with -c -m or "
+		    "-e, and not with -A, -K, -M or -n\n");
+		exit(127);
+	}
+	if ((o.shards > 0) && (o.do_walk || o.do_append || o.do_plan ||
+	    (o.noutputs > 0) || (o.journal_file != NULL) ||
+	    (o.mem_budget > 0) || (o.latency_nslow >= 0) ||
+	    (o.archive_file == NULL) || (strcmp(o.archive_file, "-") == 0))) {
+		fprintf(stderr, "ERROR: --shards needs -f <archive> (not '-') "
+		    "and can't be used with -R, -A, -n, several -f, --journal, "
+		    "-M or --latency\n");
+		exit(127);
+	}
+	if ((o.noutputs > 0) && (! is_create || o.do_append ||
+	    (o.journal_file != NULL))) {
+		fprintf(stderr, "ERROR: more than one -f is only valid with -c, "
+		    "and not with -A or --journal\n");
+		exit(127);
+	}
+	if ((o.repack_file != NULL) && (is_extract || is_create ||
+	    (o.mem_budget > 0) || (o.journal_file != NULL))) {
+		fprintf(stderr, "ERROR: --repack can't be used with -c, -e, -l, "
+		    "-t, -M or --journal\n");
+		exit(127);
+	}
+	if ((o.repack_file == NULL) && ((o.repack_block_size != 0) ||
+	    (o.filter.ninclude > 0) || (o.filter.nexclude > 0))) {
+		fprintf(stderr, "ERROR: -B, --include and --exclude are only "
+		    "valid with --repack\n");
+		exit(127);
+	}
+	if (o.repack_file != NULL) {
+		if (o.archive_file == NULL) {
+			fprintf(stderr, "ERROR: need -f <archive> to repack\n");
+			exit(127);
+		}
+		if (o.repack_block_size == 0)
+			o.repack_block_size = o.block_size;
+
+		/* The -f archive, then the rest in the order given */
+		o.ninputs = argc + 1;
+		o.inputs = calloc(o.ninputs, sizeof(char *));
+		if (o.inputs == NULL)
+			err(1, "calloc");
+		o.inputs[0] = o.archive_file;
+		for (ch = 0; ch < argc; ch++)
+			o.inputs[ch + 1] = argv[ch];
+		exit(cpio_archive_output_repack(&o) == 0 ? 0 : 1);
+	}
 	if ((is_extract == false) && (is_create == false)) {
 		fprintf(stderr, "ERROR: need either -c, -l or -e\n");
 		exit(127);
 	}
-	if (archive_file == NULL) {
+	if ((o.archive_file == NULL) && (o.do_plan == false)) {
 		fprintf(stderr, "ERROR: need -f <archive> to define the "
 		    "archive file to operate on\n");
 		exit(127);
 	}
-	if ((is_create == true) && (manifest_file == NULL)) {
-		fprintf(stderr, "ERROR: need a manifest file (-m) to create "
-		    "an archive\n");
+	if ((is_create == true) && (o.manifest_file == NULL) &&
+	    (o.do_walk == false)) {
+		fprintf(stderr, "ERROR: need a manifest file (-m) or -R to "
+		    "create an archive\n");
+		exit(127);
+	}
+	if ((o.manifest_file != NULL) && o.do_walk) {
+		fprintf(stderr, "ERROR: only one of -m and -R is valid.\n");
 		exit(127);
 	}
+	if (o.do_walk && (o.order != CPIO_ARCHIVE_ORDER_MANIFEST)) {
+		fprintf(stderr, "ERROR: -O is only valid with -m\n");
+		exit(127);
+	}
+
+	/*
+	 * These all grow as entries are processed, so there's no fixed
+	 * bound on what they'd need.
+	 */
+	if ((o.mem_budget > 0) && (o.do_walk || o.do_checksum ||
+	    (o.noutputs > 0) ||
+	    (o.order != CPIO_ARCHIVE_ORDER_MANIFEST) ||
+	    (o.latency_nslow >= 0))) {
+		fprintf(stderr, "ERROR: -M can't be used with -R, -O, -K, "
+		    "several -f or --latency\n");
+		exit(127);
+	}
+	if (o.mem_budget > 0) {
+		setvbuf(stdout, xcpio_stdout_buf,
+		    isatty(STDOUT_FILENO) ? _IOLBF : _IOFBF,
+		    sizeof(xcpio_stdout_buf));
+	}
 
 	if (is_extract) {
-		(void) cpio_archive_extract(base_directory, archive_file,
-		    ! is_list, block_size);
+		if (o.shards > 0) {
+			r = cpio_archive_extract_shards(&o, ! is_list);
+		} else {
+			r = cpio_archive_extract(&o, o.archive_file, ! is_list);
+		}
 	} else if (is_create) {
-		(void) cpio_archive_output_create(base_directory,
-		    manifest_file, archive_file, block_size);
+		r = cpio_archive_output_create(&o);
 	} else {
 		fprintf(stderr, "ERROR: invalid internal state; need either "
 		    "create or extract\n");
 		exit(127);
 	}
 
-	exit (0);
+	exit (r == 0 ? 0 : 1);
 }
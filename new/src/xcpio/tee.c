@@ -0,0 +1,211 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <string.h>
+#include <err.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "tee.h"
+
+static uint64_t
+tee_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+}
+
+/*
+ * Write the whole block, retrying short writes.
+ */
+static int
+tee_write_full(int fd, const char *buf, size_t len)
+{
+	ssize_t r;
+
+	while (len > 0) {
+		r = write(fd, buf, len);
+		if (r < 0) {
+			if (errno == EINTR)
+				continue;
+			return (errno);
+		}
+		buf += r;
+		len -= r;
+	}
+	return (0);
+}
+
+static void *
+tee_writer(void *arg)
+{
+	struct tee_output *o = arg;
+	struct tee *t = o->t;
+	size_t slot;
+	int error;
+
+	pthread_mutex_lock(&t->lock);
+	while (1) {
+		while ((o->next == t->head) && ! t->done)
+			pthread_cond_wait(&t->cv_data, &t->lock);
+		if (o->next == t->head)
+			break;
+
+		/*
+		 * The slot can't be reused until every writer is past
+		 * it, so it's safe to write from without the lock.
+		 * After a failure just keep up so the others aren't
+		 * held back.
+		 */
+		slot = o->next % TEE_NSLOTS;
+		if (o->error == 0) {
+			pthread_mutex_unlock(&t->lock);
+			error = tee_write_full(o->fd,
+			    t->ring + slot * t->block_size, t->len[slot]);
+			pthread_mutex_lock(&t->lock);
+			o->error = error;
+		}
+		o->next++;
+		pthread_cond_broadcast(&t->cv_space);
+	}
+	pthread_mutex_unlock(&t->lock);
+	return (NULL);
+}
+
+struct tee *
+tee_create(const int *fds, int nfds, size_t block_size)
+{
+	struct tee *t;
+	int i;
+
+	t = calloc(1, sizeof(*t));
+	if (t == NULL) {
+		warn("%s: calloc", __func__);
+		return (NULL);
+	}
+	t->block_size = block_size;
+	t->ring = malloc(block_size * TEE_NSLOTS);
+	t->out = calloc(nfds, sizeof(*t->out));
+	if ((t->ring == NULL) || (t->out == NULL)) {
+		warn("%s: malloc", __func__);
+		free(t->ring);
+		free(t->out);
+		free(t);
+		return (NULL);
+	}
+	pthread_mutex_init(&t->lock, NULL);
+	pthread_cond_init(&t->cv_data, NULL);
+	pthread_cond_init(&t->cv_space, NULL);
+
+	for (i = 0; i < nfds; i++) {
+		t->out[i].t = t;
+		t->out[i].fd = fds[i];
+		if (pthread_create(&t->out[i].thr, NULL, tee_writer,
+		    &t->out[i]) != 0) {
+			warnx("%s: pthread_create", __func__);
+			tee_free(t);
+			return (NULL);
+		}
+		t->nout++;
+	}
+	return (t);
+}
+
+/*
+ * The block every writer has got past.
+ */
+static uint64_t
+tee_tail(struct tee *t)
+{
+	uint64_t tail = t->head;
+	int i;
+
+	for (i = 0; i < t->nout; i++) {
+		if (t->out[i].next < tail)
+			tail = t->out[i].next;
+	}
+	return (tail);
+}
+
+int
+tee_write(struct tee *t, const char *buf, size_t len)
+{
+	uint64_t start;
+	size_t slot;
+	int i, nfailed = 0;
+
+	if (len > t->block_size) {
+		return (-1);
+	}
+
+	pthread_mutex_lock(&t->lock);
+	if (t->head - tee_tail(t) == TEE_NSLOTS) {
+		start = tee_now_ns();
+		while (t->head - tee_tail(t) == TEE_NSLOTS)
+			pthread_cond_wait(&t->cv_space, &t->lock);
+		t->wait_ns += tee_now_ns() - start;
+	}
+	for (i = 0; i < t->nout; i++) {
+		if (t->out[i].error != 0)
+			nfailed++;
+	}
+	pthread_mutex_unlock(&t->lock);
+	if (nfailed == t->nout) {
+		return (-1);
+	}
+
+	/* Nobody reads this slot until head moves past it */
+	slot = t->head % TEE_NSLOTS;
+	memcpy(t->ring + slot * t->block_size, buf, len);
+	t->len[slot] = len;
+
+	pthread_mutex_lock(&t->lock);
+	t->head++;
+	pthread_cond_broadcast(&t->cv_data);
+	pthread_mutex_unlock(&t->lock);
+	return (0);
+}
+
+int
+tee_finish(struct tee *t)
+{
+	int i, ret = 0;
+
+	if (t->done) {
+		return (0);
+	}
+	pthread_mutex_lock(&t->lock);
+	t->done = true;
+	pthread_cond_broadcast(&t->cv_data);
+	pthread_mutex_unlock(&t->lock);
+
+	for (i = 0; i < t->nout; i++) {
+		pthread_join(t->out[i].thr, NULL);
+		if (t->out[i].error != 0) {
+			errno = t->out[i].error;
+			warn("%s: write (output %d)", __func__, i);
+			ret = -1;
+		}
+	}
+	return (ret);
+}
+
+void
+tee_free(struct tee *t)
+{
+
+	if (t == NULL)
+		return;
+	(void) tee_finish(t);
+	pthread_mutex_destroy(&t->lock);
+	pthread_cond_destroy(&t->cv_data);
+	pthread_cond_destroy(&t->cv_space);
+	free(t->ring);
+	free(t->out);
+	free(t);
+}
@@ -0,0 +1,69 @@
+#ifndef	__TEE_H__
+#define	__TEE_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+/*
+ * Write the same stream of blocks to several descriptors at once.
+ *
+ * Blocks are copied into a ring of TEE_NSLOTS slots and each output
+ * has its own writer thread working through the ring, so the outputs
+ * are written concurrently and the slowest one sets the pace rather
+ * than the sum of them.  The producer only blocks once the slowest
+ * writer is a whole ring behind.
+ */
+
+#define	TEE_NSLOTS	16
+
+struct tee;
+
+struct tee_output {
+	struct tee *t;
+	int fd;
+	uint64_t next;		/* next block to write */
+	int error;		/* errno of a failed write, or 0 */
+	pthread_t thr;
+};
+
+struct tee {
+	pthread_mutex_t lock;
+	pthread_cond_t cv_data;		/* a block was added, or done */
+	pthread_cond_t cv_space;	/* a writer finished a block */
+	uint64_t head;			/* blocks added */
+	bool done;
+	size_t block_size;
+	char *ring;
+	size_t len[TEE_NSLOTS];
+	int nout;
+	struct tee_output *out;
+	uint64_t wait_ns;		/* the producer waiting for space */
+};
+
+/*
+ * Start a writer for each of the nfds descriptors, which the tee
+ * doesn't own.  Blocks are at most block_size bytes.
+ */
+extern	struct tee * tee_create(const int *, int, size_t);
+
+/*
+ * Queue a block for every output.  A failed output is dropped, so the
+ * others are still written in full; this only returns -1 once every
+ * output has failed.  tee_finish() reports the failures.
+ */
+extern	int tee_write(struct tee *, const char *, size_t);
+
+/*
+ * Wait for every output to be written and stop the writers.  Returns
+ * -1 if any of them failed.
+ */
+extern	int tee_finish(struct tee *);
+
+/*
+ * Free the tee, finishing it first if needed.
+ */
+extern	void tee_free(struct tee *);
+
+#endif	/* __TEE_H__ */
@@ -0,0 +1,147 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <err.h>
+#include <fcntl.h>
+#include <dirent.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "file_list.h"
+#include "tree_walk.h"
+
+/*
+ * Join a walk prefix and an entry name.  The root of the walk has
+ * an empty prefix so top level entries don't get a leading "./".
+ */
+static char *
+tree_walk_path(const char *prefix, const char *name)
+{
+	char *p;
+	size_t plen, nlen;
+
+	plen = strlen(prefix);
+	nlen = strlen(name);
+
+	p = malloc(plen + nlen + 2);
+	if (p == NULL) {
+		warn("%s: malloc", __func__);
+		return (NULL);
+	}
+	if (plen > 0) {
+		memcpy(p, prefix, plen);
+		p[plen++] = '/';
+	}
+	memcpy(p + plen, name, nlen + 1);
+	return (p);
+}
+
+/*
+ * Walk a single directory.  This takes ownership of dirfd.
+ *
+ * The directory entries are read in one pass (readdir() batches the
+ * underlying getdents calls), the stream is closed and the names are
+ * sorted before anything is visited.  So only the directory fd, not
+ * a DIR buffer, is held open for each level of the tree.
+ */
+static int
+tree_walk_dir(int dirfd, const char *prefix, tree_walk_cb *cb, void *arg)
+{
+	struct file_list *fl = NULL;
+	struct dirent *de;
+	struct stat sb;
+	DIR *d = NULL;
+	char *path;
+	int i, fd, ret = -1;
+
+	fl = file_list_create();
+	if (fl == NULL) {
+		goto done;
+	}
+
+	fd = dup(dirfd);
+	if (fd < 0) {
+		warn("%s: dup", __func__);
+		goto done;
+	}
+	d = fdopendir(fd);
+	if (d == NULL) {
+		warn("%s: fdopendir (%s)", __func__,
+		    prefix[0] == '\0' ? "." : prefix);
+		close(fd);
+		goto done;
+	}
+
+	while ((de = readdir(d)) != NULL) {
+		if ((strcmp(de->d_name, ".") == 0) ||
+		    (strcmp(de->d_name, "..") == 0)) {
+			continue;
+		}
+		if (file_list_add_entry(fl, de->d_name) != 0) {
+			goto done;
+		}
+	}
+	closedir(d);
+	d = NULL;
+
+	file_list_sort(fl);
+
+	for (i = 0; i < fl->nentries; i++) {
+		if (fstatat(dirfd, fl->file_list[i], &sb,
+		    AT_SYMLINK_NOFOLLOW) != 0) {
+			warn("%s: fstatat (%s/%s)", __func__,
+			    prefix[0] == '\0' ? "." : prefix,
+			    fl->file_list[i]);
+			continue;
+		}
+
+		path = tree_walk_path(prefix, fl->file_list[i]);
+		if (path == NULL) {
+			goto done;
+		}
+
+		if (cb(arg, dirfd, fl->file_list[i], path, &sb) != 0) {
+			free(path);
+			goto done;
+		}
+
+		/* Parent has been visited; now descend into it */
+		if (S_ISDIR(sb.st_mode)) {
+			fd = openat(dirfd, fl->file_list[i],
+			    O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+			if (fd < 0) {
+				warn("%s: openat (%s)", __func__, path);
+			} else if (tree_walk_dir(fd, path, cb, arg) != 0) {
+				free(path);
+				goto done;
+			}
+		}
+		free(path);
+	}
+	ret = 0;
+
+done:
+	if (d != NULL)
+		closedir(d);
+	if (fl != NULL)
+		file_list_free(fl);
+	close(dirfd);
+	return (ret);
+}
+
+int
+tree_walk(int dirfd, tree_walk_cb *cb, void *arg)
+{
+	int fd;
+
+	/* The walk closes what it opens, so work on a private copy */
+	fd = openat(dirfd, ".", O_RDONLY | O_DIRECTORY);
+	if (fd < 0) {
+		warn("%s: openat", __func__);
+		return (-1);
+	}
+	return (tree_walk_dir(fd, "", cb, arg));
+}
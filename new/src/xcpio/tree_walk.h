@@ -0,0 +1,26 @@
+#ifndef	__TREE_WALK_H__
+#define	__TREE_WALK_H__
+
+/*
+ * Called for each entry found during a tree walk.
+ *
+ * dirfd is an open descriptor for the parent directory and name is
+ * the entry name within it, so callers can use the *at() calls
+ * without re-resolving the full path.  path is the full path
+ * relative to the walk root, suitable for storing in an archive.
+ *
+ * Return 0 to continue, -1 to abort the walk.
+ */
+typedef	int tree_walk_cb(void *arg, int dirfd, const char *name,
+	    const char *path, struct stat *sb);
+
+/*
+ * Walk the directory tree under dirfd, calling cb for every entry.
+ *
+ * Entries are visited parent-before-child and sorted by name within
+ * each directory so the walk order is reproducible.  Symlinks are
+ * reported but never followed.
+ */
+extern	int tree_walk(int dirfd, tree_walk_cb *cb, void *arg);
+
+#endif	/* __TREE_WALK_H__ */